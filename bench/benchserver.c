@@ -0,0 +1,135 @@
+/*
+ *  SCGI C Library
+ *
+ *  benchserver.c - Minimal SCGI server for benchmarking the library
+ *
+ *  Answers every request with a small fixed response, as fast as it can.  Unlike helloworld.c
+ *  it never sleeps (unless told to with -s), so what you measure is the library rather than
+ *  a usleep.  With -B n, it takes up to n requests at a time from scgi_recv_batch instead of one
+ *  at a time from scgi_recv.  With -C file, it records the traffic it gets (see scgi_capture_start)
+ *  for bench/scgireplay.  Press Ctrl-C to stop it and print the library's stats.
+ *
+ *  Build with "make bench", then point bench/scgibench at it.
+ *
+ *  Copyright/license:  MIT
+ */
+
+#include "scgilib.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static volatile sig_atomic_t stop;
+
+static void handle_sigint( int sig )
+{
+  (void) sig;
+  stop = 1;
+}
+
+static void print_histogram( const char *name, scgi_histogram *h )
+{
+  int i;
+
+  printf( "%s: %llu samples, mean %.1f usec\n", name, h->count,
+          h->count ? (double) h->sum_usecs / h->count : 0.0 );
+
+  for ( i = 0; i < SCGI_HISTOGRAM_BUCKETS; i++ )
+    if ( h->buckets[i] )
+      printf( "  < %llu usec: %llu\n", 1ULL << i, h->buckets[i] );
+}
+
+static void print_stats( void )
+{
+  scgi_stats s;
+  int i;
+
+  scgi_stats_snapshot( &s );
+
+  printf( "\nconnections accepted %llu, closed %llu; requests parsed %llu, recved %llu; responses flushed %llu\n",
+          s.connections_accepted, s.connections_closed, s.requests_parsed, s.requests_recved, s.responses_flushed );
+  printf( "bytes read %llu, written %llu; buffer resizes %llu\n", s.bytes_read, s.bytes_written, s.buffer_resizes );
+
+  for ( i = 0; i < SCGI_CLOSE_REASONS; i++ )
+    if ( s.closed_by_reason[i] )
+      printf( "closed (%s): %llu\n", scgi_close_reason_name( i ), s.closed_by_reason[i] );
+
+  print_histogram( "parse time", &s.parse_time );
+  print_histogram( "total time", &s.total_time );
+}
+
+int main( int argc, char **argv )
+{
+  static char response[] = "Status: 200 OK\r\nContent-Type: text/plain\r\n\r\nHello World!";
+  scgi_request **batch = NULL;
+  scgi_config cfg;
+  char *capture = NULL;
+  int opt, port = 8000, idle_sleep = 0, batch_size = 0, count, i;
+
+  scgi_config_defaults( &cfg );
+
+  while ( ( opt = getopt( argc, argv, "p:s:m:B:C:" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+      case 'p': port = atoi( optarg ); break;
+      case 's': idle_sleep = atoi( optarg ); break;
+      case 'm': cfg.max_inbuf_size = atoi( optarg ); break;
+      case 'B': batch_size = atoi( optarg ); break;
+      case 'C': capture = optarg; break;
+      default:
+        fprintf( stderr, "Usage: %s [-p port] [-s usecs to sleep when idle] [-m max input buffer bytes] [-B batch size] [-C capture file]\n", argv[0] );
+        return 1;
+    }
+  }
+
+  if ( !scgi_initialize_with_config( port, &cfg ) )
+  {
+    fprintf( stderr, "Could not listen on port %d.\n", port );
+    return 1;
+  }
+
+  if ( batch_size > 0 && !( batch = malloc( batch_size * sizeof(scgi_request *) ) ) )
+  {
+    fprintf( stderr, "Could not allocate a batch of %d requests.\n", batch_size );
+    return 1;
+  }
+
+  if ( capture && !scgi_capture_start( capture ) )
+  {
+    fprintf( stderr, "Could not create capture file %s.\n", capture );
+    return 1;
+  }
+
+  signal( SIGINT, handle_sigint );
+  signal( SIGTERM, handle_sigint );
+
+  printf( "benchserver listening on port %d\n", port );
+  fflush( stdout );
+
+  while ( !stop && batch )
+  {
+    count = scgi_recv_batch( batch, batch_size, 0 );
+
+    for ( i = 0; i < count; i++ )
+      scgi_send( batch[i], response, sizeof(response) - 1 );
+
+    if ( !count && idle_sleep )
+      usleep( idle_sleep );
+  }
+
+  while ( !stop && !batch )
+  {
+    scgi_request *req = scgi_recv();
+
+    if ( req )
+      scgi_send( req, response, sizeof(response) - 1 );
+    else if ( idle_sleep )
+      usleep( idle_sleep );
+  }
+
+  scgi_capture_stop();
+  print_stats();
+
+  return 0;
+}
@@ -0,0 +1,459 @@
+/*
+ *  SCGI C Library
+ *
+ *  loopbench.c - Kernel-free benchmark of the library's event loop
+ *
+ *  Does what bench/benchserver and bench/scgibench do together, but in one process and without
+ *  any sockets: requests go in through in-memory pipes (see scgi_pipe_connect) on a loopback
+ *  port, the event loop reads, parses and queues them, a fixed response goes back through
+ *  scgi_send, and the pipes are read until the library closes them.  So what's measured is the
+ *  library's own reading, parsing, dispatching and buffering, not the kernel's networking, and
+ *  the run is the same every time.  Every response is checked against the one that was sent;
+ *  the exit status is 2 if any of them didn't arrive intact (or if the regression checks run
+ *  before the benchmark fail: see check_cache_under_budget).
+ *
+ *  Build with "make bench".  See usage() below for the options.
+ *
+ *  Copyright/license:  MIT
+ */
+
+#include "scgilib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The loopback port's number (it only has to be different from any other port's)
+ */
+#define LOOPBENCH_PORT 1
+
+/*
+ * One of the concurrent pipes
+ */
+typedef struct LOOP_CONN
+{
+  scgi_pipe *pp;		// NULL if this one's idle
+  int sent;			// how much of the request we've written so far
+  int received;			// how much of the response we've read so far
+  int garbled;			// whether what we've read so far differs from the response
+} loop_conn;
+
+/*
+ * Headers which nginx sends with a typical request, in the order it sends them (the same
+ * as bench/scgibench's).  CONTENT_LENGTH and SCGI always come first; -H picks how many of the
+ * rest to send (and if -H asks for more than this, we make up extra X-Bench headers).
+ */
+static const char *nginx_headers[][2] =
+{
+  { "REQUEST_METHOD", "GET" },
+  { "REQUEST_URI", "/app/items/list?page=2&sort=name&filter=active" },
+  { "QUERY_STRING", "page=2&sort=name&filter=active" },
+  { "CONTENT_TYPE", "" },
+  { "DOCUMENT_URI", "/app/items/list" },
+  { "DOCUMENT_ROOT", "/var/www/html" },
+  { "SERVER_PROTOCOL", "HTTP/1.1" },
+  { "REQUEST_SCHEME", "https" },
+  { "HTTPS", "on" },
+  { "REMOTE_ADDR", "203.0.113.42" },
+  { "REMOTE_PORT", "53412" },
+  { "SERVER_PORT", "443" },
+  { "SERVER_NAME", "www.example.com" },
+  { "HTTP_HOST", "www.example.com" },
+  { "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0" },
+  { "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8" },
+  { "HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.5" },
+  { "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" },
+  { "HTTP_CONNECTION", "keep-alive" },
+  { "HTTP_COOKIE", "session=4f9a8b7c6d5e4f3a2b1c0d9e8f7a6b5c; theme=dark; lang=en" },
+  { "HTTP_UPGRADE_INSECURE_REQUESTS", "1" },
+  { "HTTP_SEC_FETCH_DEST", "document" },
+  { "HTTP_SEC_FETCH_MODE", "navigate" },
+  { "HTTP_CACHE_CONTROL", "max-age=0" }
+};
+
+#define NGINX_HEADER_COUNT ( (int) ( sizeof(nginx_headers) / sizeof(nginx_headers[0]) ) )
+
+static char response[] = "Status: 200 OK\r\nContent-Type: text/plain\r\n\r\nHello World!";
+
+#define RESPONSE_LEN ( (int) sizeof(response) - 1 )
+
+/*
+ * Options (see usage)
+ */
+static int opt_concurrency = 16;
+static int opt_requests = 100000;
+static int opt_headers = 16;
+static int opt_body = 0;
+static int opt_fragment = 0;
+static int opt_batch = 0;
+
+static char *request;		// the request we send down every pipe
+static int request_len;
+
+static long long now_nsecs( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return (long long) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void usage( const char *prog )
+{
+  fprintf( stderr,
+    "Usage: %s [options]\n"
+    "  -c n      concurrent pipes (default 16, at most SCGI_VIRTUAL_SLOTS)\n"
+    "  -n n      total requests (default 100000)\n"
+    "  -H n      headers per request, not counting CONTENT_LENGTH and SCGI (default 16)\n"
+    "  -b n      request body size in bytes; a nonzero body makes the requests POSTs (default 0)\n"
+    "  -f n      write each request in fragments of n bytes, one per pass of the event loop (default 0: all at once)\n"
+    "  -B n      take up to n requests at a time from scgi_recv_batch (default 0: one at a time from scgi_recv)\n",
+    prog );
+  exit( 1 );
+}
+
+/*
+ * Append a netstring-style header (name\0value\0) to buf, returning the new length
+ */
+static int add_header( char *buf, int len, const char *name, const char *value )
+{
+  int n = strlen( name ) + 1, v = strlen( value ) + 1;
+
+  memcpy( buf + len, name, n );
+  memcpy( buf + len + n, value, v );
+
+  return len + n + v;
+}
+
+/*
+ * Build the request every pipe will send: the SCGI netstring, then the body.
+ */
+static void build_request( void )
+{
+  char *headers, lenstr[32], name[64];
+  int i, len = 0, hlen;
+
+  headers = malloc( 4096 + opt_headers * 64 );
+
+  sprintf( lenstr, "%d", opt_body );
+  len = add_header( headers, len, "CONTENT_LENGTH", lenstr );
+  len = add_header( headers, len, "SCGI", "1" );
+
+  for ( i = 0; i < opt_headers; i++ )
+  {
+    if ( i < NGINX_HEADER_COUNT )
+    {
+      if ( i == 0 && opt_body > 0 )
+        len = add_header( headers, len, "REQUEST_METHOD", "POST" );
+      else
+        len = add_header( headers, len, nginx_headers[i][0], nginx_headers[i][1] );
+    }
+    else
+    {
+      sprintf( name, "HTTP_X_BENCH_%d", i - NGINX_HEADER_COUNT );
+      len = add_header( headers, len, name, "some-moderately-long-value-0123456789" );
+    }
+  }
+
+  hlen = sprintf( lenstr, "%d:", len );
+  request_len = hlen + len + 1 + opt_body;
+  request = malloc( request_len );
+  memcpy( request, lenstr, hlen );
+  memcpy( request + hlen, headers, len );
+  request[hlen + len] = ',';
+  memset( request + hlen + len + 1, 'x', opt_body );
+
+  free( headers );
+}
+
+/*
+ * Start a new request on a pipe slot
+ */
+static int start_pipe( loop_conn *c )
+{
+  c->pp = scgi_pipe_connect( LOOPBENCH_PORT );
+  if ( !c->pp )
+  {
+    fprintf( stderr, "Could not open a pipe (too many at once, or out of RAM).\n" );
+    return 0;
+  }
+
+  c->sent = 0;
+  c->received = 0;
+  c->garbled = 0;
+  return 1;
+}
+
+/*
+ * Send one GET for uri down a fresh pipe and run the event loop until the library closes it.
+ * Requests which reach us get fresh_response, and if cache_it is set, that goes in the
+ * response cache too.  What came back is left in out (up to size bytes); returns its length,
+ * or -1 if the connection didn't close as completed.
+ */
+static int exchange( char *uri, char *fresh_response, int cache_it, int *reached_us, char *out, int size )
+{
+  char headers[256], req[300], lenstr[16];
+  scgi_request *r;
+  scgi_pipe *pp;
+  int len = 0, hlen, n, got = 0, passes;
+
+  len = add_header( headers, len, "CONTENT_LENGTH", "0" );
+  len = add_header( headers, len, "SCGI", "1" );
+  len = add_header( headers, len, "REQUEST_METHOD", "GET" );
+  len = add_header( headers, len, "REQUEST_URI", uri );
+  len = add_header( headers, len, "HTTP_HOST", "www.example.com" );
+  hlen = sprintf( lenstr, "%d:", len );
+  memcpy( req, lenstr, hlen );
+  memcpy( req + hlen, headers, len );
+  req[hlen + len] = ',';
+
+  *reached_us = 0;
+
+  if ( ( pp = scgi_pipe_connect( LOOPBENCH_PORT ) ) == NULL
+  ||   !scgi_pipe_write( pp, req, hlen + len + 1 ) )
+    return -1;
+
+  for ( passes = 0; passes < 100; passes++ )
+  {
+    while ( ( r = scgi_recv() ) != NULL )
+    {
+      (*reached_us)++;
+      if ( cache_it )
+        scgi_cache_insert( r, fresh_response, strlen( fresh_response ), 60000 );
+      scgi_send( r, fresh_response, strlen( fresh_response ) );
+    }
+
+    while ( ( n = scgi_pipe_read( pp, out + got, size - got ) ) > 0 )
+      got += n;
+
+    if ( n == 0 )
+      break;
+  }
+
+  n = pp->close_reason == SCGI_CLOSE_COMPLETED ? got : -1;
+  scgi_pipe_close( pp );
+
+  return n;
+}
+
+/*
+ * A regression check, before the benchmark proper: a cache hit when the memory budget won't let
+ * the cached response be copied for sending.  That's to be treated as a miss (the request comes
+ * to us, and what we send is what they get), not answered with a 503 behind our back.
+ */
+static int check_cache_under_budget( void )
+{
+  static char cached[65536], fresh[] = "Status: 200 OK\r\n\r\nfresh", out[sizeof(cached)];
+  int n, reached_us, ok = 1;
+
+  memcpy( cached, "Status: 200 OK\r\n\r\n", 18 );
+  memset( cached + 18, 'c', sizeof(cached) - 19 );
+  cached[sizeof(cached) - 1] = '\0';
+
+  scgi_cache_set_budget( 1L << 20 );
+
+  /*
+   * Put it in the cache, and make sure it's served from there
+   */
+  n = exchange( "/cached", cached, 1, &reached_us, out, sizeof(out) );
+  if ( n != (int) strlen( cached ) || reached_us != 1 )
+    ok = 0;
+
+  n = exchange( "/cached", fresh, 0, &reached_us, out, sizeof(out) );
+  if ( n != (int) strlen( cached ) || memcmp( out, cached, n ) || reached_us != 0 )
+    ok = 0;
+
+  /*
+   * Now with hardly any room left: it's a miss, and what we send gets through intact
+   */
+  scgi_set_memory_budget( 0, scgi_memory_in_use() + 32768 );
+
+  n = exchange( "/cached", fresh, 0, &reached_us, out, sizeof(out) );
+  if ( n != (int) strlen( fresh ) || memcmp( out, fresh, n ) || reached_us != 1 )
+    ok = 0;
+
+  scgi_set_memory_budget( 0, 0 );
+  scgi_cache_set_budget( 0 );
+
+  printf( "Cache hit with the memory budget exhausted: %s\n", ok ? "ok" : "FAILED" );
+
+  return ok;
+}
+
+/*
+ * Answer every request the library has for us.  Like benchserver, just the fixed response.
+ */
+static void serve( scgi_request **batch )
+{
+  scgi_request *req;
+  int count, i;
+
+  if ( opt_batch > 0 )
+  {
+    count = scgi_recv_batch( batch, opt_batch, 0 );
+
+    for ( i = 0; i < count; i++ )
+      scgi_send( batch[i], response, RESPONSE_LEN );
+  }
+  else
+  {
+    while ( ( req = scgi_recv() ) != NULL )
+      scgi_send( req, response, RESPONSE_LEN );
+  }
+}
+
+int main( int argc, char **argv )
+{
+  scgi_request **batch = NULL;
+  scgi_config cfg;
+  scgi_stats stats;
+  loop_conn *conns;
+  long long start, elapsed, t, library = 0;
+  int opt, i, n, started = 0, done = 0, errors = 0, active = 0;
+  char junk[4096];
+
+  while ( ( opt = getopt( argc, argv, "c:n:H:b:f:B:" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+      case 'c': opt_concurrency = atoi( optarg ); break;
+      case 'n': opt_requests = atoi( optarg ); break;
+      case 'H': opt_headers = atoi( optarg ); break;
+      case 'b': opt_body = atoi( optarg ); break;
+      case 'f': opt_fragment = atoi( optarg ); break;
+      case 'B': opt_batch = atoi( optarg ); break;
+      default: usage( argv[0] );
+    }
+  }
+
+  if ( opt_concurrency < 1 || opt_concurrency > SCGI_VIRTUAL_SLOTS || opt_requests < 1
+  ||   opt_headers < 0 || opt_body < 0 || opt_fragment < 0 || opt_batch < 0 )
+    usage( argv[0] );
+
+  if ( opt_concurrency > opt_requests )
+    opt_concurrency = opt_requests;
+
+  scgi_config_defaults( &cfg );
+
+  build_request();
+
+  if ( cfg.max_inbuf_size < request_len + 1024 )
+    cfg.max_inbuf_size = request_len + 1024;
+
+  if ( !scgi_initialize_loopback( LOOPBENCH_PORT, &cfg ) )
+  {
+    fprintf( stderr, "Could not set up the loopback port.\n" );
+    return 1;
+  }
+
+  if ( !check_cache_under_budget() )
+    return 2;
+
+  if ( opt_batch > 0 )
+    batch = malloc( opt_batch * sizeof(scgi_request *) );
+  conns = calloc( opt_concurrency, sizeof(loop_conn) );
+
+  printf( "Sending %d requests of %d bytes (%d headers, %d byte body, fragments of %d) over %d pipes\n",
+          opt_requests, request_len, opt_headers + 2, opt_body, opt_fragment, opt_concurrency );
+
+  start = now_nsecs();
+
+  for ( i = 0; i < opt_concurrency; i++ )
+  {
+    if ( !start_pipe( &conns[i] ) )
+      return 1;
+    started++;
+    active++;
+  }
+
+  while ( active > 0 )
+  {
+    /*
+     * Write the requests (or the next fragment of each)
+     */
+    for ( i = 0; i < opt_concurrency; i++ )
+    {
+      loop_conn *c = &conns[i];
+      int chunk = request_len - c->sent;
+
+      if ( !c->pp || chunk <= 0 )
+        continue;
+
+      if ( opt_fragment > 0 && chunk > opt_fragment )
+        chunk = opt_fragment;
+
+      if ( scgi_pipe_write( c->pp, request + c->sent, chunk ) )
+        c->sent += chunk;
+    }
+
+    /*
+     * The library's turn
+     */
+    t = now_nsecs();
+    serve( batch );
+    library += now_nsecs() - t;
+
+    /*
+     * Read the responses, and check them
+     */
+    for ( i = 0; i < opt_concurrency; i++ )
+    {
+      loop_conn *c = &conns[i];
+
+      if ( !c->pp )
+        continue;
+
+      while ( ( n = scgi_pipe_read( c->pp, junk, sizeof(junk) ) ) > 0 )
+      {
+        if ( c->received + n > RESPONSE_LEN || memcmp( junk, response + c->received, n ) )
+          c->garbled = 1;
+        c->received += n;
+      }
+
+      if ( n < 0 )
+        continue;
+
+      if ( c->garbled || c->received != RESPONSE_LEN || c->pp->close_reason != SCGI_CLOSE_COMPLETED )
+        errors++;
+      else
+        done++;
+
+      scgi_pipe_close( c->pp );
+      c->pp = NULL;
+      active--;
+
+      if ( started < opt_requests )
+      {
+        if ( !start_pipe( c ) )
+          return 1;
+        started++;
+        active++;
+      }
+    }
+  }
+
+  elapsed = now_nsecs() - start;
+
+  printf( "Completed %d requests (%d errors) in %.3f s\n", done, errors, elapsed / 1e9 );
+  printf( "Throughput: %.1f req/s\n", done / ( elapsed / 1e9 ) );
+  printf( "Per request: %.0f ns in all, %.0f ns in the library\n",
+          (double) elapsed / opt_requests, (double) library / opt_requests );
+
+  if ( errors )
+  {
+    scgi_stats_snapshot( &stats );
+
+    for ( i = 0; i < SCGI_CLOSE_REASONS; i++ )
+      if ( stats.closed_by_reason[i] )
+        printf( "closed (%s): %llu\n", scgi_close_reason_name( i ), stats.closed_by_reason[i] );
+  }
+
+  free( conns );
+  free( batch );
+  free( request );
+
+  return errors ? 2 : 0;
+}
@@ -0,0 +1,460 @@
+/*
+ *  SCGI C Library
+ *
+ *  parsebench.c - In-memory benchmark and split-point fuzzer for the request parser
+ *
+ *  Feeds SCGI requests straight into the parser, without any sockets, and checks that the
+ *  outcome (what got parsed, or why the request was rejected) doesn't depend on how the
+ *  bytes were split up.  Then it times the parser on each profile and reports ns/request
+ *  and MB/s.  Exits with status 1 if any check fails, so it can be used as a regression gate.
+ *
+ *  The profiles are synthetic nginx-style requests with various numbers of headers, plus any
+ *  captured requests given on the command line (raw SCGI bytes, one request per file).
+ *
+ *  Build with "make bench".  Usage: bench/parsebench [-i iterations] [-s seed] [captured files...]
+ *
+ *  Copyright/license:  MIT
+ */
+
+#include "scgilib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Library internals we drive directly (they're declared in scgilib.c, not scgilib.h)
+ */
+int scgi_consume_input( scgi_desc *d, char *data, int len );
+
+extern scgi_request *first_scgi_unrecved_req;
+
+/*
+ * What happened when we fed a request to the parser
+ */
+typedef struct PARSE_OUTCOME
+{
+  int status;			// OUTCOME_PARSED, OUTCOME_REJECTED or OUTCOME_INCOMPLETE
+  int reason;			// if rejected, the SCGI_CLOSE_* reason
+  int headers;			// if parsed, how many headers
+  unsigned long hash;		// if parsed, hash of all the header names, values and the body
+} parse_outcome;
+
+typedef enum
+{
+  OUTCOME_PARSED, OUTCOME_REJECTED, OUTCOME_INCOMPLETE
+} types_of_parse_outcomes;
+
+/*
+ * A request to feed to the parser
+ */
+typedef struct PARSE_PROFILE
+{
+  char name[64];
+  char *data;
+  int len;
+  int must_parse;		// 1 if this is a valid request which must be parsed successfully
+} parse_profile;
+
+#define MAX_PROFILES 64
+
+static parse_profile profiles[MAX_PROFILES];
+static int profile_count;
+
+static scgi_port bench_port;
+static int last_close_reason;
+static int failures;
+static unsigned long long rng_state = 88172645463325252ULL;
+
+static unsigned long long rng( void )
+{
+  rng_state ^= rng_state << 13;
+  rng_state ^= rng_state >> 7;
+  rng_state ^= rng_state << 17;
+  return rng_state;
+}
+
+static void on_close( scgi_request *req, int reason, scgi_timings *timings )
+{
+  (void) req;
+  (void) timings;
+  last_close_reason = reason;
+}
+
+static unsigned long hash_bytes( unsigned long h, const char *s, int len )
+{
+  int i;
+
+  for ( i = 0; i < len; i++ )
+    h = ( h ^ (unsigned char) s[i] ) * 1099511628211UL;
+
+  return h;
+}
+
+/*
+ * Hand len bytes to the parser, the same way scgi_listen_to_request does after a recv.
+ * Returns 0 if the parser killed the connection.
+ */
+static int feed( scgi_desc *d, char *data, int len )
+{
+  return scgi_consume_input( d, data, len );
+}
+
+/*
+ * Feed a request to the parser in pieces (the pieces are given by a list of split points)
+ * and record the outcome.
+ */
+static void parse_with_splits( parse_profile *p, int *splits, int nsplits, parse_outcome *out )
+{
+  scgi_desc *d = scgi_new_connection( &bench_port, -1 );
+  int i, from = 0;
+
+  memset( out, 0, sizeof(*out) );
+
+  for ( i = 0; i <= nsplits; i++ )
+  {
+    int to = i < nsplits ? splits[i] : p->len;
+
+    if ( to <= from )
+      continue;
+
+    if ( !feed( d, p->data + from, to - from ) )
+    {
+      out->status = OUTCOME_REJECTED;
+      out->reason = last_close_reason;
+      return;
+    }
+
+    from = to;
+
+    if ( first_scgi_unrecved_req == d->req )
+      break;
+  }
+
+  if ( first_scgi_unrecved_req == d->req )
+  {
+    scgi_header *h;
+
+    out->status = OUTCOME_PARSED;
+    out->hash = 14695981039346656037UL;
+
+    for ( h = d->req->first_header; h; h = h->next )
+    {
+      out->hash = hash_bytes( out->hash, h->name, strlen( h->name ) + 1 );
+      out->hash = hash_bytes( out->hash, h->value, strlen( h->value ) + 1 );
+      out->headers++;
+    }
+
+    out->hash = hash_bytes( out->hash, d->req->body, d->req->scgi_content_length );
+  }
+  else
+    out->status = OUTCOME_INCOMPLETE;
+
+  scgi_kill_socket( d, SCGI_CLOSE_COMPLETED );
+}
+
+static void report_mismatch( parse_profile *p, const char *how, parse_outcome *want, parse_outcome *got )
+{
+  failures++;
+  fprintf( stderr, "FAIL %s (%s): expected status %d reason %d headers %d hash %lx, got status %d reason %d headers %d hash %lx\n",
+           p->name, how, want->status, want->reason, want->headers, want->hash,
+           got->status, got->reason, got->headers, got->hash );
+}
+
+static int same_outcome( parse_outcome *a, parse_outcome *b )
+{
+  if ( a->status != b->status )
+    return 0;
+  if ( a->status == OUTCOME_REJECTED )
+    return a->reason == b->reason;
+  if ( a->status == OUTCOME_PARSED )
+    return a->headers == b->headers && a->hash == b->hash;
+  return 1;
+}
+
+/*
+ * The parser must reach the same outcome whether it gets the request all at once, split at any
+ * single point, or chopped into random fragments.
+ */
+static void check_profile( parse_profile *p, int random_rounds )
+{
+  parse_outcome whole, split;
+  int splits[64], i, k;
+
+  parse_with_splits( p, NULL, 0, &whole );
+
+  if ( p->must_parse && whole.status != OUTCOME_PARSED )
+  {
+    failures++;
+    fprintf( stderr, "FAIL %s: valid request was not parsed (status %d, reason %s)\n",
+             p->name, whole.status, scgi_close_reason_name( whole.reason ) );
+    return;
+  }
+
+  /*
+   * Every split point in the first 4 KB (where the headers usually are), then every 97th
+   * byte, so that big profiles don't take quadratic time
+   */
+  for ( k = 1; k < p->len; k += k < 4096 ? 1 : 97 )
+  {
+    splits[0] = k;
+    parse_with_splits( p, splits, 1, &split );
+    if ( !same_outcome( &whole, &split ) )
+    {
+      char how[64];
+
+      sprintf( how, "split at %d", k );
+      report_mismatch( p, how, &whole, &split );
+      return;
+    }
+  }
+
+  for ( i = 0; i < random_rounds; i++ )
+  {
+    int n = 1 + rng() % 63;
+
+    for ( k = 0; k < n; k++ )
+      splits[k] = rng() % ( p->len + 1 );
+
+    /*
+     * Sort the split points (insertion sort, there are at most 63 of them)
+     */
+    for ( k = 1; k < n; k++ )
+    {
+      int v = splits[k], j = k - 1;
+
+      while ( j >= 0 && splits[j] > v )
+      {
+        splits[j + 1] = splits[j];
+        j--;
+      }
+      splits[j + 1] = v;
+    }
+
+    parse_with_splits( p, splits, n, &split );
+    if ( !same_outcome( &whole, &split ) )
+    {
+      report_mismatch( p, "random fragments", &whole, &split );
+      return;
+    }
+  }
+}
+
+/*
+ * Fuzz: flip random bytes in a valid request.  The result may well be rejected, but it
+ * must be rejected (or accepted) the same way no matter how it's split.
+ */
+static void fuzz_profile( parse_profile *p, int rounds )
+{
+  parse_profile mutant;
+  int i, j;
+
+  mutant.len = p->len;
+  mutant.must_parse = 0;
+  mutant.data = malloc( p->len );
+  sprintf( mutant.name, "%.40s (mutated)", p->name );
+
+  for ( i = 0; i < rounds && !failures; i++ )
+  {
+    memcpy( mutant.data, p->data, p->len );
+
+    for ( j = 1 + rng() % 3; j > 0; j-- )
+    {
+      static const char interesting[] = { '\0', ':', ',', '0', '9', 'A' };
+      int pos = rng() % p->len;
+
+      mutant.data[pos] = rng() % 2 ? (char) rng() : interesting[rng() % sizeof(interesting)];
+    }
+
+    check_profile( &mutant, 4 );
+  }
+
+  free( mutant.data );
+}
+
+static int add_header( char *buf, int len, const char *name, const char *value )
+{
+  int n = strlen( name ) + 1, v = strlen( value ) + 1;
+
+  memcpy( buf + len, name, n );
+  memcpy( buf + len + n, value, v );
+
+  return len + n + v;
+}
+
+/*
+ * Make a synthetic nginx-style request with the given number of headers and body size
+ */
+static void add_synthetic_profile( int headers, int body )
+{
+  static const char *common[][2] =
+  {
+    { "REQUEST_METHOD", "POST" }, { "REQUEST_URI", "/app/items/list?page=2&sort=name" },
+    { "QUERY_STRING", "page=2&sort=name" }, { "CONTENT_TYPE", "application/x-www-form-urlencoded" },
+    { "SERVER_PROTOCOL", "HTTP/1.1" }, { "REMOTE_ADDR", "203.0.113.42" }, { "SERVER_PORT", "443" },
+    { "HTTP_HOST", "www.example.com" },
+    { "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0" },
+    { "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" }, { "HTTP_COOKIE", "session=4f9a8b7c6d5e4f3a; theme=dark" }
+  };
+  parse_profile *p = &profiles[profile_count++];
+  char *hdrs, lenstr[32], name[64];
+  int i, len = 0, hlen;
+
+  hdrs = malloc( 1024 + headers * 96 );
+
+  sprintf( lenstr, "%d", body );
+  len = add_header( hdrs, len, "CONTENT_LENGTH", lenstr );
+  len = add_header( hdrs, len, "SCGI", "1" );
+
+  for ( i = 0; i < headers; i++ )
+  {
+    if ( i < (int) ( sizeof(common) / sizeof(common[0]) ) )
+      len = add_header( hdrs, len, common[i][0], common[i][1] );
+    else
+    {
+      sprintf( name, "HTTP_X_CUSTOM_HEADER_%d", i );
+      len = add_header( hdrs, len, name, "a-moderately-long-header-value-0123456789abcdef" );
+    }
+  }
+
+  hlen = sprintf( lenstr, "%d:", len );
+  p->len = hlen + len + 1 + body;
+  p->data = malloc( p->len );
+  memcpy( p->data, lenstr, hlen );
+  memcpy( p->data + hlen, hdrs, len );
+  p->data[hlen + len] = ',';
+  for ( i = 0; i < body; i++ )
+    p->data[hlen + len + 1 + i] = 'a' + i % 26;
+  p->must_parse = 1;
+  sprintf( p->name, "%d headers, %d byte body", headers + 2, body );
+
+  free( hdrs );
+}
+
+/*
+ * Some requests which must be rejected, and why
+ */
+static void add_invalid_profile( const char *name, const char *data, int len )
+{
+  parse_profile *p = &profiles[profile_count++];
+
+  p->data = malloc( len );
+  memcpy( p->data, data, len );
+  p->len = len;
+  p->must_parse = 0;
+  sprintf( p->name, "invalid: %.50s", name );
+}
+
+static int add_captured_profile( const char *path )
+{
+  parse_profile *p = &profiles[profile_count];
+  FILE *fp = fopen( path, "rb" );
+  long len;
+
+  if ( !fp )
+  {
+    perror( path );
+    return 0;
+  }
+
+  fseek( fp, 0, SEEK_END );
+  len = ftell( fp );
+  fseek( fp, 0, SEEK_SET );
+
+  p->data = malloc( len > 0 ? len : 1 );
+  p->len = fread( p->data, 1, len, fp );
+  p->must_parse = 1;
+  sprintf( p->name, "captured: %.50s", path );
+  fclose( fp );
+
+  profile_count++;
+  return 1;
+}
+
+/*
+ * Time the parser on a profile, fed all at once and in 536-byte fragments (a typical TCP
+ * segment size on the internet at large)
+ */
+static void time_profile( parse_profile *p, int iterations )
+{
+  int fragments, i, k, splits[1024], nsplits = 0;
+
+  for ( k = 536; k < p->len && nsplits < 1024; k += 536 )
+    splits[nsplits++] = k;
+
+  for ( fragments = 0; fragments < 2; fragments++ )
+  {
+    parse_outcome out;
+    long long start, elapsed;
+
+    start = scgi_now_usecs();
+    for ( i = 0; i < iterations; i++ )
+      parse_with_splits( p, splits, fragments ? nsplits : 0, &out );
+    elapsed = scgi_now_usecs() - start;
+
+    printf( "  %-40s %-10s %9.0f ns/req %9.1f MB/s\n", p->name, fragments ? "fragmented" : "whole",
+            elapsed * 1000.0 / iterations, (double) p->len * iterations / ( elapsed > 0 ? elapsed : 1 ) );
+  }
+}
+
+int main( int argc, char **argv )
+{
+  static const int header_counts[] = { 0, 8, 16, 32, 64, 256 };
+  int opt, i, iterations = 20000;
+
+  while ( ( opt = getopt( argc, argv, "i:s:" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+      case 'i': iterations = atoi( optarg ); break;
+      case 's': rng_state = strtoull( optarg, NULL, 10 ) | 1; break;
+      default:
+        fprintf( stderr, "Usage: %s [-i iterations] [-s seed] [captured request files...]\n", argv[0] );
+        return 1;
+    }
+  }
+
+  scgi_config_defaults( &bench_port.config );
+  bench_port.config.max_inbuf_size = 1 << 24;
+  bench_port.port = -1;
+  bench_port.sock = -1;
+  scgi_set_close_hook( on_close );
+
+  for ( i = 0; i < (int) ( sizeof(header_counts) / sizeof(header_counts[0]) ); i++ )
+    add_synthetic_profile( header_counts[i], 0 );
+  add_synthetic_profile( 16, 1000 );
+  add_synthetic_profile( 16, 40000 );
+
+  for ( i = optind; i < argc && profile_count < MAX_PROFILES - 8; i++ )
+    if ( !add_captured_profile( argv[i] ) )
+      return 1;
+
+  add_invalid_profile( "leading zero", "0:,", 3 );
+  add_invalid_profile( "non-numeric length", "1x:CONTENT_LENGTH\0" "0\0,", 21 );
+  add_invalid_profile( "no SCGI header", "18:CONTENT_LENGTH\0" "0\0,", 22 );
+  add_invalid_profile( "CONTENT_LENGTH not first", "24:SCGI\0" "1\0CONTENT_LENGTH\0" "0\0,", 28 );
+  add_invalid_profile( "empty header name", "27:CONTENT_LENGTH\0" "0\0\0x\0SCGI\0" "1\0,", 31 );
+  add_invalid_profile( "missing comma", "25:CONTENT_LENGTH\0" "0\0SCGI\0" "1\0;", 29 );
+
+  printf( "Checking %d profiles at every split point and at random fragment sizes...\n", profile_count );
+
+  for ( i = 0; i < profile_count; i++ )
+  {
+    check_profile( &profiles[i], 200 );
+    if ( profiles[i].must_parse && profiles[i].len < 4096 )
+      fuzz_profile( &profiles[i], 100 );
+  }
+
+  if ( failures )
+  {
+    printf( "%d failures.\n", failures );
+    return 1;
+  }
+
+  printf( "All checks passed.\n\nTiming (%d iterations per profile):\n", iterations );
+
+  for ( i = 0; i < profile_count; i++ )
+    if ( profiles[i].must_parse )
+      time_profile( &profiles[i], iterations );
+
+  return 0;
+}
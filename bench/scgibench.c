@@ -0,0 +1,374 @@
+/*
+ *  SCGI C Library
+ *
+ *  scgibench.c - SCGI load generator
+ *
+ *  Opens many concurrent connections to an SCGI server (for instance bench/benchserver, which is
+ *  built on the SCGI C Library), sends each one an nginx-style SCGI request, reads the response
+ *  until the server hangs up, and reports requests per second and latency percentiles.
+ *
+ *  Build with "make bench".  Run with no arguments to benchmark a server on port 8000, or see
+ *  usage() below for the options.
+ *
+ *  Copyright/license:  MIT
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Different states of a benchmark connection
+ */
+typedef enum
+{
+  BENCH_IDLE, BENCH_CONNECTING, BENCH_SENDING, BENCH_READING
+} types_of_states_for_bench_connections;
+
+/*
+ * One of the concurrent connections
+ */
+typedef struct BENCH_CONN
+{
+  int sock;
+  int state;
+  int sent;			// how much of the request we've sent so far
+  int received;			// how much of the response we've read so far
+  long long started;		// when we started connecting (microseconds)
+} bench_conn;
+
+/*
+ * Headers which nginx sends with a typical request, in the order it sends them.
+ * CONTENT_LENGTH and SCGI always come first; -H picks how many of the rest to send
+ * (and if -H asks for more than this, we make up extra X-Bench headers).
+ */
+static const char *nginx_headers[][2] =
+{
+  { "REQUEST_METHOD", "GET" },
+  { "REQUEST_URI", "/app/items/list?page=2&sort=name&filter=active" },
+  { "QUERY_STRING", "page=2&sort=name&filter=active" },
+  { "CONTENT_TYPE", "" },
+  { "DOCUMENT_URI", "/app/items/list" },
+  { "DOCUMENT_ROOT", "/var/www/html" },
+  { "SERVER_PROTOCOL", "HTTP/1.1" },
+  { "REQUEST_SCHEME", "https" },
+  { "HTTPS", "on" },
+  { "REMOTE_ADDR", "203.0.113.42" },
+  { "REMOTE_PORT", "53412" },
+  { "SERVER_PORT", "443" },
+  { "SERVER_NAME", "www.example.com" },
+  { "HTTP_HOST", "www.example.com" },
+  { "HTTP_USER_AGENT", "Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/118.0" },
+  { "HTTP_ACCEPT", "text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8" },
+  { "HTTP_ACCEPT_LANGUAGE", "en-US,en;q=0.5" },
+  { "HTTP_ACCEPT_ENCODING", "gzip, deflate, br" },
+  { "HTTP_CONNECTION", "keep-alive" },
+  { "HTTP_COOKIE", "session=4f9a8b7c6d5e4f3a2b1c0d9e8f7a6b5c; theme=dark; lang=en" },
+  { "HTTP_UPGRADE_INSECURE_REQUESTS", "1" },
+  { "HTTP_SEC_FETCH_DEST", "document" },
+  { "HTTP_SEC_FETCH_MODE", "navigate" },
+  { "HTTP_CACHE_CONTROL", "max-age=0" }
+};
+
+#define NGINX_HEADER_COUNT ( (int) ( sizeof(nginx_headers) / sizeof(nginx_headers[0]) ) )
+
+/*
+ * Options (see usage)
+ */
+static const char *opt_host = "127.0.0.1";
+static int opt_port = 8000;
+static int opt_concurrency = 16;
+static int opt_requests = 10000;
+static int opt_headers = 16;
+static int opt_body = 0;
+static int opt_fragment = 0;
+
+static char *request;		// the request we send on every connection
+static int request_len;
+
+static long long now_usecs( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage( const char *prog )
+{
+  fprintf( stderr,
+    "Usage: %s [options]\n"
+    "  -a addr   server address (default 127.0.0.1)\n"
+    "  -p port   server port (default 8000)\n"
+    "  -c n      concurrent connections (default 16)\n"
+    "  -n n      total requests (default 10000)\n"
+    "  -H n      headers per request, not counting CONTENT_LENGTH and SCGI (default 16)\n"
+    "  -b n      request body size in bytes; a nonzero body makes the requests POSTs (default 0)\n"
+    "  -f n      send each request in fragments of n bytes, one per poll (default 0: all at once)\n",
+    prog );
+  exit( 1 );
+}
+
+/*
+ * Append a netstring-style header (name\0value\0) to buf, returning the new length
+ */
+static int add_header( char *buf, int len, const char *name, const char *value )
+{
+  int n = strlen( name ) + 1, v = strlen( value ) + 1;
+
+  memcpy( buf + len, name, n );
+  memcpy( buf + len + n, value, v );
+
+  return len + n + v;
+}
+
+/*
+ * Build the request every connection will send: the SCGI netstring, then the body.
+ */
+static void build_request( void )
+{
+  char *headers, lenstr[32], name[64];
+  int i, len = 0, hlen;
+
+  headers = malloc( 4096 + opt_headers * 64 );
+
+  sprintf( lenstr, "%d", opt_body );
+  len = add_header( headers, len, "CONTENT_LENGTH", lenstr );
+  len = add_header( headers, len, "SCGI", "1" );
+
+  for ( i = 0; i < opt_headers; i++ )
+  {
+    if ( i < NGINX_HEADER_COUNT )
+    {
+      if ( i == 0 && opt_body > 0 )
+        len = add_header( headers, len, "REQUEST_METHOD", "POST" );
+      else
+        len = add_header( headers, len, nginx_headers[i][0], nginx_headers[i][1] );
+    }
+    else
+    {
+      sprintf( name, "HTTP_X_BENCH_%d", i - NGINX_HEADER_COUNT );
+      len = add_header( headers, len, name, "some-moderately-long-value-0123456789" );
+    }
+  }
+
+  hlen = sprintf( lenstr, "%d:", len );
+  request_len = hlen + len + 1 + opt_body;
+  request = malloc( request_len );
+  memcpy( request, lenstr, hlen );
+  memcpy( request + hlen, headers, len );
+  request[hlen + len] = ',';
+  memset( request + hlen + len + 1, 'x', opt_body );
+
+  free( headers );
+}
+
+/*
+ * Start a new request on a connection slot
+ */
+static int start_connection( bench_conn *c, struct sockaddr_in *addr )
+{
+  int one = 1;
+
+  c->sock = socket( AF_INET, SOCK_STREAM, 0 );
+  if ( c->sock < 0 )
+  {
+    perror( "socket" );
+    return 0;
+  }
+
+  fcntl( c->sock, F_SETFL, O_NONBLOCK );
+  setsockopt( c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+
+  c->started = now_usecs();
+  c->sent = 0;
+  c->received = 0;
+
+  if ( connect( c->sock, (struct sockaddr *) addr, sizeof(*addr) ) < 0 && errno != EINPROGRESS )
+  {
+    perror( "connect" );
+    close( c->sock );
+    return 0;
+  }
+
+  c->state = BENCH_CONNECTING;
+  return 1;
+}
+
+static int compare_latencies( const void *a, const void *b )
+{
+  long long x = *(const long long *) a, y = *(const long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static long long percentile( long long *sorted, int n, double pct )
+{
+  int i;
+
+  if ( n == 0 )
+    return 0;
+
+  i = (int) ( pct / 100.0 * n );
+  if ( i >= n )
+    i = n - 1;
+
+  return sorted[i];
+}
+
+int main( int argc, char **argv )
+{
+  struct sockaddr_in addr;
+  struct pollfd *pfds;
+  bench_conn *conns;
+  long long *latencies, start, elapsed;
+  int opt, i, started = 0, done = 0, errors = 0, active = 0;
+  char junk[65536];
+
+  while ( ( opt = getopt( argc, argv, "a:p:c:n:H:b:f:" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+      case 'a': opt_host = optarg; break;
+      case 'p': opt_port = atoi( optarg ); break;
+      case 'c': opt_concurrency = atoi( optarg ); break;
+      case 'n': opt_requests = atoi( optarg ); break;
+      case 'H': opt_headers = atoi( optarg ); break;
+      case 'b': opt_body = atoi( optarg ); break;
+      case 'f': opt_fragment = atoi( optarg ); break;
+      default: usage( argv[0] );
+    }
+  }
+
+  if ( opt_concurrency < 1 || opt_requests < 1 || opt_headers < 0 || opt_body < 0 || opt_fragment < 0 )
+    usage( argv[0] );
+
+  if ( opt_concurrency > opt_requests )
+    opt_concurrency = opt_requests;
+
+  memset( &addr, 0, sizeof(addr) );
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons( opt_port );
+  if ( inet_pton( AF_INET, opt_host, &addr.sin_addr ) != 1 )
+    usage( argv[0] );
+
+  build_request();
+
+  conns = calloc( opt_concurrency, sizeof(bench_conn) );
+  pfds = calloc( opt_concurrency, sizeof(struct pollfd) );
+  latencies = calloc( opt_requests, sizeof(long long) );
+
+  printf( "Sending %d requests of %d bytes (%d headers, %d byte body, fragments of %d) over %d connections to %s:%d\n",
+          opt_requests, request_len, opt_headers + 2, opt_body, opt_fragment, opt_concurrency, opt_host, opt_port );
+
+  start = now_usecs();
+
+  for ( i = 0; i < opt_concurrency; i++ )
+  {
+    if ( !start_connection( &conns[i], &addr ) )
+      return 1;
+    started++;
+    active++;
+  }
+
+  while ( active > 0 )
+  {
+    for ( i = 0; i < opt_concurrency; i++ )
+    {
+      pfds[i].fd = conns[i].state == BENCH_IDLE ? -1 : conns[i].sock;
+      pfds[i].events = conns[i].state == BENCH_READING ? POLLIN : POLLOUT;
+      pfds[i].revents = 0;
+    }
+
+    if ( poll( pfds, opt_concurrency, 1000 ) < 0 )
+    {
+      perror( "poll" );
+      return 1;
+    }
+
+    for ( i = 0; i < opt_concurrency; i++ )
+    {
+      bench_conn *c = &conns[i];
+      int n, finished = 0, failed = 0;
+
+      if ( !pfds[i].revents )
+        continue;
+
+      if ( c->state == BENCH_CONNECTING || c->state == BENCH_SENDING )
+      {
+        int chunk = request_len - c->sent;
+
+        if ( opt_fragment > 0 && chunk > opt_fragment )
+          chunk = opt_fragment;
+
+        c->state = BENCH_SENDING;
+        n = send( c->sock, request + c->sent, chunk, MSG_NOSIGNAL );
+        if ( n > 0 )
+        {
+          c->sent += n;
+          if ( c->sent == request_len )
+            c->state = BENCH_READING;
+        }
+        else if ( n < 0 && errno != EAGAIN )
+          failed = 1;
+      }
+      else if ( c->state == BENCH_READING )
+      {
+        n = recv( c->sock, junk, sizeof(junk), 0 );
+        if ( n > 0 )
+          c->received += n;
+        else if ( n == 0 )
+        {
+          if ( c->received > 0 )
+            finished = 1;
+          else
+            failed = 1;
+        }
+        else if ( errno != EAGAIN )
+          failed = 1;
+      }
+
+      if ( !finished && !failed )
+        continue;
+
+      close( c->sock );
+      c->state = BENCH_IDLE;
+      active--;
+
+      if ( finished )
+        latencies[done++] = now_usecs() - c->started;
+      else
+        errors++;
+
+      if ( started < opt_requests )
+      {
+        if ( !start_connection( c, &addr ) )
+          return 1;
+        started++;
+        active++;
+      }
+    }
+  }
+
+  elapsed = now_usecs() - start;
+
+  qsort( latencies, done, sizeof(long long), compare_latencies );
+
+  printf( "Completed %d requests (%d errors) in %.3f s\n", done, errors, elapsed / 1e6 );
+  printf( "Throughput: %.1f req/s\n", done / ( elapsed / 1e6 ) );
+  printf( "Latency (usec): p50 %lld  p99 %lld  p999 %lld  max %lld\n",
+          percentile( latencies, done, 50 ), percentile( latencies, done, 99 ),
+          percentile( latencies, done, 99.9 ), done ? latencies[done - 1] : 0 );
+
+  return errors ? 2 : 0;
+}
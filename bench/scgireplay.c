@@ -0,0 +1,598 @@
+/*
+ *  SCGI C Library
+ *
+ *  scgireplay.c - Play back captured SCGI traffic
+ *
+ *  Reads a capture file written by a server which called scgi_capture_start, and sends the same
+ *  bytes to an SCGI server, over the same number of connections, in the same fragments, and (unless
+ *  told otherwise) with the same timing.  Like scgibench, it reads each response until the server
+ *  hangs up, and reports requests per second and latency percentiles.  It can save those results
+ *  to a file, and compare against results saved earlier, so that one version of a server can be
+ *  measured against another on the same traffic.
+ *
+ *  Build with "make bench", or see usage() below for the options.
+ *
+ *  Copyright/license:  MIT
+ */
+
+#include "scgilib.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Different states of a replayed connection
+ */
+typedef enum
+{
+  REPLAY_WAITING, REPLAY_CONNECTING, REPLAY_SENDING, REPLAY_READING, REPLAY_FINISHED
+} types_of_states_for_replay_connections;
+
+/*
+ * One chunk of input, as the capturing server's recv got it
+ */
+typedef struct REPLAY_CHUNK
+{
+  long long at;			// when it arrived, in microseconds since the capture started
+  char *data;			// points into the capture file
+  int len;
+  int next;			// index of the connection's next chunk, or -1
+} replay_chunk;
+
+/*
+ * One of the captured connections
+ */
+typedef struct REPLAY_CONN
+{
+  unsigned long long id;	// its number in the capture file
+  int first_chunk;
+  int last_chunk;
+  int chunk;			// which chunk we're sending, or -1 when we've sent them all
+  int sent;			// how much of that chunk we've sent so far
+  int sock;
+  int state;
+  int received;			// how much of the response we've read so far
+  long long started;		// when we started connecting (microseconds)
+} replay_conn;
+
+/*
+ * The results of a replay, as saved by -o and compared by -B
+ */
+typedef struct REPLAY_RESULTS
+{
+  double requests;
+  double errors;
+  double seconds;
+  double throughput;
+  double p50;
+  double p99;
+  double p999;
+  double max;
+} replay_results;
+
+/*
+ * Options (see usage)
+ */
+static const char *opt_host = "127.0.0.1";
+static int opt_port = 8000;
+static double opt_speed = 1;
+static int opt_concurrency = 256;
+static const char *opt_save;
+static const char *opt_baseline;
+
+static replay_chunk *chunks;
+static int chunk_count;
+static replay_conn *conns;
+static int conn_count;
+
+static long long now_usecs( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void usage( const char *prog )
+{
+  fprintf( stderr,
+    "Usage: %s [options] capture-file\n"
+    "  -a addr   server address (default 127.0.0.1)\n"
+    "  -p port   server port (default 8000)\n"
+    "  -x n      play back n times as fast as it was captured; 0 means as fast as possible (default 1)\n"
+    "  -c n      at most n connections at once (default 256)\n"
+    "  -o file   save the results to file\n"
+    "  -B file   compare the results with ones saved earlier by -o\n",
+    prog );
+  exit( 1 );
+}
+
+/*
+ * Read a varint (see SCGI_CAPTURE_MAGIC in scgilib.h) from *p, not going past end.
+ * Returns 0 if it's cut off.
+ */
+static int read_varint( unsigned char **p, unsigned char *end, unsigned long long *out )
+{
+  int shift = 0;
+
+  *out = 0;
+
+  while ( *p < end && shift < 64 )
+  {
+    unsigned char byte = *(*p)++;
+
+    *out |= (unsigned long long) ( byte & 0x7f ) << shift;
+    if ( !( byte & 0x80 ) )
+      return 1;
+    shift += 7;
+  }
+
+  return 0;
+}
+
+/*
+ * Find the connection with the given number, adding it if it's new.
+ * Connections appear in the file in order of their first chunk, so the one we want is usually
+ * among the last few; look there first.
+ */
+static replay_conn *find_conn( unsigned long long id )
+{
+  static int capacity;
+  int i;
+
+  for ( i = conn_count - 1; i >= 0; i-- )
+    if ( conns[i].id == id )
+      return &conns[i];
+
+  if ( conn_count == capacity )
+  {
+    capacity = capacity ? capacity * 2 : 1024;
+    conns = realloc( conns, capacity * sizeof(replay_conn) );
+    if ( !conns )
+    {
+      fprintf( stderr, "Out of memory\n" );
+      exit( 1 );
+    }
+  }
+
+  memset( &conns[conn_count], 0, sizeof(replay_conn) );
+  conns[conn_count].id = id;
+  conns[conn_count].first_chunk = -1;
+  conns[conn_count].last_chunk = -1;
+  conns[conn_count].sock = -1;
+
+  return &conns[conn_count++];
+}
+
+/*
+ * Read the capture file into memory, and sort its chunks out by connection
+ */
+static void load_capture( const char *filename )
+{
+  unsigned char *buf, *p, *end;
+  unsigned long long id, delta, len;
+  long long at = 0;
+  int capacity = 0;
+  long size;
+  FILE *fp;
+
+  if ( !( fp = fopen( filename, "rb" ) ) )
+  {
+    perror( filename );
+    exit( 1 );
+  }
+
+  fseek( fp, 0, SEEK_END );
+  size = ftell( fp );
+  rewind( fp );
+
+  buf = malloc( size > 0 ? size : 1 );
+  if ( !buf || (long) fread( buf, 1, size, fp ) != size )
+  {
+    fprintf( stderr, "Couldn't read %s\n", filename );
+    exit( 1 );
+  }
+  fclose( fp );
+
+  if ( size < SCGI_CAPTURE_MAGIC_LEN || memcmp( buf, SCGI_CAPTURE_MAGIC, SCGI_CAPTURE_MAGIC_LEN ) )
+  {
+    fprintf( stderr, "%s isn't an SCGI capture file\n", filename );
+    exit( 1 );
+  }
+
+  p = buf + SCGI_CAPTURE_MAGIC_LEN;
+  end = buf + size;
+
+  while ( p < end )
+  {
+    replay_conn *c;
+
+    if ( !read_varint( &p, end, &id ) || !read_varint( &p, end, &delta ) || !read_varint( &p, end, &len )
+    ||   len > (unsigned long long) ( end - p ) || len == 0 )
+    {
+      /*
+       * The server may have been killed in the middle of writing a record; use what we've got
+       */
+      fprintf( stderr, "Warning: %s ends with an incomplete record, ignoring it\n", filename );
+      break;
+    }
+
+    if ( chunk_count == capacity )
+    {
+      capacity = capacity ? capacity * 2 : 4096;
+      chunks = realloc( chunks, capacity * sizeof(replay_chunk) );
+      if ( !chunks )
+      {
+        fprintf( stderr, "Out of memory\n" );
+        exit( 1 );
+      }
+    }
+
+    at += delta;
+    chunks[chunk_count].at = at;
+    chunks[chunk_count].data = (char *) p;
+    chunks[chunk_count].len = (int) len;
+    chunks[chunk_count].next = -1;
+    p += len;
+
+    c = find_conn( id );
+    if ( c->last_chunk >= 0 )
+      chunks[c->last_chunk].next = chunk_count;
+    else
+      c->first_chunk = chunk_count;
+    c->last_chunk = chunk_count;
+
+    chunk_count++;
+  }
+}
+
+/*
+ * When a chunk is due to be sent, in microseconds since we started
+ */
+static long long due( int chunk )
+{
+  if ( opt_speed <= 0 )
+    return 0;
+
+  return (long long) ( ( chunks[chunk].at - chunks[0].at ) / opt_speed );
+}
+
+/*
+ * Start replaying a connection
+ */
+static int start_connection( replay_conn *c, struct sockaddr_in *addr )
+{
+  int one = 1;
+
+  c->sock = socket( AF_INET, SOCK_STREAM, 0 );
+  if ( c->sock < 0 )
+  {
+    perror( "socket" );
+    return 0;
+  }
+
+  fcntl( c->sock, F_SETFL, O_NONBLOCK );
+  setsockopt( c->sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+
+  c->started = now_usecs();
+  c->chunk = c->first_chunk;
+  c->sent = 0;
+  c->received = 0;
+
+  if ( connect( c->sock, (struct sockaddr *) addr, sizeof(*addr) ) < 0 && errno != EINPROGRESS )
+  {
+    perror( "connect" );
+    close( c->sock );
+    return 0;
+  }
+
+  c->state = REPLAY_CONNECTING;
+  return 1;
+}
+
+static int compare_latencies( const void *a, const void *b )
+{
+  long long x = *(const long long *) a, y = *(const long long *) b;
+
+  return x < y ? -1 : x > y;
+}
+
+static long long percentile( long long *sorted, int n, double pct )
+{
+  int i;
+
+  if ( n == 0 )
+    return 0;
+
+  i = (int) ( pct / 100.0 * n );
+  if ( i >= n )
+    i = n - 1;
+
+  return sorted[i];
+}
+
+static void save_results( const char *filename, replay_results *r )
+{
+  FILE *fp = fopen( filename, "w" );
+
+  if ( !fp )
+  {
+    perror( filename );
+    return;
+  }
+
+  fprintf( fp, "requests %.0f\nerrors %.0f\nseconds %.6f\nthroughput %.1f\np50 %.0f\np99 %.0f\np999 %.0f\nmax %.0f\n",
+           r->requests, r->errors, r->seconds, r->throughput, r->p50, r->p99, r->p999, r->max );
+  fclose( fp );
+}
+
+static int load_results( const char *filename, replay_results *r )
+{
+  FILE *fp = fopen( filename, "r" );
+  char name[32];
+  double value;
+
+  if ( !fp )
+  {
+    perror( filename );
+    return 0;
+  }
+
+  memset( r, 0, sizeof(*r) );
+
+  while ( fscanf( fp, "%31s %lf", name, &value ) == 2 )
+  {
+    if ( !strcmp( name, "requests" ) ) r->requests = value;
+    else if ( !strcmp( name, "errors" ) ) r->errors = value;
+    else if ( !strcmp( name, "seconds" ) ) r->seconds = value;
+    else if ( !strcmp( name, "throughput" ) ) r->throughput = value;
+    else if ( !strcmp( name, "p50" ) ) r->p50 = value;
+    else if ( !strcmp( name, "p99" ) ) r->p99 = value;
+    else if ( !strcmp( name, "p999" ) ) r->p999 = value;
+    else if ( !strcmp( name, "max" ) ) r->max = value;
+  }
+
+  fclose( fp );
+  return 1;
+}
+
+static void compare_one( const char *name, double before, double after )
+{
+  if ( before != 0 )
+    printf( "  %-12s %12.1f %12.1f %+8.1f%%\n", name, before, after, ( after - before ) / before * 100 );
+  else
+    printf( "  %-12s %12.1f %12.1f\n", name, before, after );
+}
+
+static void compare_results( replay_results *before, replay_results *after )
+{
+  printf( "Compared with the baseline:\n  %-12s %12s %12s %9s\n", "", "baseline", "now", "change" );
+  compare_one( "requests", before->requests, after->requests );
+  compare_one( "errors", before->errors, after->errors );
+  compare_one( "req/s", before->throughput, after->throughput );
+  compare_one( "p50 usec", before->p50, after->p50 );
+  compare_one( "p99 usec", before->p99, after->p99 );
+  compare_one( "p999 usec", before->p999, after->p999 );
+  compare_one( "max usec", before->max, after->max );
+}
+
+int main( int argc, char **argv )
+{
+  struct sockaddr_in addr;
+  struct pollfd *pfds;
+  replay_conn **polled;
+  replay_results results, baseline;
+  long long *latencies, start, elapsed, now, wait, lag, max_lag = 0;
+  int opt, i, next_conn = 0, first_unfinished = 0, done = 0, errors = 0, active = 0, npolled;
+  char junk[65536];
+
+  while ( ( opt = getopt( argc, argv, "a:p:x:c:o:B:" ) ) != -1 )
+  {
+    switch ( opt )
+    {
+      case 'a': opt_host = optarg; break;
+      case 'p': opt_port = atoi( optarg ); break;
+      case 'x': opt_speed = atof( optarg ); break;
+      case 'c': opt_concurrency = atoi( optarg ); break;
+      case 'o': opt_save = optarg; break;
+      case 'B': opt_baseline = optarg; break;
+      default: usage( argv[0] );
+    }
+  }
+
+  if ( optind != argc - 1 || opt_concurrency < 1 || opt_speed < 0 )
+    usage( argv[0] );
+
+  memset( &addr, 0, sizeof(addr) );
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons( opt_port );
+  if ( inet_pton( AF_INET, opt_host, &addr.sin_addr ) != 1 )
+    usage( argv[0] );
+
+  load_capture( argv[optind] );
+
+  if ( !conn_count )
+  {
+    fprintf( stderr, "%s has no traffic in it\n", argv[optind] );
+    return 1;
+  }
+
+  pfds = calloc( opt_concurrency, sizeof(struct pollfd) );
+  polled = calloc( opt_concurrency, sizeof(replay_conn *) );
+  latencies = calloc( conn_count, sizeof(long long) );
+
+  if ( opt_speed > 0 )
+    printf( "Replaying %d connections (%d chunks, %.3f s of traffic) at %gx speed to %s:%d\n",
+            conn_count, chunk_count, ( chunks[chunk_count - 1].at - chunks[0].at ) / 1e6, opt_speed, opt_host, opt_port );
+  else
+    printf( "Replaying %d connections (%d chunks) as fast as possible, %d at a time, to %s:%d\n",
+            conn_count, chunk_count, opt_concurrency, opt_host, opt_port );
+
+  start = now_usecs();
+
+  while ( next_conn < conn_count || active > 0 )
+  {
+    now = now_usecs() - start;
+
+    /*
+     * Connect whoever is due (connections are in order of their first chunk)
+     */
+    while ( next_conn < conn_count && active < opt_concurrency && due( conns[next_conn].first_chunk ) <= now )
+    {
+      lag = now - due( conns[next_conn].first_chunk );
+      if ( opt_speed > 0 && lag > max_lag )
+        max_lag = lag;
+
+      if ( !start_connection( &conns[next_conn], &addr ) )
+        return 1;
+      next_conn++;
+      active++;
+    }
+
+    /*
+     * Poll the connections which are under way, and work out how long we can wait for them
+     */
+    wait = 1000000;
+    if ( next_conn < conn_count && active < opt_concurrency )
+      wait = due( conns[next_conn].first_chunk ) - now;
+
+    /*
+     * Connections start in order and (mostly) finish in order, so the ones under way are all
+     * between the oldest unfinished one and the next one to start
+     */
+    while ( first_unfinished < next_conn && conns[first_unfinished].state == REPLAY_FINISHED )
+      first_unfinished++;
+
+    npolled = 0;
+    for ( i = first_unfinished; i < next_conn && npolled < active; i++ )
+    {
+      replay_conn *c = &conns[i];
+
+      if ( c->state != REPLAY_CONNECTING && c->state != REPLAY_SENDING && c->state != REPLAY_READING )
+        continue;
+
+      pfds[npolled].fd = c->sock;
+      pfds[npolled].events = POLLIN;
+      pfds[npolled].revents = 0;
+
+      if ( c->state == REPLAY_CONNECTING || c->state == REPLAY_SENDING )
+      {
+        if ( due( c->chunk ) <= now )
+          pfds[npolled].events |= POLLOUT;
+        else if ( due( c->chunk ) - now < wait )
+          wait = due( c->chunk ) - now;
+      }
+
+      polled[npolled++] = c;
+    }
+
+    if ( wait < 0 )
+      wait = 0;
+
+    if ( poll( pfds, npolled, (int) ( ( wait + 999 ) / 1000 ) ) < 0 )
+    {
+      if ( errno == EINTR )
+        continue;
+      perror( "poll" );
+      return 1;
+    }
+
+    for ( i = 0; i < npolled; i++ )
+    {
+      replay_conn *c = polled[i];
+      int n, finished = 0, failed = 0;
+
+      if ( !pfds[i].revents )
+        continue;
+
+      if ( ( pfds[i].revents & POLLOUT ) && ( c->state == REPLAY_CONNECTING || c->state == REPLAY_SENDING ) )
+      {
+        replay_chunk *ch = &chunks[c->chunk];
+
+        c->state = REPLAY_SENDING;
+        n = send( c->sock, ch->data + c->sent, ch->len - c->sent, MSG_NOSIGNAL );
+        if ( n > 0 )
+        {
+          c->sent += n;
+          if ( c->sent == ch->len )
+          {
+            c->sent = 0;
+            c->chunk = ch->next;
+            if ( c->chunk < 0 )
+              c->state = REPLAY_READING;
+          }
+        }
+        else if ( n < 0 && errno != EAGAIN )
+          failed = 1;
+      }
+      else if ( pfds[i].revents & ( POLLIN | POLLHUP | POLLERR ) )
+      {
+        /*
+         * The server may answer before we've sent everything (e.g. with an error), which is fine
+         */
+        n = recv( c->sock, junk, sizeof(junk), 0 );
+        if ( n > 0 )
+          c->received += n;
+        else if ( n == 0 )
+        {
+          if ( c->received > 0 )
+            finished = 1;
+          else
+            failed = 1;
+        }
+        else if ( errno != EAGAIN )
+          failed = 1;
+      }
+
+      if ( !finished && !failed )
+        continue;
+
+      close( c->sock );
+      c->state = REPLAY_FINISHED;
+      active--;
+
+      if ( finished )
+        latencies[done++] = now_usecs() - c->started;
+      else
+        errors++;
+    }
+  }
+
+  elapsed = now_usecs() - start;
+
+  qsort( latencies, done, sizeof(long long), compare_latencies );
+
+  results.requests = done;
+  results.errors = errors;
+  results.seconds = elapsed / 1e6;
+  results.throughput = done / ( elapsed / 1e6 );
+  results.p50 = percentile( latencies, done, 50 );
+  results.p99 = percentile( latencies, done, 99 );
+  results.p999 = percentile( latencies, done, 99.9 );
+  results.max = done ? latencies[done - 1] : 0;
+
+  printf( "Completed %d requests (%d errors) in %.3f s\n", done, errors, results.seconds );
+  printf( "Throughput: %.1f req/s\n", results.throughput );
+  printf( "Latency (usec): p50 %.0f  p99 %.0f  p999 %.0f  max %.0f\n", results.p50, results.p99, results.p999, results.max );
+  if ( opt_speed > 0 )
+    printf( "Fell behind schedule by up to %.1f msec%s\n", max_lag / 1e3,
+            max_lag > 10000 ? " (try a higher -c, or the server is too slow for this speed)" : "" );
+
+  if ( opt_save )
+    save_results( opt_save, &results );
+
+  if ( opt_baseline && load_results( opt_baseline, &baseline ) )
+    compare_results( &baseline, &results );
+
+  return errors ? 2 : 0;
+}
@@ -41,9 +41,12 @@
 //#define SUPPORT_FOR_BUGGY_NGINX
 
 
+#define MAX_CONNECTIONS_TO_ACCEPT_AT_ONCE 5
+
 int main(void)
 {
-  int connections;
+  scgi_request *reqs[MAX_CONNECTIONS_TO_ACCEPT_AT_ONCE];
+  int connections, i;
 
   /*
    * Attempt to initialize the SCGI Library and make it listen on a port
@@ -64,90 +67,66 @@ int main(void)
   while ( 1 )
   {
     /*
-     * Check for connections ten times per second (once per 100000 microseconds).
-     * A typical server (such as this helloworld server) will spend the vast majority of its time sleeping.
-     * Nothing magical about 100000 microseconds, an SCGI Library user can call the library as often or rarely
+     * Check for connections at least ten times per second: if nobody is waiting, scgi_recv_batch() waits
+     * up to 100 milliseconds for something to happen, then outputs pointers to as many as
+     * MAX_CONNECTIONS_TO_ACCEPT_AT_ONCE connections awaiting the server's attention, and returns how many.
+     * A typical server (such as this helloworld server) will spend the vast majority of its time waiting.
+     * Nothing magical about 100 milliseconds, an SCGI Library user can call the library as often or rarely
      * as desired (of course, if you wait foreeeever, eventually your webserver will issue an "Internal Server Error").
      */
-    usleep(100000);
+    connections = scgi_recv_batch( reqs, MAX_CONNECTIONS_TO_ACCEPT_AT_ONCE, 100 );
 
-#define MAX_CONNECTIONS_TO_ACCEPT_AT_ONCE 5
+    for ( i = 0; i < connections; i++ )
+    {
+      scgi_request *req = reqs[i];
+      scgi_handle h;
 
-    connections = 0;
+      /*
+       * Since there is no way to check whether memory has been free'd, let's get a handle for the
+       * request.  Unlike the pointer, we can check the handle at any time, to see whether the request
+       * still exists in memory.
+       */
+      h = scgi_request_handle( req );
 
-    while ( connections < MAX_CONNECTIONS_TO_ACCEPT_AT_ONCE )
-    {
       /*
-       * If any connections are awaiting the server's attention, scgi_recv() will output a pointer to one of them.
-       * Otherwise, it will return NULL.
+       * Send some log messages to stdout (pretty silly, but this is to illustrate how scgilib works)
        */
-      scgi_request *req = scgi_recv();
-      int dead;
 
-      if ( req != NULL )
-      {
-        /*
-         * Got a connection!
-         */
-        connections++;
-
-        /*
-         * Since there is no way to check whether memory has been free'd, let's give the library a way to
-         * let us know whether the request still exists in memory or not, by giving it the address of an
-         * int.  Once we've done this, we can check the int at any time, to see whether the request still
-         * exists in memory.
-         */
-        dead = 0;
-        req->dead = &dead;
-
-        /*
-         * Send some log messages to stdout (pretty silly, but this is to illustrate how scgilib works)
-         */
-
-        printf( "SCGI C Library received an SCGI connection on port %d.\n", req->descriptor->port->port );
-        if ( req->remote_addr )
-          printf( "The connection originated from remote IP address %s.\n", req->remote_addr );
-        if ( req->http_host )
-          printf( "The connection was addressed to domain name %s.\n", req->http_host );
-        if ( req->request_method == SCGI_METHOD_GET )
-          printf( "The connection made an HTTP GET request.\n" );
-        else if ( req->request_method == SCGI_METHOD_POST )
-          printf( "The connection made an HTTP POST request.\n" );
-        else if ( req->request_method == SCGI_METHOD_HEAD )
-          printf( "The connection made an HTTP HEAD request.\n" );
-        else
-          printf( "The connection made some other HTTP request than GET, POST, or HEAD.\n" );
-        if ( req->user_agent )
-          printf( "The webclient identified itself as: %s\n", req->user_agent );
-        if ( req->query_string && *req->query_string )
-          printf( "They included a query string: %s\n", req->query_string );
+      printf( "SCGI C Library received an SCGI connection on port %d.\n", req->descriptor->port->port );
+      if ( req->remote_addr )
+        printf( "The connection originated from remote IP address %s.\n", req->remote_addr );
+      if ( req->http_host )
+        printf( "The connection was addressed to domain name %s.\n", req->http_host );
+      if ( req->request_method == SCGI_METHOD_GET )
+        printf( "The connection made an HTTP GET request.\n" );
+      else if ( req->request_method == SCGI_METHOD_POST )
+        printf( "The connection made an HTTP POST request.\n" );
+      else if ( req->request_method == SCGI_METHOD_HEAD )
+        printf( "The connection made an HTTP HEAD request.\n" );
+      else
+        printf( "The connection made some other HTTP request than GET, POST, or HEAD.\n" );
+      if ( req->user_agent )
+        printf( "The webclient identified itself as: %s\n", req->user_agent );
+      if ( req->query_string && *req->query_string )
+        printf( "They included a query string: %s\n", req->query_string );
 
 #ifndef SUPPORT_FOR_BUGGY_NGINX
-        if ( !scgi_write( req,  "Status: 200 OK\r\n"
-                                "Content-Type: text/plain\r\n\r\n"
-                                "Hello World!" ) )
+      if ( !scgi_write( req,  "Status: 200 OK\r\n"
+                              "Content-Type: text/plain\r\n\r\n"
+                              "Hello World!" ) )
 #else
-        if ( !scgi_write( req,  "HTTP/1.1 200 OK\r\n\r\n"
-                                "Hello World!" ) )
+      if ( !scgi_write( req,  "HTTP/1.1 200 OK\r\n\r\n"
+                              "Hello World!" ) )
 #endif
-        {
-          printf( "Our response could not be sent, we couldn't allocate the necessary RAM.\n" );
-        }
-        else
-          if ( dead == 1 )
-            printf(	"Oh my, something went wrong!\n"
-			"The connection was killed by the SCGI Library when we tried to send the response.\n" );
-
-        /*
-         * From here on, helloworld.c forgets about the request (though the library itself still remembers it)
-         * so we can relieve the library from having to maintain the req->dead
-         */
-        if ( !dead )
-          req->dead = NULL;
-        printf("\n");
+      {
+        printf( "Our response could not be sent, we couldn't allocate the necessary RAM.\n" );
       }
       else
-        break;
+        if ( !scgi_handle_alive( h ) )
+          printf(	"Oh my, something went wrong!\n"
+			"The connection was killed by the SCGI Library when we tried to send the response.\n" );
+
+      printf("\n");
     }
   }
 }
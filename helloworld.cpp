@@ -0,0 +1,82 @@
+/*
+ *  SCGI C Library
+ *
+ *  helloworld.cpp - SCGI Library example file, C++20 coroutine version
+ *                   Creates a server (on port 8000) to listen for SCGI and respond with Hello World!
+ *
+ *  Does what helloworld.c does, but with scgilib.hpp: each request is handled by a coroutine,
+ *  which can wait for things (here, for its response to be sent) without holding up anybody
+ *  else, and without a thread of its own.  See helloworld.c for how to point a webserver at it.
+ *
+ *  Build with "make cpp".
+ *
+ *  Copyright/license:  MIT
+ */
+
+#include "scgilib.hpp"
+#include <cstdio>
+
+#define HELLOWORLDPORT 8000
+
+/*
+ * How many requests may be in progress at once: each of these coroutines handles one request at a time
+ */
+#define HANDLERS 16
+
+scgi::task handle_requests( scgi::server &server, int id )
+{
+  for ( ; ; )
+  {
+    scgi::request req = co_await server.accept();
+    std::string_view name = req.query_param( "name" );
+    std::size_t total = 0;
+    char response[512];
+    int len;
+
+    /*
+     * If they sent a body, read it (in pieces, just to show how) and tell them how long it was
+     */
+    if ( !req.body().empty() )
+    {
+      scgi::body_reader reader = req.body_stream();
+
+      while ( !reader.done() )
+        total += reader.read( 1024 ).size();
+    }
+
+    len = std::snprintf( response, sizeof(response),
+                         "Status: 200 OK\r\nContent-Type: text/plain\r\n\r\nHello %.*s!\nYou sent %zu bytes.\n",
+                         name.empty() ? 5 : (int) name.size(), name.empty() ? "World" : name.data(), total );
+    if ( len >= (int) sizeof(response) )
+      len = sizeof(response) - 1;
+
+    std::printf( "Handler %d got a request for %.*s\n", id, (int) req.uri().size(), req.uri().data() );
+
+    /*
+     * The library copies the response, so waiting here isn't necessary, but it tells us whether
+     * the response made it (and this handler takes on no new request until the connection is done)
+     */
+    if ( !co_await req.send( std::string_view( response, len ) ) )
+      std::printf( "Handler %d's response could not be sent.\n", id );
+  }
+}
+
+int main()
+{
+  scgi::server server( HELLOWORLDPORT );
+
+  if ( !server.ok() )
+  {
+    std::printf( "Could not listen for incoming connections on port %d.\n", HELLOWORLDPORT );
+    return 1;
+  }
+
+  std::printf( "Successfully initialized the SCGI library.  Listening on port %d.\n", HELLOWORLDPORT );
+
+  for ( int i = 0; i < HANDLERS; i++ )
+    handle_requests( server, i );
+
+  server.run();
+
+  return 0;
+}
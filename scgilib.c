@@ -18,9 +18,17 @@
 #include <ctype.h>
 #include <errno.h>
 #include <string.h>
+#include <strings.h>
 #include <netdb.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
 
 /*
  * Doubly-linked list of ports to listen on
@@ -29,10 +37,30 @@ scgi_port *first_scgi_port;
 scgi_port *last_scgi_port;
 
 /*
- * Doubly-linked list of requests from clients
+ * The connection table: slot i holds the connection on socket i (or, from scgi_socket_slots on,
+ * a connection without a socket).  See SCGI_MAX_SOCKET_SLOTS.
  */
-scgi_request *first_scgi_req;
-scgi_request *last_scgi_req;
+scgi_slot *scgi_slots;
+int scgi_socket_slots;
+int scgi_total_slots;
+int scgi_top_slot;
+int scgi_top_virtual_slot;
+
+/*
+ * The in-memory transport behind scgi_pipe_connect
+ */
+int scgi_pipe_readable( scgi_desc *d );
+int scgi_pipe_recv( scgi_desc *d, char *buf, int len );
+int scgi_pipe_send( scgi_desc *d, char *buf, int len );
+void scgi_pipe_hang_up( scgi_desc *d, int reason );
+
+scgi_transport scgi_pipe_transport =
+{
+  scgi_pipe_readable,
+  scgi_pipe_recv,
+  scgi_pipe_send,
+  scgi_pipe_hang_up
+};
 
 /*
  * Doubly-linked list of new requests which have been parsed and are ready to be returned by scgi_recv
@@ -40,6 +68,67 @@ scgi_request *last_scgi_req;
 scgi_request *first_scgi_unrecved_req;
 scgi_request *last_scgi_unrecved_req;
 
+/*
+ * Function to call when a connection closes (see scgi_set_close_hook)
+ */
+scgi_close_hook *scgi_close_hook_fn;
+
+/*
+ * Function to decide which requests to turn away when the queue is full (see scgi_set_shed_hook)
+ */
+scgi_shed_hook *scgi_shed_hook_fn;
+
+/*
+ * In what order scgi_recv hands out waiting requests, once at least scgi_queue_pressure of them
+ * are waiting (see scgi_set_queue_policy).  Below that, it's always oldest first.
+ */
+int scgi_queue_policy = SCGI_QUEUE_FIFO;
+int scgi_queue_pressure;
+scgi_priority_hook *scgi_priority_hook_fn;
+
+/*
+ * The response cache (see scgi_cache_insert): a hash table of entries, plus a list of them
+ * in order of use (least recently used first), so that when we run out of budget, those go first.
+ */
+scgi_cache_entry *scgi_cache_table[SCGI_CACHE_BUCKETS];
+scgi_cache_entry *first_scgi_cache_entry;
+scgi_cache_entry *last_scgi_cache_entry;
+long scgi_cache_budget = SCGI_CACHE_BUDGET;
+long scgi_cache_used;
+
+/*
+ * How many bytes connections' buffers and requests' arenas are using, and how many they may use
+ * (see scgi_set_memory_budget), and whether the last scgi_memory_charge was refused (so that when
+ * an allocation fails, we can tell whether it was the budget's doing or the RAM's)
+ */
+long scgi_memory_used;
+long scgi_memory_soft_limit = SCGI_MEMORY_SOFT_LIMIT;
+long scgi_memory_hard_limit = SCGI_MEMORY_HARD_LIMIT;
+int scgi_memory_refused;
+
+/*
+ * Static responses (see scgi_add_static_response), every variant of every URI
+ */
+scgi_static_response *first_scgi_static_response;
+
+/*
+ * Routes (see scgi_add_route), and the trie they're compiled into: node 0 is the root
+ */
+scgi_route *scgi_routes;
+int scgi_route_count;
+scgi_route_node *scgi_route_nodes;
+int scgi_route_node_count;
+unsigned char *scgi_route_edge_bytes;
+int *scgi_route_edge_nodes;
+int scgi_route_edge_count;
+
+/*
+ * Where to record incoming traffic, if anywhere (see scgi_capture_start)
+ */
+FILE *scgi_capture_file;
+unsigned long scgi_capture_next_id;
+long long scgi_capture_last_record;
+
 /*
  * Socket programming stuff
  */
@@ -50,11 +139,77 @@ fd_set scgi_excset;
 /*
  * Function prototypes (there are additional function prototypes in scgilib.h)
  */
-int resize_buffer( scgi_desc *d, char **buf );
-void scgi_parse_input( scgi_desc *d );
+int scgi_parse_input( scgi_desc *d );
+int scgi_header_scan_end( scgi_desc *d, char *parser );
+int scgi_consume_input( scgi_desc *d, char *data, int len );
+int scgi_keep_input( scgi_desc *d, char *data, int len );
+void scgi_release_input( scgi_desc *d );
+int scgi_turn_away_large_request( scgi_desc *d, long long size );
 void scgi_deal_with_socket_out_of_ram( scgi_desc *d );
 int scgi_is_number( char *arg );
 int scgi_add_header( scgi_desc *d, char *name, char *val );
+int scgi_config_is_valid( scgi_config *cfg );
+void scgi_request_is_ready( scgi_desc *d );
+void scgi_stats_add( scgi_stats *sum, scgi_stats *s );
+double scgi_msecs_between( long long from, long long to );
+void scgi_log_slow_request( scgi_request *r, int reason );
+unsigned int scgi_hash( char *str );
+int scgi_build_header_index( scgi_request *req );
+int scgi_split_params( scgi_request *req, char *str, char separator, int trim, int plus_is_space, scgi_param **out );
+void *scgi_arena_alloc( scgi_request *req, int size, int align );
+int scgi_arena_add_chunk( scgi_request *req, int size );
+void scgi_arena_free( scgi_request *req );
+int scgi_has_escapes( char *str, int len, int plus_is_space );
+int scgi_decode_char( char *src, char *end, char *c, int plus_is_space );
+int scgi_percent_decode( char *dst, char *src, int len, int plus_is_space );
+int scgi_decoded_equals( char *src, int len, char *want, int wantlen, int plus_is_space );
+char *scgi_decode_param( scgi_request *req, scgi_param *prm, int plus_is_space );
+char *scgi_find_param( scgi_request *req, scgi_param *params, int count, char *name, int *len, int plus_is_space );
+void scgi_prepare_canned_responses( scgi_port *p );
+void scgi_respond_canned( scgi_desc *d, int which, int reason );
+void scgi_turn_away_caller( scgi_port *p, int caller );
+int scgi_request_has_expired( scgi_request *req, long long now );
+void scgi_expire_request( scgi_request *req );
+scgi_request *scgi_next_in_line( void );
+scgi_request *scgi_hand_out_request( long long now );
+void scgi_wait_for_io( int timeout_ms );
+unsigned int scgi_cache_hash( char *host, char *uri, char *query );
+int scgi_cache_key_matches( scgi_cache_entry *e, char *host, char *uri, char *query );
+scgi_cache_entry *scgi_cache_lookup( char *host, char *uri, char *query );
+void scgi_cache_remove( scgi_cache_entry *e );
+void scgi_cache_make_room( long cost );
+int scgi_answer_from_cache( scgi_desc *d );
+int scgi_fill_outbuf( scgi_desc *d, char *txt, int len );
+double scgi_accept_q( char *accept, char *coding );
+int scgi_answer_with_static_response( scgi_desc *d );
+void scgi_prefork_signal( int sig );
+int scgi_too_slow( scgi_desc *d, long long now );
+int scgi_is_idle( scgi_desc *d, long long now );
+void scgi_discard_input( scgi_desc *d );
+int scgi_drain( scgi_port *p, int sock, scgi_desc *d );
+void scgi_service_lingerers( scgi_port *p, fd_set *readable, long long now );
+void scgi_evict( scgi_desc *d, int reason );
+void scgi_capture( scgi_desc *d, char *data, int len );
+int scgi_memory_charge( long bytes );
+int scgi_dispatch_route( scgi_desc *d );
+void scgi_run_route_handler( scgi_desc *d );
+int scgi_find_route( scgi_request *req );
+int scgi_route_child( int node, unsigned char byte );
+int scgi_route_path( int node, char *uri );
+int scgi_compile_routes( void );
+int scgi_compile_route_node( int *order, int lo, int hi, int depth );
+int scgi_compare_routes( const void *a, const void *b );
+int scgi_capture_varint( unsigned long long x );
+int scgi_init_connection_table( void );
+int scgi_claim_slot( int sock );
+int scgi_resp_start( scgi_desc *d );
+int scgi_resp_reserve( scgi_desc *d, int extra );
+int scgi_resp_append( scgi_desc *d, char *txt, int len );
+int scgi_resp_start_body( scgi_desc *d );
+void scgi_service_connection( scgi_desc *d, int readable, int writable, int broken, int slow_checks, long long now );
+scgi_port *scgi_add_port( int port, int sock, scgi_config *cfg );
+int scgi_pipe_append( char **buf, int *len, int *done, int *size, char *data, int n );
+int scgi_virtual_io_pending( void );
 
 /*
  * Listen for incoming requests on all open ports
@@ -73,8 +228,9 @@ void scgi_update_connections( void )
 void scgi_update_connections_port( scgi_port *p )
 {
   static struct timeval zero_time;
-  scgi_desc *d, *d_next;
-  int top_desc;
+  scgi_desc *d;
+  int top_desc, slow_checks, i;
+  long long now;
 
   /*
    * initialize socket stuff
@@ -82,26 +238,45 @@ void scgi_update_connections_port( scgi_port *p )
   FD_ZERO( &scgi_inset );
   FD_ZERO( &scgi_outset );
   FD_ZERO( &scgi_excset );
-  FD_SET( p->sock, &scgi_inset );
   top_desc = p->sock;
+  if ( p->sock >= 0 )
+    FD_SET( p->sock, &scgi_inset );
 
-  for ( d = p->first_scgi_desc; d; d = d->next )
+  for ( i = 0; i < scgi_top_slot; i++ )
   {
+    if ( !scgi_slots[i].in_use || scgi_slots[i].desc.port != p || scgi_slots[i].desc.sock < 0 )
+      continue;
+
+    d = &scgi_slots[i].desc;
+
     if ( d->sock > top_desc )
       top_desc = d->sock;
-    if ( d->state == SCGI_SOCKSTATE_READING_REQUEST )
+    if ( d->state == SCGI_SOCKSTATE_READING_REQUEST || d->discarding )
       FD_SET( d->sock, &scgi_inset );
-    else
     if ( d->state == SCGI_SOCKSTATE_WRITING_RESPONSE )
       FD_SET( d->sock, &scgi_outset );
     FD_SET( d->sock, &scgi_excset );
   }
 
+  for ( i = 0; i < p->lingering_count; i++ )
+  {
+    FD_SET( p->lingering[i].sock, &scgi_inset );
+    if ( p->lingering[i].sock > top_desc )
+      top_desc = p->lingering[i].sock;
+  }
+
   /*
-   * Poll the sockets!
+   * Poll the sockets!  (A loopback port, with nothing but in-memory connections, has none.)
    */
-  if ( select( top_desc+1, &scgi_inset, &scgi_outset, &scgi_excset, &zero_time ) < 0 )
+  if ( top_desc >= 0
+  &&   select( top_desc+1, &scgi_inset, &scgi_outset, &scgi_excset, &zero_time ) < 0 )
   {
+    /*
+     * A signal arrived while we were polling.  Nothing's wrong, we'll just poll again next time.
+     */
+    if ( errno == EINTR )
+      return;
+
     scgi_perror( "Fatal: scgilib failed to poll the descriptors." );
     exit(1);
   }
@@ -109,68 +284,265 @@ void scgi_update_connections_port( scgi_port *p )
   /*
    * If we've got a new incoming connection, deal with it
    */
-  if ( !FD_ISSET( p->sock, &scgi_excset ) && FD_ISSET( p->sock, &scgi_inset ) )
+  if ( p->sock >= 0 && !FD_ISSET( p->sock, &scgi_excset ) && FD_ISSET( p->sock, &scgi_inset ) )
   {
     scgi_answer_the_phone(p);
   }
 
-  for ( d = p->first_scgi_desc; d; d = d_next )
+  slow_checks = p->config.header_timeout_msecs || p->config.body_timeout_msecs || p->config.min_bytes_per_sec;
+  now = scgi_now_usecs();
+
+  if ( p->lingering_count )
+    scgi_service_lingerers( p, &scgi_inset, now );
+
+  for ( i = 0; i < scgi_top_slot; i++ )
   {
-    /*
-     * We may be killing things in this list as we traverse it,
-     * so need a safe copy of the next thing in the list.
-     */
-    d_next = d->next;
+    if ( !scgi_slots[i].in_use || scgi_slots[i].desc.port != p || scgi_slots[i].desc.sock < 0 )
+      continue;
 
-    d->idle++;
+    d = &scgi_slots[i].desc;
 
-    /*
-     * Kick connections out if they raise any kind of exception, or if they're idle too long
-     */
-    if ( FD_ISSET( d->sock, &scgi_excset )
-    ||   d->idle > SCGI_KICK_IDLE_AFTER_X_SECS * SCGI_PULSES_PER_SEC )
-    {
-      FD_CLR( d->sock, &scgi_inset );
-      FD_CLR( d->sock, &scgi_outset );
+    scgi_service_connection( d, FD_ISSET( d->sock, &scgi_inset ), FD_ISSET( d->sock, &scgi_outset ),
+                             FD_ISSET( d->sock, &scgi_excset ), slow_checks, now );
+  }
 
-      scgi_kill_socket( d );
+  /*
+   * Connections without a socket (see scgi_connect_transport) are always ready to be written to,
+   * and their transport says whether there's anything to read
+   */
+  for ( i = scgi_socket_slots; i < scgi_top_virtual_slot; i++ )
+  {
+    if ( !scgi_slots[i].in_use || scgi_slots[i].desc.port != p || !scgi_slots[i].desc.transport )
       continue;
-    }
 
-    /*
-     * Handle remote I/O, provided the connections are ready for it
-     */
-    if ( d->state == SCGI_SOCKSTATE_READING_REQUEST
-    &&   FD_ISSET( d->sock, &scgi_inset ) )
-    {
-      d->idle = 0;
-      scgi_listen_to_request( d );
-    }
+    d = &scgi_slots[i].desc;
+
+    scgi_service_connection( d, (*d->transport->readable)( d ), 1, 0, slow_checks, now );
+  }
+}
+
+/*
+ * One connection's turn in the event loop: readable, writable and broken say what the poll
+ * found out about it
+ */
+void scgi_service_connection( scgi_desc *d, int readable, int writable, int broken, int slow_checks, long long now )
+{
+  int reason;
+
+  /*
+   * Kick connections out if they raise any kind of exception, or if they're idle too long
+   */
+  if ( broken )
+  {
+    scgi_kill_socket( d, SCGI_CLOSE_EXCEPTION );
+    return;
+  }
+
+  if ( scgi_is_idle( d, now ) )
+  {
+    scgi_kill_socket( d, d->discarding ? d->close_reason : SCGI_CLOSE_IDLE );
+    return;
+  }
+
+  /*
+   * Kick connections out if they're taking too long to send their request, even if they
+   * aren't quite idle
+   */
+  if ( slow_checks
+  &&   d->state == SCGI_SOCKSTATE_READING_REQUEST
+  &&   ( reason = scgi_too_slow( d, now ) ) >= 0 )
+  {
+    scgi_evict( d, reason );
+    return;
+  }
+
+  /*
+   * Handle remote I/O, provided the connections are ready for it
+   */
+  if ( d->state == SCGI_SOCKSTATE_READING_REQUEST
+  &&   readable )
+  {
+    d->last_active = now;
+    scgi_listen_to_request( d );
+  }
+  else
+  if ( d->state == SCGI_SOCKSTATE_WRITING_RESPONSE
+  &&   d->outbuflen > 0
+  &&  !d->building
+  &&   writable )
+  {
+    d->last_active = now;
+    scgi_flush_response( d );
+  }
+  else
+  if ( d->discarding
+  &&   readable )
+  {
+    d->last_active = now;
+    scgi_discard_input( d );
+  }
+}
+
+/*
+ * We've turned them away in the middle of their request (see scgi_keep_input), but the rest of
+ * it is still coming.  Read it and throw it away: if we closed the connection with it unread,
+ * the kernel would reset the connection, and they might never see our response.  Once they've
+ * got the response and hung up, the connection is closed (for the reason we turned them away).
+ */
+void scgi_discard_input( scgi_desc *d )
+{
+  unsigned long long before = d->port->stats.bytes_read;
+  int open = scgi_drain( d->port, d->sock, d->transport ? d : NULL );
+
+  d->bytes_received += d->port->stats.bytes_read - before;
+
+  if ( !open )
+    scgi_kill_socket( d, d->close_reason );
+}
+
+/*
+ * Read whatever they've sent, and throw it away (counting it in the port's bytes_read), until
+ * there's nothing more for now.  Reads the socket, or if d isn't NULL, d's transport.
+ * Returns 1 if they're still there, or 0 if they've hung up (or the connection is broken).
+ */
+int scgi_drain( scgi_port *p, int sock, scgi_desc *d )
+{
+  char junk[4096];
+  int readsize;
+
+  for ( ; ; )
+  {
+    if ( d )
+      readsize = (*d->transport->recv)( d, junk, sizeof(junk) );
     else
-    if ( d->state == SCGI_SOCKSTATE_WRITING_RESPONSE
-    &&   d->outbuflen > 0
-    &&   FD_ISSET( d->sock, &scgi_outset ) )
+      readsize = recv( sock, junk, sizeof(junk), 0 );
+
+    if ( readsize > 0 )
     {
-      d->idle = 0;
-      scgi_flush_response( d );
+      p->stats.bytes_read += readsize;
+      continue;
     }
+
+    if ( readsize < 0 && errno == EINTR )
+      continue;
+
+    return readsize < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN );
+  }
+}
+
+/*
+ * Callers we've turned away (see scgi_turn_away_caller): drain the ones with something to say,
+ * and close the ones which have hung up, or which we've waited on long enough
+ */
+void scgi_service_lingerers( scgi_port *p, fd_set *readable, long long now )
+{
+  scgi_lingerer *l;
+  int i;
+
+  for ( i = p->lingering_count - 1; i >= 0; i-- )
+  {
+    l = &p->lingering[i];
+
+    if ( now - l->since <= SCGI_LINGER_SECS * 1000000LL
+    &&   ( !FD_ISSET( l->sock, readable ) || scgi_drain( p, l->sock, NULL ) ) )
+      continue;
+
+    close( l->sock );
+    *l = p->lingering[--p->lingering_count];
+  }
+}
+
+/*
+ * Has a connection kept us waiting for longer than kick_idle_after_x_secs?  Only waiting on them
+ * counts: for their request, or for them to take our response.  From when their request is all
+ * here until its response is ready to go, the wait is ours (in the queue, or in your program),
+ * so they can't be idle then.
+ */
+int scgi_is_idle( scgi_desc *d, long long now )
+{
+  long long since = d->last_active;
+
+  if ( d->parser_state == SCGI_PARSE_DONE )
+  {
+    if ( d->state != SCGI_SOCKSTATE_WRITING_RESPONSE || d->outbuflen <= 0 || d->building )
+      return 0;
+
+    if ( d->req->timings.sent > since )
+      since = d->req->timings.sent;
   }
+
+  return now - since > d->port->config.kick_idle_after_x_secs * 1000000LL;
 }
 
 /*
- * Kick a connection offline and delete it from memory
+ * Kick a connection offline and delete it from memory.
+ * reason is one of the SCGI_CLOSE_* codes from scgilib.h, saying why.
  */
-void scgi_kill_socket( scgi_desc *d )
+void scgi_kill_socket( scgi_desc *d, int reason )
 {
-  SCGI_UNLINK( d, d->port->first_scgi_desc, d->port->last_scgi_desc, next, prev );
+  scgi_slot *slot = (scgi_slot *) d;
+
+  d->port->stats.connections_closed++;
+  d->port->stats.open_connections--;
+
+  /*
+   * A reason which isn't one of ours still closes the connection, it just isn't counted by reason
+   */
+  if ( reason >= 0 && reason < SCGI_CLOSE_REASONS )
+    d->port->stats.closed_by_reason[reason]++;
+
+  d->req->timings.closed = scgi_now_usecs();
+
+  /*
+   * If you (the programmer) asked to be told about closed connections, now's the time,
+   * while the request is still in memory.
+   */
+  if ( scgi_close_hook_fn )
+    (*scgi_close_hook_fn)( d->req, reason, &d->req->timings );
 
-  free( d->buf );
+  if ( d->port->config.log_slow_requests_after_x_msecs > 0
+  &&   d->req->timings.closed - d->req->timings.accepted > d->port->config.log_slow_requests_after_x_msecs * 1000LL )
+    scgi_log_slow_request( d->req, reason );
+
+  if ( d->buf && !d->buf_borrowed )
+  {
+    free( d->buf );
+    scgi_memory_charge( -( d->bufsize + 1L ) );
+  }
 
   free( d->outbuf );
+  scgi_memory_charge( -( d->outbufsize + 1L ) );
+
+  /*
+   * If we were sending a canned response from a set the port has since replaced, and we were
+   * the last ones doing so, that set can go now
+   */
+  if ( d->canned && --d->canned->users == 0 && d->canned != d->port->canned )
+    free( d->canned );
+
+  /*
+   * Handles to the request stop working before it's freed (see scgi_handle_alive)
+   */
+  atomic_fetch_add_explicit( &slot->generation, 1, memory_order_release );
 
   free_scgi_request( d->req );
-  close( d->sock );
-  free( d );
+
+  if ( d->transport )
+    (*d->transport->close)( d, reason );
+  else
+  if ( d->sock >= 0 )
+    close( d->sock );
+
+  /*
+   * The slot is free for the next connection on this socket
+   */
+  slot->in_use = 0;
+
+  while ( scgi_top_slot > 0 && !scgi_slots[scgi_top_slot - 1].in_use )
+    scgi_top_slot--;
+
+  while ( scgi_top_virtual_slot > scgi_socket_slots && !scgi_slots[scgi_top_virtual_slot - 1].in_use )
+    scgi_top_virtual_slot--;
 }
 
 /*
@@ -178,9 +550,6 @@ void scgi_kill_socket( scgi_desc *d )
  */
 void free_scgi_request( scgi_request *r )
 {
-  scgi_header *h, *h_next;
-  scgi_request *ptr;
-
   if ( !r )
     return;
 
@@ -194,27 +563,20 @@ void free_scgi_request( scgi_request *r )
     *r->dead = 1;
   }
 
-  SCGI_UNLINK( r, first_scgi_req, last_scgi_req, next, prev );
-
-  for ( ptr = first_scgi_unrecved_req; ptr; ptr = ptr->next_unrecved )
-  {
-    if ( ptr == r )
-    {
-      SCGI_UNLINK( r, first_scgi_unrecved_req, last_scgi_unrecved_req, next_unrecved, prev_unrecved );
-      break;
-    }
-  }
-
-  for ( h = r->first_header; h; h = h_next )
+  /*
+   * If it was still waiting for scgi_recv, it isn't anymore
+   */
+  if ( r->prev_unrecved || first_scgi_unrecved_req == r )
   {
-    h_next = h->next;
-    free( h->name );
-    free( h->value );
-    free( h );
+    SCGI_UNLINK( r, first_scgi_unrecved_req, last_scgi_unrecved_req, next_unrecved, prev_unrecved );
+    r->descriptor->port->stats.unrecved_requests--;
   }
 
-  if ( r->body )
-    free( r->body );
+  /*
+   * Headers, body, header index, etc. all live in the request's arena, so there's nothing
+   * to free one at a time.
+   */
+  scgi_arena_free( r );
 
   free( r );
 }
@@ -227,12 +589,15 @@ void scgi_answer_the_phone( scgi_port *p )
   struct sockaddr_storage their_addr;
   socklen_t addr_size = sizeof(their_addr);
   int caller;
-  scgi_desc *d;
-  scgi_request *req;
 
   if ( ( caller = accept( p->sock, (struct sockaddr *) &their_addr, &addr_size) ) < 0 )
   {
-    scgi_perror( "Warning: scgilib's phone rang but something prevented scgilib from answering it." );
+    /*
+     * The listening socket is non-blocking, so if another process sharing it (see scgi_prefork)
+     * picked up first, or the caller hung up already, there's simply nobody on the line.
+     */
+    if ( errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED && errno != EINTR )
+      scgi_perror( "Warning: scgilib's phone rang but something prevented scgilib from answering it." );
     return;
   }
 
@@ -248,162 +613,597 @@ void scgi_answer_the_phone( scgi_port *p )
   }
 
   /*
-   * The connection has been made.  Let's commit it to RAM.
+   * If we've already got as many connections as we're willing to juggle, turn this one away
+   * right now, before spending any memory on it.
    */
-  SCGI_CREATE( d, scgi_desc, 1 );
-  d->next = NULL;
-  d->prev = NULL;
-  d->port = p;
-  d->sock = caller;
-  d->idle = 0;
-  d->state = SCGI_SOCKSTATE_READING_REQUEST;
-  d->writehead = NULL;
-  d->parsed_chars = 0;
-  d->string_starts = NULL;
-  d->parser_state = SCGI_PARSE_HEADLENGTH;
-
-  SCGI_CREATE( d->buf, char, SCGI_INITIAL_INBUF_SIZE + 1 );
-  d->bufsize = SCGI_INITIAL_INBUF_SIZE;
-  d->buflen = 0;
-  *d->buf = '\0';
-
-  SCGI_CREATE( d->outbuf, char, SCGI_INITIAL_OUTBUF_SIZE + 1 );
-  d->outbufsize = SCGI_INITIAL_OUTBUF_SIZE;
-  d->outbuflen = 0;
-  *d->outbuf = '\0';
+  if ( p->config.max_connections > 0 && p->stats.open_connections >= p->config.max_connections )
+  {
+    scgi_turn_away_caller( p, caller );
+    return;
+  }
 
-  SCGI_CREATE( req, scgi_request, 1 );
-  req->next = NULL;
-  req->prev = NULL;
-  req->next_unrecved = NULL;
-  req->prev_unrecved = NULL;
-  req->descriptor = d;
+  /*
+   * The connection table has no room for sockets beyond the limit we started with (which is
+   * never more than select can watch: see SCGI_MAX_SOCKET_SLOTS), and when we're out of memory
+   * (or memory budget), we can't take on anybody new either
+   */
+  if ( !scgi_new_connection( p, caller ) )
+    scgi_turn_away_caller( p, caller );
+}
 
-  req->first_header = NULL;
-  req->last_header = NULL;
-  req->body = NULL;
-  req->scgi_content_length = -1;
-  req->scgi_scgiheader = 0;
-  req->dead = NULL;
+/*
+ * We're too busy to take a call.  Tell the caller so (503 Service Unavailable, try again later)
+ * and hang up, without taking them on as a connection.  Their request is most likely still on its
+ * way, and closing a socket with unread data makes the kernel reset the connection (and then the
+ * webserver might never see our 503).  So, like a connection whose request we've turned away
+ * (see scgi_discard_input), we only say we're done talking, and keep the socket until they hang
+ * up, reading and throwing away whatever they send (see scgi_service_lingerers).  If too many
+ * are lingering already, we drain what's arrived so far, and hang up.
+ */
+void scgi_turn_away_caller( scgi_port *p, int caller )
+{
+  scgi_lingerer *l;
 
-  req->request_method = SCGI_METHOD_UNSPECIFIED;
-  req->http_host = NULL;
-  req->query_string = NULL;
-  req->request_uri = NULL;
-  req->http_cache_control = NULL;
-  req->raw_http_cookie = NULL;
-  req->http_connection = NULL;
-  req->http_accept_encoding = NULL;
-  req->http_accept_language = NULL;
-  req->http_accept_charset = NULL;
-  req->http_accept = NULL;
-  req->user_agent = NULL;
-  req->remote_addr = NULL;
-  req->server_port = NULL;
-  req->server_addr = NULL;
-  req->server_protocol = NULL;
+  if ( send( caller, p->canned->response[SCGI_CANNED_BUSY], p->canned->len[SCGI_CANNED_BUSY], 0 ) > 0 )
+    p->stats.bytes_written += p->canned->len[SCGI_CANNED_BUSY];
 
-  d->req = req;
+  p->stats.connections_accepted++;
+  p->stats.connections_closed++;
+  p->stats.closed_by_reason[SCGI_CLOSE_SHED]++;
 
-  SCGI_LINK( req, first_scgi_req, last_scgi_req, next, prev );
+  if ( p->lingering && p->lingering_count < SCGI_MAX_LINGERING
+  &&   caller < FD_SETSIZE && shutdown( caller, SHUT_WR ) == 0 )
+  {
+    l = &p->lingering[p->lingering_count++];
+    l->sock = caller;
+    l->since = scgi_now_usecs();
+    return;
+  }
 
-  SCGI_LINK( d, p->first_scgi_desc, p->last_scgi_desc, next, prev );
+  scgi_drain( p, caller, NULL );
+  close( caller );
+}
 
-  return;
+/*
+ * Answer a connection straight from the event loop, without bothering you (the programmer):
+ * as soon as the connection is ready, txt is sent, and then the connection is closed (with the
+ * specified SCGI_CLOSE_* reason).  txt is sent by reference rather than copied, so it has to
+ * stay put until then (for a port's canned responses, scgi_respond_canned sees to that).
+ */
+void scgi_respond_from_loop( scgi_desc *d, char *txt, int len, int reason )
+{
+  d->state = SCGI_SOCKSTATE_WRITING_RESPONSE;
+  d->writehead = txt;
+  d->outbuflen = len;
+  d->close_reason = reason;
+  d->req->timings.sent = scgi_now_usecs();
 }
 
 /*
- * If more I/O space is needed than allocated, allocate more (up to a limit)
- * Returns 0 (and kills the connection) if the specified limit has been reached
+ * Format the responses a port sends from the event loop (e.g. "503 Service Unavailable"),
+ * once and for all, so they're ready to go when needed.
  */
-int resize_buffer( scgi_desc *d, char **buf )
+void scgi_prepare_canned_responses( scgi_port *p )
 {
-  int max, *size;
-  char *tmp;
+  static char busy_body[] = "503 Service Unavailable: the server is too busy, please try again later.\n";
+  static char expired_body[] = "504 Gateway Timeout: the server was too busy to get to your request in time.\n";
+  static char not_found_body[] = "404 Not Found\n";
 
-  if ( *buf == d->buf )
-  {
-    max = SCGI_MAX_INBUF_SIZE;
-    size = &d->bufsize;
-  }
-  else
-  {
-    max = SCGI_MAX_OUTBUF_SIZE;
-    size = &d->outbufsize;
-  }
+  scgi_canned *c;
 
-  *size *= 2;
-  if ( *size >= max )
-  {
-    scgi_kill_socket(d);
-    return 0;
-  }
+  SCGI_CREATE( c, scgi_canned, 1 );
+
+  c->len[SCGI_CANNED_BUSY] = sprintf( c->response[SCGI_CANNED_BUSY],
+    "Status: 503 Service Unavailable\r\nRetry-After: %d\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s",
+    p->config.retry_after_secs, (int) strlen( busy_body ), busy_body );
+
+  c->len[SCGI_CANNED_EXPIRED] = sprintf( c->response[SCGI_CANNED_EXPIRED],
+    "Status: 504 Gateway Timeout\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s",
+    (int) strlen( expired_body ), expired_body );
+
+  c->len[SCGI_CANNED_NOT_FOUND] = sprintf( c->response[SCGI_CANNED_NOT_FOUND],
+    "Status: 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n%s",
+    (int) strlen( not_found_body ), not_found_body );
 
   /*
-   * Special treatment rather than the usual malloc macro, just because I thought this
-   * particular function might have a bigger risk of sucking up too much RAM and so it
-   * would be better to handle it directly rather than use a generic macro
+   * The old set (if the config is changing) goes once nobody's sending from it any more
+   * (see scgi_kill_socket)
    */
-  tmp = (char *) calloc((*size)+1, sizeof(char) );
-  if ( !tmp )
-  {
-    scgi_deal_with_socket_out_of_ram(d);
-    return 0;
-  }
+  if ( p->canned && !p->canned->users )
+    free( p->canned );
 
-  sprintf( tmp, "%s", *buf );
-  free( *buf );
-  *buf = tmp;
-  return 1;
+  p->canned = c;
 }
 
 /*
- * A socket is ready for us to read (continue reading?) its input!  So read it.
+ * Answer a connection from the event loop (see scgi_respond_from_loop) with one of its port's
+ * canned responses (SCGI_CANNED_*), making sure that set stays put until it's been sent
  */
-void scgi_listen_to_request( scgi_desc *d )
+void scgi_respond_canned( scgi_desc *d, int which, int reason )
 {
-  int start = d->buflen, readsize;
+  scgi_canned *c;
 
-  /*
-   * If their buffer is sufficiently near full and there's still more to be read,
-   * then increase the buffer.  If they're spamming with an enormous request,
-   * the connection will be terminated in resize_buffer.
-   */
-  if ( start >= d->bufsize - 5 )
-  {
-    if ( !resize_buffer( d, &d->buf ) )
-      return;
-  }
+  if ( !d->port->canned )
+    scgi_prepare_canned_responses( d->port );
 
-  /*
-   * Read as much as we can.  Can't wait around, since there may be other connections to attend to,
-   * so just read as much as possible and make a note of how much that was (the socket is non-blocking
-   * so this won't cause us to hang even if the incoming message would otherwise take time to recv)
-   */
-  readsize = recv( d->sock, d->buf + start, d->bufsize - 5 - start, 0 );
+  c = d->port->canned;
+  c->users++;
+  d->canned = c;
 
-  /*
-   * There's new input, successfully read and stored in memory!  Let's parse it and figure out what
-   * the heck they're asking for!  (Who knows whether we've got their full transmission or whether
-   * there's still more in the pipeline-- we'll let the parser figure that out based on the SCGI
-   * protocol)
+  scgi_respond_from_loop( d, c->response[which], c->len[which], reason );
+}
+
+/*
+ * Decide which requests to turn away (with a 503) when a port's queue is full.
+ * When a request is ready but the port already has max_unrecved_requests requests waiting
+ * for scgi_recv, the hook is called with it: return nonzero to turn it away, or 0 to queue
+ * it anyway (e.g. for health checks, or your most important customers).
+ * With no hook (the default, or pass NULL), everything past the limit is turned away.
+ */
+void scgi_set_shed_hook( scgi_shed_hook *hook )
+{
+  scgi_shed_hook_fn = hook;
+}
+
+/*
+ * Set up the connection table (see SCGI_MAX_SOCKET_SLOTS), if it isn't already.
+ * It's calloc'd, so the operating system only hands us memory for the parts we actually use.
+ * Returns 0 if there isn't enough RAM.
+ */
+int scgi_init_connection_table( void )
+{
+  struct rlimit rl;
+
+  if ( scgi_slots )
+    return 1;
+
+  if ( getrlimit( RLIMIT_NOFILE, &rl ) == -1 || rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > SCGI_MAX_SOCKET_SLOTS )
+    scgi_socket_slots = SCGI_MAX_SOCKET_SLOTS;
+  else
+    scgi_socket_slots = rl.rlim_cur;
+
+  scgi_total_slots = scgi_socket_slots + SCGI_VIRTUAL_SLOTS;
+
+  scgi_slots = (scgi_slot *) calloc( scgi_total_slots, sizeof(scgi_slot) );
+
+  return scgi_slots != NULL;
+}
+
+/*
+ * Find a slot in the connection table for a new connection: the socket's own slot, or for a
+ * connection without a socket (sock < 0), any free slot beyond the sockets' ones.
+ * Returns -1 if there isn't one.
+ */
+int scgi_claim_slot( int sock )
+{
+  int i;
+
+  if ( !scgi_init_connection_table() )
+    return -1;
+
+  if ( sock >= 0 )
+  {
+    if ( sock >= scgi_socket_slots || scgi_slots[sock].in_use )
+      return -1;
+    i = sock;
+  }
+  else
+  {
+    for ( i = scgi_socket_slots; i < scgi_total_slots; i++ )
+      if ( !scgi_slots[i].in_use )
+        break;
+
+    if ( i == scgi_total_slots )
+      return -1;
+  }
+
+  scgi_slots[i].in_use = 1;
+
+  if ( sock >= 0 && i >= scgi_top_slot )
+    scgi_top_slot = i + 1;
+  if ( sock < 0 && i >= scgi_top_virtual_slot )
+    scgi_top_virtual_slot = i + 1;
+
+  return i;
+}
+
+/*
+ * The connection has been made.  Let's commit it to RAM.
+ * (Split out of scgi_answer_the_phone so that a connection can be set up on a socket
+ *  which came from somewhere other than accept -- e.g. bench/parsebench uses this
+ *  to drive the parser without any sockets at all, passing -1 for the socket.)
+ * Returns NULL if there's no room in the connection table, or no memory for the connection.
+ */
+scgi_desc *scgi_new_connection( scgi_port *p, int sock )
+{
+  scgi_desc *d;
+  scgi_request *req;
+  char *outbuf;
+  int slot;
+
+  if ( !scgi_memory_charge( p->config.initial_outbuf_size + 1L ) )
+    return NULL;
+
+  outbuf = (char *) malloc( p->config.initial_outbuf_size + 1 );
+  req = (scgi_request *) calloc( 1, sizeof(scgi_request) );
+
+  if ( !outbuf || !req || ( slot = scgi_claim_slot( sock ) ) < 0 )
+  {
+    free( outbuf );
+    free( req );
+    scgi_memory_charge( -( p->config.initial_outbuf_size + 1L ) );
+    return NULL;
+  }
+
+  d = &scgi_slots[slot].desc;
+  memset( d, 0, sizeof(scgi_desc) );
+  d->port = p;
+  d->sock = sock;
+  d->bytes_received = 0;
+  d->state = SCGI_SOCKSTATE_READING_REQUEST;
+  d->close_reason = SCGI_CLOSE_COMPLETED;
+  d->writehead = NULL;
+  d->parsed_chars = 0;
+  d->string_starts = NULL;
+  d->parser_state = SCGI_PARSE_HEADLENGTH;
+
+  /*
+   * No input buffer until we need one (see scgi_consume_input)
+   */
+  d->buf = NULL;
+  d->bufsize = 0;
+  d->buflen = 0;
+  d->buf_borrowed = 0;
+
+  d->outbuf = outbuf;
+  d->outbufsize = p->config.initial_outbuf_size;
+  d->outbuflen = 0;
+  *d->outbuf = '\0';
+  d->building = 0;
+  d->build_failed = 0;
+  d->body_starts = 0;
+
+  req->next_unrecved = NULL;
+  req->prev_unrecved = NULL;
+  req->descriptor = d;
+  memset( &req->timings, 0, sizeof(req->timings) );
+  req->timings.accepted = scgi_now_usecs();
+  d->last_active = req->timings.accepted;
+
+  req->first_header = NULL;
+  req->last_header = NULL;
+  req->header_index = NULL;
+  req->header_index_size = 0;
+  req->query_params = NULL;
+  req->query_param_count = -1;
+  req->cookies = NULL;
+  req->cookie_count = -1;
+  req->decoded = NULL;
+  req->decoded_len = 0;
+  req->arena = NULL;
+  req->priority = 0;
+  req->userdata = NULL;
+  req->body = NULL;
+  req->scgi_content_length = -1;
+  req->scgi_scgiheader = 0;
+  req->dead = NULL;
+
+  req->request_method = SCGI_METHOD_UNSPECIFIED;
+  req->http_host = NULL;
+  req->query_string = NULL;
+  req->request_uri = NULL;
+  req->http_cache_control = NULL;
+  req->raw_http_cookie = NULL;
+  req->http_connection = NULL;
+  req->http_accept_encoding = NULL;
+  req->http_accept_language = NULL;
+  req->http_accept_charset = NULL;
+  req->http_accept = NULL;
+  req->user_agent = NULL;
+  req->remote_addr = NULL;
+  req->server_port = NULL;
+  req->server_addr = NULL;
+  req->server_protocol = NULL;
+
+  d->req = req;
+
+  p->stats.connections_accepted++;
+  p->stats.open_connections++;
+
+  return d;
+}
+
+/*
+ * A socket is ready for us to read (continue reading?) its input!  So read it.
+ */
+void scgi_listen_to_request( scgi_desc *d )
+{
+  static char scratch[SCGI_SCRATCH_SIZE];
+  int readsize;
+
+  /*
+   * Read as much as there is, until the socket says "that's all for now" (the socket is non-blocking
+   * so this won't cause us to hang even if the rest of the message would take time to arrive).
+   * Everything is read into one scratch buffer shared by all connections, and only gets copied
+   * somewhere more permanent if their request is still incomplete (see scgi_consume_input).
    */
-  if ( readsize > 0 )
+  for ( ; ; )
   {
-    d->buflen += readsize;
-    scgi_parse_input( d );
+    if ( d->transport )
+      readsize = (*d->transport->recv)( d, scratch, SCGI_SCRATCH_SIZE );
+    else
+      readsize = recv( d->sock, scratch, SCGI_SCRATCH_SIZE, 0 );
+
+    /*
+     * There's new input!  Let's parse it and figure out what the heck they're asking for!
+     * (Who knows whether we've got their full transmission or whether there's still more in the
+     * pipeline-- we'll let the parser figure that out based on the SCGI protocol)
+     */
+    if ( readsize > 0 )
+    {
+      if ( !d->req->timings.first_byte )
+        d->req->timings.first_byte = scgi_now_usecs();
+      if ( scgi_capture_file )
+        scgi_capture( d, scratch, readsize );
+      d->port->stats.bytes_read += readsize;
+      d->bytes_received += readsize;
+
+      /*
+       * If the connection's been killed, or their request has been turned away (and what's
+       * left of it is for scgi_discard_input to deal with), we're done here
+       */
+      if ( scgi_consume_input( d, scratch, readsize ) != 1 )
+        return;
+
+      /*
+       * Once the request is complete, anything else they send is none of our business.
+       * If it's for a route's handler, it's only safe to call that now that the parser's let go.
+       */
+      if ( d->parser_state == SCGI_PARSE_DONE )
+      {
+        if ( d->route )
+          scgi_run_route_handler( d );
+        return;
+      }
+
+      continue;
+    }
+
+    if ( readsize < 0 && errno == EINTR )
+      continue;
+
+    /*
+     * Nothing more for now; we'll be back when there is.
+     */
+    if ( readsize < 0 && ( errno == EWOULDBLOCK || errno == EAGAIN ) )
+      return;
+
+    /*
+     * Something unexpected happened.  This is the wild untamed internet, so kill the connection first and
+     * ask questions later.
+     */
+    scgi_kill_socket( d, readsize == 0 ? SCGI_CLOSE_EOF : SCGI_CLOSE_RECV_ERROR );
     return;
   }
+}
+
+/*
+ * Feed len bytes of a connection's input to the parser.
+ *
+ * If we haven't kept anything from them so far, the bytes are parsed right where they are
+ * (typically, the scratch buffer they were read into).  Most requests arrive in one piece, and
+ * then that's all there is to it: the parser copies what it needs into the request's arena, and
+ * the connection never needs an input buffer of its own.  Only if the request is still incomplete
+ * is what we've got so far copied into an input buffer for the connection, sized exactly (as far as
+ * we can tell how much is coming), and later bytes are added to that.
+ *
+ * Returns 1 if all's well, 0 if the connection was killed, or -1 if their request was turned
+ * away (see scgi_keep_input): the connection is still there, sending the 503.
+ */
+int scgi_consume_input( scgi_desc *d, char *data, int len )
+{
+  int status;
+
+  if ( !d->buf )
+  {
+    d->buf = data;
+    d->buflen = len;
+    d->bufsize = len;
+    d->buf_borrowed = 1;
+
+    if ( !( status = scgi_parse_input( d ) ) )
+      return 0;
+
+    /*
+     * The bytes were only borrowed, so scgi_release_input just lets go of them
+     */
+    if ( status < 0 || d->parser_state == SCGI_PARSE_DONE )
+    {
+      scgi_release_input( d );
+      return status;
+    }
+
+    /*
+     * Still incomplete: scgi_keep_input copies what we've got (string_starts, which points into
+     * it, moves along)
+     */
+    d->buf_borrowed = 0;
+    d->buf = NULL;
+    d->buflen = 0;
+    d->bufsize = 0;
+  }
+
+  if ( ( status = scgi_keep_input( d, data, len ) ) != 1
+  ||   ( status = scgi_parse_input( d ) ) == 0 )
+    return status;
 
   /*
-   * Something unexpected happened.  This is the wild untamed internet, so kill the connection first and
-   * ask questions later.
+   * Once the request is complete (or turned away), everything we need is in its arena, so the
+   * input buffer can go
    */
-  if ( readsize == 0 || errno != EWOULDBLOCK )
+  if ( status < 0 || d->parser_state == SCGI_PARSE_DONE )
+    scgi_release_input( d );
+
+  return status;
+}
+
+/*
+ * Under memory pressure (past the soft limit: see scgi_set_memory_budget), turn away a request
+ * which is going to need more than SCGI_MEMORY_LARGE_REQUEST bytes, with a 503.  The rest of their
+ * request is read and thrown away (see scgi_discard_input), so that they get to see it.
+ * Returns 1 if the request was turned away.
+ */
+int scgi_turn_away_large_request( scgi_desc *d, long long size )
+{
+  if ( size <= SCGI_MEMORY_LARGE_REQUEST
+  ||   scgi_memory_soft_limit <= 0 || scgi_memory_used < scgi_memory_soft_limit )
+    return 0;
+
+  d->discarding = 1;
+  scgi_respond_canned( d, SCGI_CANNED_BUSY, SCGI_CLOSE_MEMORY_BUDGET );
+
+  return 1;
+}
+
+/*
+ * Let go of a connection's input buffer: free it, unless it was only borrowed (see scgi_consume_input)
+ */
+void scgi_release_input( scgi_desc *d )
+{
+  if ( d->buf && !d->buf_borrowed )
   {
-    scgi_kill_socket( d );
-    return;
+    free( d->buf );
+    scgi_memory_charge( -( d->bufsize + 1L ) );
+  }
+
+  d->buf = NULL;
+  d->buflen = 0;
+  d->bufsize = 0;
+  d->buf_borrowed = 0;
+  d->string_starts = NULL;
+}
+
+/*
+ * Add bytes to a connection's input buffer, growing it to fit.  If we know how long their request
+ * (or at least its headers) is going to be, make it exactly that big right away, so that it doesn't
+ * have to keep growing as the rest arrives.  The parser remembers where the current string started,
+ * so if that's in the buffer being moved, it has to move along with it.
+ *
+ * Returns 1 if all's well, or 0 (and kills the connection) if the request is bigger than
+ * max_inbuf_size, or we're out of RAM or memory budget.  Under memory pressure, a large request
+ * which is just starting to need a buffer gets a 503 instead, and -1 is returned: the connection
+ * stays open while the rest of their request is read and thrown away (see scgi_discard_input),
+ * so that they get to see the 503.
+ */
+int scgi_keep_input( scgi_desc *d, char *data, int len )
+{
+  int want = d->buflen + len, max = d->port->config.max_inbuf_size, starts_at;
+  char *tmp;
+
+  if ( want > max )
+  {
+    scgi_kill_socket( d, SCGI_CLOSE_INBUF_OVERFLOW );
+    return 0;
+  }
+
+  if ( want > d->bufsize )
+  {
+    if ( d->parser_state == SCGI_PARSE_BODY && (long long) d->true_header_length + d->req->scgi_content_length > want )
+      want = d->true_header_length + d->req->scgi_content_length;
+    else
+    if ( ( d->parser_state == SCGI_PARSE_HEADNAME || d->parser_state == SCGI_PARSE_HEADVAL ) && d->true_header_length > want )
+      want = d->true_header_length;
+
+    if ( want > max )
+      want = max;
+
+    if ( !d->bufsize && scgi_turn_away_large_request( d, want ) )
+      return -1;
+
+    if ( !scgi_memory_charge( want + 1L - ( d->bufsize ? d->bufsize + 1L : 0 ) ) )
+    {
+      scgi_kill_socket( d, SCGI_CLOSE_MEMORY_BUDGET );
+      return 0;
+    }
+
+    starts_at = d->string_starts ? d->string_starts - ( d->buflen ? d->buf : data ) : -1;
+
+    tmp = (char *) realloc( d->buf, want + 1 );
+
+    if ( !tmp )
+    {
+      scgi_memory_charge( -( want + 1L - ( d->bufsize ? d->bufsize + 1L : 0 ) ) );
+      scgi_deal_with_socket_out_of_ram( d );
+      return 0;
+    }
+
+    if ( d->bufsize )
+      d->port->stats.buffer_resizes++;
+
+    if ( starts_at >= 0 )
+      d->string_starts = tmp + starts_at;
+
+    d->buf = tmp;
+    d->bufsize = want;
   }
+
+  memcpy( &d->buf[d->buflen], data, len );
+  d->buflen += len;
+  d->buf[d->buflen] = '\0';
+
+  return 1;
+}
+
+/*
+ * Is a connection taking too long to send its request?  Returns why (an SCGI_CLOSE_* reason),
+ * or -1 if it's doing fine.
+ */
+int scgi_too_slow( scgi_desc *d, long long now )
+{
+  scgi_config *cfg = &d->port->config;
+  scgi_timings *t = &d->req->timings;
+  long long elapsed;
+
+  /*
+   * Once their request is all here, they've done their part; any waiting from then on is ours
+   */
+  if ( d->parser_state == SCGI_PARSE_DONE )
+    return -1;
+
+  if ( cfg->header_timeout_msecs > 0 && !t->headers_done
+  &&   now - t->accepted > cfg->header_timeout_msecs * 1000LL )
+    return SCGI_CLOSE_HEADER_TIMEOUT;
+
+  if ( cfg->body_timeout_msecs > 0 && t->headers_done
+  &&   now - t->headers_done > cfg->body_timeout_msecs * 1000LL )
+    return SCGI_CLOSE_BODY_TIMEOUT;
+
+  /*
+   * Everyone gets a little while to get going before we hold them to the minimum rate
+   */
+  elapsed = now - t->accepted - SCGI_RATE_GRACE_MSECS * 1000LL;
+
+  if ( cfg->min_bytes_per_sec > 0 && elapsed > 0
+  &&   d->bytes_received < cfg->min_bytes_per_sec * elapsed / 1000000 )
+    return SCGI_CLOSE_TOO_SLOW;
+
+  return -1;
+}
+
+/*
+ * Kick a misbehaving connection off as cheaply as possible: reset it rather than closing it
+ * politely, so the kernel doesn't keep it around (in TIME_WAIT etc.) on their account.
+ */
+void scgi_evict( scgi_desc *d, int reason )
+{
+  struct linger lg;
+
+  lg.l_onoff = 1;
+  lg.l_linger = 0;
+  if ( d->sock >= 0 )
+    setsockopt( d->sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg) );
+
+  scgi_kill_socket( d, reason );
 }
 
 /*
@@ -421,14 +1221,45 @@ void scgi_flush_response( scgi_desc *d )
    * Don't take too long transmitting, since other connections may be waiting.
    * Send as much as we can right now, and if there's more left, send the rest next time.
    */
-  sent_amount = send(d->sock, d->writehead, d->outbuflen, 0 );
+  if ( d->transport )
+    sent_amount = (*d->transport->send)( d, d->writehead, d->outbuflen );
+  else
+    sent_amount = send(d->sock, d->writehead, d->outbuflen, 0 );
+
+  if ( sent_amount < 0 )
+  {
+    /*
+     * The socket said it was ready but wasn't after all.  No harm done, try again next time.
+     * Anything else means the connection is broken.
+     */
+    if ( errno != EWOULDBLOCK && errno != EAGAIN )
+      scgi_kill_socket( d, SCGI_CLOSE_SEND_ERROR );
+    return;
+  }
+
+  d->port->stats.bytes_written += sent_amount;
 
   /*
    * Transmission complete... Sayonara.
    */
   if ( sent_amount >= d->outbuflen )
   {
-    scgi_kill_socket( d );
+    d->req->timings.flushed = scgi_now_usecs();
+    d->port->stats.responses_flushed++;
+    scgi_histogram_record( &d->port->stats.total_time, d->req->timings.flushed - d->req->timings.accepted );
+
+    /*
+     * If the rest of their request is still coming (see scgi_discard_input), say we're done
+     * talking, and wait for them to finish and hang up
+     */
+    if ( d->discarding && !d->transport && d->sock >= 0 )
+    {
+      d->outbuflen = 0;
+      shutdown( d->sock, SHUT_WR );
+      return;
+    }
+
+    scgi_kill_socket( d, d->close_reason );
     return;
   }
 
@@ -441,6 +1272,39 @@ void scgi_flush_response( scgi_desc *d )
   return;
 }
 
+/*
+ * How long between two timestamps, in milliseconds (0 if either one never happened)
+ */
+double scgi_msecs_between( long long from, long long to )
+{
+  if ( !from || !to )
+    return 0;
+
+  return ( to - from ) / 1000.0;
+}
+
+/*
+ * Complain (to stderr) about a request that took too long, breaking down where the time went:
+ * waiting for them to start talking, waiting for them to finish uploading, sitting in the queue
+ * waiting for scgi_recv, waiting for you to call scgi_send, and waiting for the response to drain.
+ */
+void scgi_log_slow_request( scgi_request *r, int reason )
+{
+  scgi_timings *t = &r->timings;
+
+  fprintf( stderr, "scgilib: slow request on port %d (%s): %.1f ms total = "
+                   "%.1f connect + %.1f upload + %.1f queued + %.1f handler + %.1f drain, closed: %s\n",
+           r->descriptor->port->port,
+           r->request_uri ? r->request_uri : "?",
+           scgi_msecs_between( t->accepted, t->closed ),
+           scgi_msecs_between( t->accepted, t->first_byte ),
+           scgi_msecs_between( t->first_byte, t->body_done ),
+           scgi_msecs_between( t->body_done, t->recved ),
+           scgi_msecs_between( t->recved, t->sent ),
+           scgi_msecs_between( t->sent, t->flushed ),
+           scgi_close_reason_name( reason ) );
+}
+
 void scgi_perror( char *txt )
 {
   fprintf( stderr, "%s\n", txt );
@@ -454,17 +1318,21 @@ void scgi_perror( char *txt )
  * way to tell without parsing, so the parser must be capable of stopping,
  * remembering where it left off, and indicating as much (which it does via
  * states in the descriptor structure).
+ * Returns 0 if it had to kill the connection, -1 if the request was turned away (see
+ * scgi_turn_away_large_request), or 1 otherwise.
  */
-void scgi_parse_input( scgi_desc *d )
+int scgi_parse_input( scgi_desc *d )
 {
-  char *parser = &d->buf[d->parsed_chars], *end, *headername, *headerval;
-  int len, total_req_length, headernamelen;
+  char *parser = &d->buf[d->parsed_chars], *end, *headername, *headerval, *nul;
+  int len, digits, headernamelen, headervallen, scan_to;
+  unsigned long headlen;
 
   /*
    * Everything has already been parsed, so do nothing until new input arrives.
+   * (Or the request is complete and anything else they send is none of our business.)
    */
-  if ( d->parsed_chars == d->buflen )
-    return;
+  if ( d->parsed_chars == d->buflen || d->parser_state == SCGI_PARSE_DONE )
+    return 1;
 
   /*
    * If they are not following the SCGI protocol, we have no choice but to hang up on them.
@@ -474,8 +1342,8 @@ void scgi_parse_input( scgi_desc *d )
    */
   if ( d->parsed_chars == 0 && (*d->buf == '0' || *d->buf == ':') )
   {
-    scgi_kill_socket(d);
-    return;
+    scgi_kill_socket( d, SCGI_CLOSE_BAD_NETSTRING );
+    return 0;
   }
 
   end = &d->buf[d->buflen];
@@ -491,8 +1359,6 @@ scgi_parse_input_label:
     case SCGI_PARSE_HEADLENGTH:   // Oh yeah, we were in the middle of reading the length of their headers.  (This is the default state)
       while ( parser < end )
       {
-        d->parsed_chars++;
-
         /*
          * The end of the header length is indicated by :, we've successfully read the header's length.
          */
@@ -503,167 +1369,325 @@ scgi_parse_input_label:
            * Replace the colon with an end-of-string so we can use strtoul to read the number.
            */
           *parser = '\0';
-          d->true_header_length = strtoul(d->buf,NULL,10) + strlen(d->buf) + 2;
+          headlen = strtoul(d->buf,NULL,10);
           *parser = ':'; // undo the end-of-string change we made above
-          parser++;
-          d->string_starts = parser;
-          goto scgi_parse_input_label;
-        }
-        if ( *parser < '0' || *parser > '9' )
-        {
+
           /*
-           * If they're trying to indicate a non-number length, they're making a mockery of the SCGI protocol,
-           * kick them right out.
+           * If their headers alone wouldn't fit in the input buffer limit, there's no point
+           * waiting for them (and the length mustn't be allowed to overflow true_header_length).
            */
-          scgi_kill_socket(d);
-          return;
-        }
-        parser++;
-      }
-      break;
-
-    case SCGI_PARSE_HEADNAME: // Oh yeah, we were in the middle of reading a header's name.
-      while ( parser < end )
-      {
-        d->parsed_chars++;
-
-        if ( d->parsed_chars == d->true_header_length )
-        {
-          /*
-           * If we're supposedly at the end of the headers (based on the length they transmitted),
-           * but the headers don't end with "\0,", then it's invalid SCGI.  Been nice knowing you...
-           */
-          if ( *parser != ',' || parser[-1] != '\0' )
+          digits = parser - d->buf;
+          if ( headlen > (unsigned long) d->port->config.max_inbuf_size
+          ||   headlen + digits + 2 > (unsigned long) d->port->config.max_inbuf_size )
           {
-            scgi_kill_socket(d);
-            return;
+            scgi_kill_socket( d, SCGI_CLOSE_INBUF_OVERFLOW );
+            return 0;
           }
 
+          d->true_header_length = headlen + digits + 2;
+          parser++;
+          d->string_starts = parser;
+
           /*
-           * They didn't send an "SCGI" header with value 1.
-           * Are they using some different protocol?  Whatever, not our problem.  Door's that way.
+           * No need to wait until a large request has arrived before deciding we can't afford it
            */
-          if ( !d->req->scgi_scgiheader )
-          {
-            scgi_kill_socket(d);
-            return;
-          }
+          if ( scgi_turn_away_large_request( d, d->true_header_length ) )
+            return -1;
 
           /*
-           * If their headers indicated that no body is coming, then we're done.
-           * Put the parsed request in the list of requests which have been parsed but not yet
-           * communicated to you (the programmer of whatever program is including scgilib).
+           * Now that we know how long their headers are, we can guess how much room everything
+           * about the request will need (a copy of each header's name and value, a structure for
+           * each header, and some to spare), and grab it all in one go.  But no more than the
+           * input buffer limit allows, in case they're lying about the length.
            */
-          if ( d->req->scgi_content_length == 0 )
+          len = d->true_header_length < d->port->config.max_inbuf_size ? d->true_header_length : d->port->config.max_inbuf_size;
+          if ( !scgi_arena_add_chunk( d->req, 2 * len + SCGI_ARENA_SPARE ) )
           {
-            SCGI_CREATE( d->req->body, char, 2 );
-
-            *d->req->body = '\0';
-
-            SCGI_LINK( d->req, first_scgi_unrecved_req, last_scgi_unrecved_req, next_unrecved, prev_unrecved );
-            return;
+            scgi_deal_with_socket_out_of_ram( d );
+            return 0;
           }
-          len = strtoul(d->req->first_header->value,NULL,10);
-          d->true_request_length = len + d->true_header_length;
-          parser++;
-          d->string_starts = parser;
-
+          goto scgi_parse_input_label;
+        }
+        if ( *parser < '0' || *parser > '9' )
+        {
           /*
-           * Next task is to start reading the body after the headers
+           * If they're trying to indicate a non-number length, they're making a mockery of the SCGI protocol,
+           * kick them right out.
            */
-          d->parser_state = SCGI_PARSE_BODY;
-
-          goto scgi_parse_input_label;
+          scgi_kill_socket( d, SCGI_CLOSE_BAD_NETSTRING );
+          return 0;
         }
+        parser++;
 
         /*
-         * A '\0' indicates the end of the header's name.
+         * Nor do we wait around for a number with more digits than any length we'd accept
          */
-        if ( *parser == '\0' )
+        if ( parser - d->buf > SCGI_MAX_LENGTH_DIGITS )
         {
-          /*
-           * Of course, a header with the empty string as its name is forbidden and no such
-           * nonsense will be tolerated.
-           */
-          if ( parser == d->string_starts )
-          {
-            scgi_kill_socket(d);
-            return;
-          }
-
-          /*
-           * Having a header's name, our next task is to parse its value.
-           */
-          d->parser_state = SCGI_PARSE_HEADVAL;
-          parser++;
-          goto scgi_parse_input_label;
+          scgi_kill_socket( d, SCGI_CLOSE_BAD_NETSTRING );
+          return 0;
         }
-        parser++;
       }
       break;
 
-    case SCGI_PARSE_HEADVAL:
-      while ( parser < end )
+    case SCGI_PARSE_HEADNAME: // Oh yeah, we were in the middle of reading a header's name.
+      /*
+       * Rather than crawl along one byte at a time, let memchr find the '\0' which ends the
+       * header's name.  Any decent C library vectorizes memchr (glibc, for instance, picks an
+       * SSE2/AVX2/etc. version at runtime to suit the CPU), so this goes at memory speed.
+       * We mustn't look past the ',' which ends the headers, though: true_header_length - 1
+       * is where that ',' is supposed to be.
+       */
+      scan_to = scgi_header_scan_end( d, parser );
+      nul = memchr( parser, '\0', &d->buf[scan_to] - parser );
+
+      /*
+       * A '\0' indicates the end of the header's name.
+       */
+      if ( nul )
       {
-        d->parsed_chars++;
+        /*
+         * Of course, a header with the empty string as its name is forbidden and no such
+         * nonsense will be tolerated.
+         */
+        if ( nul == d->string_starts )
+        {
+          scgi_kill_socket( d, SCGI_CLOSE_BAD_HEADER );
+          return 0;
+        }
 
         /*
-         * We expected a header value, and instead we reached the end of the headers (according to
-         * the header length they specified)?!  Nope.jpg
+         * Having a header's name, our next task is to parse its value.
          */
-        if ( d->parsed_chars == d->true_header_length )
+        d->parser_state = SCGI_PARSE_HEADVAL;
+        parser = nul + 1;
+        goto scgi_parse_input_label;
+      }
+
+      parser = &d->buf[scan_to];
+
+      /*
+       * No more header names, and the place where the headers are supposed to end hasn't
+       * arrived yet.  Wait for more input.
+       */
+      if ( scan_to == d->buflen )
+        break;
+
+      /*
+       * If we're supposedly at the end of the headers (based on the length they transmitted),
+       * but the headers don't end with "\0,", then it's invalid SCGI.  Been nice knowing you...
+       */
+      if ( *parser != ',' || parser[-1] != '\0' )
+      {
+        scgi_kill_socket( d, SCGI_CLOSE_BAD_NETSTRING );
+        return 0;
+      }
+
+      /*
+       * They didn't send an "SCGI" header with value 1.
+       * Are they using some different protocol?  Whatever, not our problem.  Door's that way.
+       */
+      if ( !d->req->scgi_scgiheader )
+      {
+        scgi_kill_socket( d, SCGI_CLOSE_NO_SCGI_HEADER );
+        return 0;
+      }
+
+      d->req->timings.headers_done = scgi_now_usecs();
+
+      /*
+       * If their headers indicated that no body is coming, then we're done.
+       * Put the parsed request in the list of requests which have been parsed but not yet
+       * communicated to you (the programmer of whatever program is including scgilib).
+       */
+      if ( d->req->scgi_content_length == 0 )
+      {
+        if ( !( d->req->body = scgi_arena_alloc( d->req, 1, 1 ) ) )
         {
-          scgi_kill_socket(d);
-          return;
+          scgi_deal_with_socket_out_of_ram( d );
+          return 0;
         }
 
+        *d->req->body = '\0';
+
+        scgi_request_is_ready( d );
+        return 1;
+      }
+      d->true_request_length = d->true_header_length + d->req->scgi_content_length;
+      parser++;
+      d->string_starts = parser;
+
+      if ( scgi_turn_away_large_request( d, d->true_request_length ) )
+        return -1;
+
+      /*
+       * Next task is to start reading the body after the headers
+       */
+      d->parser_state = SCGI_PARSE_BODY;
+
+      goto scgi_parse_input_label;
+
+    case SCGI_PARSE_HEADVAL:
+      /*
+       * Same idea as for the header's name: find the '\0' which ends the value.
+       */
+      scan_to = scgi_header_scan_end( d, parser );
+      nul = memchr( parser, '\0', &d->buf[scan_to] - parser );
+
+      if ( !nul )
+      {
         /*
-         * We've successfully read the value of the current header.
-         * Create a structure for this header and store it.
+         * We expected a header value, and instead we reached the end of the headers (according to
+         * the header length they specified)?!  Nope.jpg
          */
-        if ( *parser == '\0' )
+        if ( scan_to < d->buflen )
         {
-          headernamelen = strlen(d->string_starts);
-          SCGI_CREATE( headername, char, headernamelen+1 );
-          sprintf( headername, "%s", d->string_starts );
-          SCGI_CREATE( headerval, char, strlen(&d->string_starts[headernamelen+1])+1 );
-          sprintf( headerval, "%s", &d->string_starts[headernamelen+1] );
-          if ( !scgi_add_header( d, headername, headerval ) )
-            return;
-          /*
-           * Next task: parse the next header's name.
-           */
-          d->parser_state = SCGI_PARSE_HEADNAME;
-          parser++;
-          d->string_starts = parser;
-          goto scgi_parse_input_label;
+          scgi_kill_socket( d, SCGI_CLOSE_BAD_HEADER );
+          return 0;
         }
-        parser++;
+
+        parser = end;
+        break;
       }
-      break;
+
+      /*
+       * We've successfully read the value of the current header.
+       * Create a structure for this header and store it.
+       */
+      headernamelen = strlen(d->string_starts);
+      headervallen = nul - &d->string_starts[headernamelen+1];
+      headername = scgi_arena_alloc( d->req, headernamelen + headervallen + 2, 1 );
+      if ( !headername )
+      {
+        scgi_deal_with_socket_out_of_ram( d );
+        return 0;
+      }
+      memcpy( headername, d->string_starts, headernamelen + headervallen + 2 );
+      headerval = &headername[headernamelen+1];
+      if ( !scgi_add_header( d, headername, headerval ) )
+        return 0;
+      /*
+       * Next task: parse the next header's name.
+       */
+      d->parser_state = SCGI_PARSE_HEADNAME;
+      parser = nul + 1;
+      d->string_starts = parser;
+      goto scgi_parse_input_label;
 
     case SCGI_PARSE_BODY:
-      total_req_length = d->true_header_length + d->req->scgi_content_length;
+      /*
+       * We know exactly how long the body is, so there's no need to look at it: either
+       * all of it has arrived or it hasn't.
+       */
+      if ( d->buflen < (long long) d->true_header_length + d->req->scgi_content_length )
+      {
+        parser = end;
+        break;
+      }
 
-      while ( parser < end )
+      /*
+       * The body may well contain \0's (e.g. a file upload), so copy it byte for byte rather
+       * than as a string.  We still tack on a \0 for the convenience of text bodies.
+       */
+      d->req->body = scgi_arena_alloc( d->req, d->req->scgi_content_length + 1, 1 );
+      if ( !d->req->body )
       {
-        d->parsed_chars++;
+        scgi_deal_with_socket_out_of_ram( d );
+        return 0;
+      }
+      memcpy( d->req->body, d->string_starts, d->req->scgi_content_length );
+      d->req->body[d->req->scgi_content_length] = '\0';
+      scgi_request_is_ready( d );
 
-        if ( d->parsed_chars == total_req_length )
-        {
-          parser[1] = '\0';
-          SCGI_CREATE( d->req->body, char, strlen(d->string_starts)+1 );
-          sprintf( d->req->body, "%s", d->string_starts );
-          SCGI_LINK( d->req, first_scgi_unrecved_req, last_scgi_unrecved_req, next_unrecved, prev_unrecved );
+      return 1;
+  }
 
-          return;
-        }
-        parser++;
-      }
-      break;
+  /*
+   * Make a note of how far we got, so we can pick up where we left off when more input arrives
+   */
+  d->parsed_chars = parser - d->buf;
+
+  return 1;
+}
+
+/*
+ * Where the parser should stop looking for the end of a header's name or value: at the ',' which
+ * ends the headers (true_header_length - 1), or the end of what's arrived so far, whichever comes
+ * first, but never before where it's looking from.
+ */
+int scgi_header_scan_end( scgi_desc *d, char *parser )
+{
+  int scan_to = d->true_header_length - 1 < d->buflen ? d->true_header_length - 1 : d->buflen;
+
+  if ( scan_to < parser - d->buf )
+    scan_to = parser - d->buf;
+
+  return scan_to;
+}
+
+/*
+ * A request has been completely parsed.
+ * Put it in the list of requests which have been parsed but not yet communicated to
+ * you (the programmer of whatever program is including scgilib).
+ */
+void scgi_request_is_ready( scgi_desc *d )
+{
+  scgi_stats *s = &d->port->stats;
+
+  d->parser_state = SCGI_PARSE_DONE;
+
+  d->req->timings.body_done = scgi_now_usecs();
+
+  s->requests_parsed++;
+  scgi_histogram_record( &s->parse_time, d->req->timings.body_done - d->req->timings.first_byte );
+
+  /*
+   * If we've got the response on file, there's no need to bother you (the programmer) at all.
+   */
+  if ( first_scgi_static_response
+  &&   ( d->req->request_method == SCGI_METHOD_GET || d->req->request_method == SCGI_METHOD_HEAD )
+  &&   scgi_answer_with_static_response( d ) )
+  {
+    s->static_hits++;
+    return;
   }
 
-  return;
+  if ( first_scgi_cache_entry
+  &&   ( d->req->request_method == SCGI_METHOD_GET || d->req->request_method == SCGI_METHOD_HEAD ) )
+  {
+    if ( scgi_answer_from_cache( d ) )
+    {
+      s->cache_hits++;
+      return;
+    }
+    s->cache_misses++;
+  }
+
+  /*
+   * If you've registered routes, requests go wherever those say (or get a 404)
+   */
+  if ( scgi_route_count && !scgi_dispatch_route( d ) )
+    return;
+
+  /*
+   * If the queue is already full, it's better to tell them "too busy" right away than to make
+   * them wait in an ever-growing line.
+   */
+  if ( d->port->config.max_unrecved_requests > 0
+  &&   s->unrecved_requests >= d->port->config.max_unrecved_requests
+  &&   ( !scgi_shed_hook_fn || (*scgi_shed_hook_fn)( d->req ) ) )
+  {
+    scgi_respond_canned( d, SCGI_CANNED_BUSY, SCGI_CLOSE_SHED );
+    return;
+  }
+
+  if ( scgi_priority_hook_fn )
+    d->req->priority = (*scgi_priority_hook_fn)( d->req );
+
+  d->req->timings.queued = scgi_now_usecs();
+
+  SCGI_LINK( d->req, first_scgi_unrecved_req, last_scgi_unrecved_req, next_unrecved, prev_unrecved );
+  s->unrecved_requests++;
 }
 
 /*
@@ -679,6 +1703,7 @@ scgi_parse_input_label:
 int scgi_add_header( scgi_desc *d, char *name, char *val )
 {
   scgi_header *h;
+  unsigned long long content_length;
 
   /*
    * First header is required to be CONTENT_LENGTH and have a nonnegative numeric value.
@@ -686,28 +1711,37 @@ int scgi_add_header( scgi_desc *d, char *name, char *val )
   if ( !d->req->first_header )
   {
     if ( strcmp( name, "CONTENT_LENGTH" )
-    ||  !scgi_is_number( val ) )
+    ||  !scgi_is_number( val )
+    ||   *val == '-' )
     {
-      free( name );
-      free( val );
-      scgi_kill_socket(d);
+      scgi_kill_socket( d, SCGI_CLOSE_BAD_HEADER );
       return 0;
     }
 
-    d->req->scgi_content_length = strtoul(val,NULL,10);
+    /*
+     * A body which wouldn't fit in the input buffer limit along with the headers is refused
+     * right away, rather than waited for
+     */
+    content_length = strtoull(val,NULL,10);
 
-    if ( d->req->scgi_content_length < 0 )
+    if ( content_length > (unsigned long long) ( d->port->config.max_inbuf_size - d->true_header_length ) )
     {
-      free( name );
-      free( val );
-      scgi_kill_socket(d);
+      scgi_kill_socket( d, SCGI_CLOSE_INBUF_OVERFLOW );
       return 0;
     }
+
+    d->req->scgi_content_length = (int) content_length;
   }
 
-  SCGI_CREATE( h, scgi_header, 1 );
+  h = scgi_arena_alloc( d->req, sizeof(scgi_header), SCGI_ARENA_ALIGN );
+  if ( !h )
+  {
+    scgi_deal_with_socket_out_of_ram( d );
+    return 0;
+  }
   h->name = name;
   h->value = val;
+  h->hash = 0;
 
   SCGI_LINK( h, d->req->first_header, d->req->last_header, next, prev );
 
@@ -749,204 +1783,2838 @@ int scgi_add_header( scgi_desc *d, char *name, char *val )
 }
 
 /*
- * Function to check whether a string is a number
- */
-int scgi_is_number( char *arg )
-{
-    int first = 1;
-    if ( *arg == '\0' )
-        return 0;
-
-    for ( ; *arg != '\0'; arg++ )
-    {
-        if ( first && *arg == '-')
-        {
-                first = 0;
-                continue;
-        }
-        if ( !isdigit(*arg) )
-            return 0;
-        first = 0;
-    }
-
-    return 1;
-}
-
-void scgi_deal_with_socket_out_of_ram( scgi_desc *d )
-{
-  scgi_kill_socket( d );
-}
-
-/*
- * Function to initialize the SCGI C Library (and start it listening on the specified port).
- * Returns 0 on failure.
- * May be called multiple times with different port numbers, if you want a single program
- * listening on different ports.
+ * Every request has an arena: a list of big chunks of memory which all the request's
+ * allocations (header names and values, header structures, the body, and so on) are carved
+ * out of, one after the other.  When the request is done, the chunks are freed, and that's
+ * all the cleanup there is.
  *
- * This is one of the functions which you (the programmer making use of the SCGI C Library)
- * are likely to use in practice.
+ * Add a chunk with room for at least size bytes to the front of a request's arena.
+ * Chunks count towards the memory budget (see scgi_set_memory_budget).
+ * Returns 0 if there wasn't enough RAM or memory budget (or size is negative, or too big for a chunk).
  */
-int scgi_initialize(int port)
+int scgi_arena_add_chunk( scgi_request *req, int size )
 {
-  scgi_port *p;
-  int status, sock;
-  struct addrinfo hints, *servinfo;
-  char portstr[128];
-
-  /*
-   * Socket stuff
-   */
-  memset(&hints, 0, sizeof hints);
-  hints.ai_family = AF_UNSPEC;
-  hints.ai_socktype = SOCK_STREAM;
-  hints.ai_flags = AI_PASSIVE;
-  sprintf( portstr, "%d", port );
+  scgi_arena_chunk *chunk;
 
-  if ((status=getaddrinfo(NULL,portstr,&hints,&servinfo)) != 0)
-  {
+  if ( size < 0 || size > SCGI_ARENA_MAX_CHUNK )
     return 0;
-  }
 
-  sock = socket( servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol );
+  /*
+   * Each chunk is at least twice as big as the previous one, so a request which keeps on
+   * needing more only needs a handful of chunks.
+   */
+  if ( req->arena && size < req->arena->size * 2L )
+    size = req->arena->size * 2L > SCGI_ARENA_MAX_CHUNK ? SCGI_ARENA_MAX_CHUNK : req->arena->size * 2;
 
-  if ( sock == -1 )
+  if ( !scgi_memory_charge( (long) SCGI_ARENA_HEADER_SIZE + size ) )
     return 0;
 
-  if ( bind(sock, servinfo->ai_addr, servinfo->ai_addrlen) == -1
-  ||   listen(sock, SCGI_LISTEN_BACKLOG_PER_PORT) == -1 )
+  chunk = (scgi_arena_chunk *) malloc( SCGI_ARENA_HEADER_SIZE + size );
+  if ( !chunk )
   {
-    close(sock);
+    scgi_memory_charge( -( (long) SCGI_ARENA_HEADER_SIZE + size ) );
     return 0;
   }
 
-  /*
-   * At this point, SCGI C Library has successfully opened its ears to listen on the specified port.
-   * Commit the port to memory.
-   */
-
-  SCGI_CREATE( p, scgi_port, 1 );
-  p->next = NULL;
-  p->prev = NULL;
-  p->first_scgi_desc = NULL;
-  p->last_scgi_desc = NULL;
-  p->port = port;
-  p->sock = sock;
-
-  SCGI_LINK(p, first_scgi_port, last_scgi_port, next, prev );
+  chunk->size = size;
+  chunk->used = 0;
+  chunk->next = req->arena;
+  req->arena = chunk;
 
   return 1;
 }
 
 /*
- * If any pending requests have successfully been parsed and are waiting to be served by your program,
- * this function will return a pointer to one of them.  A NULL return value indicates there are no such
- * requests.
- *
- * This is one of the functions which you (the programmer making use of the SCGI C Library)
- * are likely to use in practice.
+ * Carve size bytes (aligned to align, which must be a power of 2) out of a request's arena.
+ * Returns NULL if there wasn't enough RAM.  The memory is NOT zeroed.
  */
-scgi_request *scgi_recv( void )
+void *scgi_arena_alloc( scgi_request *req, int size, int align )
 {
-  scgi_request *req;
+  scgi_arena_chunk *chunk = req->arena;
+  int start;
 
-  if ( !first_scgi_unrecved_req )
+  if ( size < 0 )
+    return NULL;
+
+  if ( chunk )
   {
-    scgi_update_connections();
+    start = ( chunk->used + align - 1 ) & ~( align - 1 );
 
-    if ( !first_scgi_unrecved_req )
-      return NULL;
+    /*
+     * (Written this way round so that a huge size can't overflow)
+     */
+    if ( start <= chunk->size && size <= chunk->size - start )
+    {
+      chunk->used = start + size;
+      return (char *) chunk + SCGI_ARENA_HEADER_SIZE + start;
+    }
   }
 
-  req = first_scgi_unrecved_req;
+  if ( !scgi_arena_add_chunk( req, size > SCGI_ARENA_SPARE ? size : SCGI_ARENA_SPARE ) )
+    return NULL;
 
-  /*
-   * After scgi_recv returns the pointer to the request, it is up to you (the programmer using SCGI Library)
-   * to do something with it-- in most cases by sending a response.
-   */
-  req->descriptor->state = SCGI_SOCKSTATE_WRITING_RESPONSE;
+  req->arena->used = size;
+  return (char *) req->arena + SCGI_ARENA_HEADER_SIZE;
+}
 
-  SCGI_UNLINK( req, first_scgi_unrecved_req, last_scgi_unrecved_req, next_unrecved, prev_unrecved );
+/*
+ * Free all the memory in a request's arena
+ */
+void scgi_arena_free( scgi_request *req )
+{
+  scgi_arena_chunk *chunk, *chunk_next;
 
-  return req;
+  for ( chunk = req->arena; chunk; chunk = chunk_next )
+  {
+    chunk_next = chunk->next;
+    scgi_memory_charge( -( (long) SCGI_ARENA_HEADER_SIZE + chunk->size ) );
+    free( chunk );
+  }
+
+  req->arena = NULL;
 }
 
 /*
- * Send a response to a request, without explicitly specifying the response's length.
- * NOTE: scgi_write should only be called once per request. Once it has been called, every time
- * the SCGI Library updates it will send as much of the response as it can, until the whole
- * response has been sent, and at that time, the request will be free'd.
- *
- * Returns 0 in case of failure due to inability to allocate RAM.
+ * Allocate memory which will be freed automatically along with the request.
+ * Handy for temporary things you need while building the response: there's no need to free
+ * it (and you mustn't), and it's very cheap, since it comes out of the same arena as the
+ * request's own headers and body.
+ * Returns NULL if there wasn't enough RAM (or memory budget: see scgi_set_memory_budget).
+ * The memory is NOT zeroed.
  *
  * This is one of the functions which you (the programmer making use of the SCGI C Library)
  * are likely to use in practice.
  */
-int scgi_write( scgi_request *req, char *txt )
+void *scgi_req_alloc( scgi_request *req, int size )
 {
-  int len = strlen(txt);
+  if ( size < 0 )
+    return NULL;
+
+  return scgi_arena_alloc( req, size, SCGI_ARENA_ALIGN );
+}
+
+/*
+ * Hash a string (FNV-1a)
+ */
+unsigned int scgi_hash( char *str )
+{
+  unsigned int h = 2166136261u;
+
+  for ( ; *str; str++ )
+    h = ( h ^ (unsigned char) *str ) * 16777619u;
+
+  return h;
+}
+
+/*
+ * Build a request's header index: an open-addressed hash table (linear probing) of its headers,
+ * keyed by name.  The table is at least twice as big as the number of headers, so probe chains
+ * stay short.  If a header was sent more than once, the index points to the first one, same as
+ * walking the list would.
+ * Returns 0 if there wasn't enough RAM (in which case lookups fall back to walking the list).
+ */
+int scgi_build_header_index( scgi_request *req )
+{
+  scgi_header *h;
+  unsigned int mask, i;
+  int count = 0, size = 8;
+
+  for ( h = req->first_header; h; h = h->next )
+    count++;
+
+  while ( size < count * 2 )
+    size *= 2;
+
+  req->header_index = scgi_arena_alloc( req, size * sizeof(scgi_header *), SCGI_ARENA_ALIGN );
+  if ( !req->header_index )
+    return 0;
+  memset( req->header_index, 0, size * sizeof(scgi_header *) );
+
+  req->header_index_size = size;
+  mask = size - 1;
+
+  for ( h = req->first_header; h; h = h->next )
+  {
+    h->hash = scgi_hash( h->name );
+
+    for ( i = h->hash & mask; req->header_index[i]; i = ( i + 1 ) & mask )
+    {
+      if ( req->header_index[i]->hash == h->hash && !strcmp( req->header_index[i]->name, h->name ) )
+        break;
+    }
+
+    if ( !req->header_index[i] )
+      req->header_index[i] = h;
+  }
+
+  return 1;
+}
+
+/*
+ * Look up the value of any header, by name (e.g. scgi_get_header( req, "CONTENT_TYPE" )).
+ * Returns NULL if they didn't send that header.
+ * The first lookup on a request builds a hash index of its headers, so this is O(1) no matter
+ * how many headers they sent.
+ *
+ * This is one of the functions which you (the programmer making use of the SCGI C Library)
+ * are likely to use in practice.
+ */
+char *scgi_get_header( scgi_request *req, char *name )
+{
+  scgi_header *h;
+  unsigned int hash, mask, i;
+
+  if ( !req->header_index && !scgi_build_header_index( req ) )
+  {
+    for ( h = req->first_header; h; h = h->next )
+      if ( !strcmp( h->name, name ) )
+        return h->value;
+
+    return NULL;
+  }
+
+  hash = scgi_hash( name );
+  mask = req->header_index_size - 1;
+
+  for ( i = hash & mask; ( h = req->header_index[i] ) != NULL; i = ( i + 1 ) & mask )
+  {
+    if ( h->hash == hash && !strcmp( h->name, name ) )
+      return h->value;
+  }
+
+  return NULL;
+}
+
+/*
+ * Split a query string ("a=1&b=2") or cookie header ("a=1; b=2") into name/value slices.
+ * Nothing is copied: the slices point into str.  If trim is set, spaces around names and
+ * values are skipped (and so are double quotes around cookie values).  Names containing
+ * escapes (rare) are decoded on the spot; values are only decoded when somebody asks for them.
+ * Returns how many pairs there were, or -1 if we ran out of RAM.
+ */
+int scgi_split_params( scgi_request *req, char *str, char separator, int trim, int plus_is_space, scgi_param **out )
+{
+  scgi_param *params;
+  char *p, *seg_end, *eq;
+  int count = 1;
+
+  for ( p = str; *p; p++ )
+    if ( *p == separator )
+      count++;
+
+  params = scgi_arena_alloc( req, count * sizeof(scgi_param), SCGI_ARENA_ALIGN );
+  if ( !params )
+    return -1;
+
+  count = 0;
+
+  for ( p = str; *p; p = *seg_end ? seg_end + 1 : seg_end )
+  {
+    scgi_param *prm = &params[count];
+
+    seg_end = strchr( p, separator );
+    if ( !seg_end )
+      seg_end = p + strlen( p );
+
+    if ( trim )
+    {
+      while ( p < seg_end && ( *p == ' ' || *p == '\t' ) )
+        p++;
+    }
+
+    if ( p == seg_end )
+      continue;
+
+    eq = memchr( p, '=', seg_end - p );
+
+    prm->name = p;
+    prm->namelen = ( eq ? eq : seg_end ) - p;
+    prm->value = eq ? eq + 1 : seg_end;
+    prm->valuelen = seg_end - prm->value;
+
+    if ( trim )
+    {
+      while ( prm->namelen > 0 && ( prm->name[prm->namelen-1] == ' ' || prm->name[prm->namelen-1] == '\t' ) )
+        prm->namelen--;
+      while ( prm->valuelen > 0 && ( *prm->value == ' ' || *prm->value == '\t' ) )
+      {
+        prm->value++;
+        prm->valuelen--;
+      }
+      while ( prm->valuelen > 0 && ( prm->value[prm->valuelen-1] == ' ' || prm->value[prm->valuelen-1] == '\t' ) )
+        prm->valuelen--;
+      if ( prm->valuelen >= 2 && *prm->value == '"' && prm->value[prm->valuelen-1] == '"' )
+      {
+        prm->value++;
+        prm->valuelen -= 2;
+      }
+    }
+
+    prm->name_escaped = scgi_has_escapes( prm->name, prm->namelen, plus_is_space );
+    prm->escaped = scgi_has_escapes( prm->value, prm->valuelen, plus_is_space );
+    count++;
+  }
+
+  *out = params;
+  return count;
+}
+
+/*
+ * Does this (not necessarily \0-terminated) string contain anything percent-decoding would change?
+ */
+int scgi_has_escapes( char *str, int len, int plus_is_space )
+{
+  if ( memchr( str, '%', len ) )
+    return 1;
+
+  return plus_is_space && memchr( str, '+', len ) != NULL;
+}
+
+/*
+ * Decode one character of a percent-encoded string, starting at src (which must be before end):
+ * "%" followed by two hex digits becomes the byte they spell, '+' becomes a space if
+ * plus_is_space, and anything else (including a '%' which isn't followed by two hex digits)
+ * stays as it is.  Stores the character in *c, and returns how many bytes of src it took up.
+ */
+int scgi_decode_char( char *src, char *end, char *c, int plus_is_space )
+{
+  if ( *src == '%' && end - src >= 3 && isxdigit( (unsigned char) src[1] ) && isxdigit( (unsigned char) src[2] ) )
+  {
+    char hex[3];
+
+    hex[0] = src[1];
+    hex[1] = src[2];
+    hex[2] = '\0';
+    *c = (char) strtol( hex, NULL, 16 );
+    return 3;
+  }
+
+  *c = ( *src == '+' && plus_is_space ) ? ' ' : *src;
+  return 1;
+}
+
+/*
+ * Percent-decode len bytes of src into dst (which may be the same as src, since decoding
+ * never makes anything longer), as described at scgi_decode_char.
+ * Returns the decoded length.  dst is \0-terminated, so it needs len+1 bytes.
+ */
+int scgi_percent_decode( char *dst, char *src, int len, int plus_is_space )
+{
+  char *start = dst, *end = src + len;
+
+  while ( src < end )
+    src += scgi_decode_char( src, end, dst++, plus_is_space );
+
+  *dst = '\0';
+  return dst - start;
+}
+
+/*
+ * Does len bytes of src, once percent-decoded, come out as exactly the wantlen bytes of want?
+ * Decodes as it goes, so it needs no buffer, and gives up at the first difference.
+ */
+int scgi_decoded_equals( char *src, int len, char *want, int wantlen, int plus_is_space )
+{
+  char *end = src + len, *wend = want + wantlen, c;
+
+  while ( src < end )
+  {
+    src += scgi_decode_char( src, end, &c, plus_is_space );
+
+    if ( want == wend || c != *want++ )
+      return 0;
+  }
+
+  return want == wend;
+}
+
+/*
+ * Decode a name/value pair's value into the request's storage for decoded values, and point
+ * the pair at the decoded copy from now on.  The storage is carved out of the request's arena
+ * the first time it's needed, big enough for every value in the query string and cookies
+ * (decoding only ever shrinks things).
+ * Returns NULL if we ran out of RAM.
+ */
+char *scgi_decode_param( scgi_request *req, scgi_param *prm, int plus_is_space )
+{
+  char *dst;
+
+  if ( !req->decoded )
+  {
+    int size = 2;
+
+    if ( req->query_string )
+      size += strlen( req->query_string ) * 2;
+    if ( req->raw_http_cookie )
+      size += strlen( req->raw_http_cookie ) * 2;
+
+    req->decoded = scgi_arena_alloc( req, size, 1 );
+    if ( !req->decoded )
+      return NULL;
+  }
+
+  dst = &req->decoded[req->decoded_len];
+  prm->valuelen = scgi_percent_decode( dst, prm->value, prm->valuelen, plus_is_space );
+  prm->value = dst;
+  prm->escaped = 0;
+  req->decoded_len += prm->valuelen + 1;
+
+  return dst;
+}
+
+/*
+ * Look up a name in a list of name/value pairs.  Names with escapes in them are compared
+ * as they'd be decoded, however long they are.
+ */
+char *scgi_find_param( scgi_request *req, scgi_param *params, int count, char *name, int *len, int plus_is_space )
+{
+  int i, namelen = strlen( name );
+
+  for ( i = 0; i < count; i++ )
+  {
+    scgi_param *prm = &params[i];
+
+    if ( prm->name_escaped )
+    {
+      if ( !scgi_decoded_equals( prm->name, prm->namelen, name, namelen, plus_is_space ) )
+        continue;
+    }
+    else if ( prm->namelen != namelen || memcmp( prm->name, name, namelen ) )
+      continue;
+
+    if ( prm->escaped && !scgi_decode_param( req, prm, plus_is_space ) )
+      return NULL;
+
+    if ( len )
+      *len = prm->valuelen;
+
+    return prm->value;
+  }
+
+  return NULL;
+}
+
+/*
+ * Look up a parameter in the query string, e.g. for "?page=2&q=hello%20world",
+ * scgi_query_param( req, "q", &len ) returns "hello world" with len 11.
+ * Returns NULL if there's no such parameter (if there are several, you get the first).
+ *
+ * IMPORTANT: to avoid copying, the result usually points straight into req->query_string, so
+ * it is NOT \0-terminated: use the length stored in *len.  (Values which needed decoding are
+ * decoded into storage belonging to the request, and those do happen to be \0-terminated.)
+ * Either way the result lives as long as the request does.
+ *
+ * Names and values are percent-decoded: "%" and two hex digits stand for that byte (so "%41"
+ * is "A", and "%00" is a \0 which counts in *len), '+' stands for a space, and everything else,
+ * including a '%' which isn't followed by two hex digits, is taken as it is.  Nothing else is
+ * done to them (no UTF-8 checks, no case folding), so name has to match the decoded name byte
+ * for byte.
+ *
+ * The query string is split up the first time you call this, and values are only decoded
+ * if and when you ask for them.
+ *
+ * This is one of the functions which you (the programmer making use of the SCGI C Library)
+ * are likely to use in practice.
+ */
+char *scgi_query_param( scgi_request *req, char *name, int *len )
+{
+  if ( !req->query_string )
+    return NULL;
+
+  if ( req->query_param_count < 0 )
+  {
+    req->query_param_count = scgi_split_params( req, req->query_string, '&', 0, 1, &req->query_params );
+    if ( req->query_param_count < 0 )
+      return NULL;
+  }
+
+  return scgi_find_param( req, req->query_params, req->query_param_count, name, len, 1 );
+}
+
+/*
+ * Look up a cookie by name.  Works just like scgi_query_param (including the part about the
+ * result NOT being \0-terminated), except that '+' is left as it is rather than decoded to a
+ * space, in names as well as values.
+ *
+ * This is one of the functions which you (the programmer making use of the SCGI C Library)
+ * are likely to use in practice.
+ */
+char *scgi_cookie( scgi_request *req, char *name, int *len )
+{
+  if ( !req->raw_http_cookie )
+    return NULL;
+
+  if ( req->cookie_count < 0 )
+  {
+    req->cookie_count = scgi_split_params( req, req->raw_http_cookie, ';', 1, 0, &req->cookies );
+    if ( req->cookie_count < 0 )
+      return NULL;
+  }
+
+  return scgi_find_param( req, req->cookies, req->cookie_count, name, len, 0 );
+}
+
+/*
+ * Function to check whether a string is a number
+ */
+int scgi_is_number( char *arg )
+{
+    int first = 1;
+    if ( *arg == '\0' )
+        return 0;
+
+    for ( ; *arg != '\0'; arg++ )
+    {
+        if ( first && *arg == '-')
+        {
+                first = 0;
+                continue;
+        }
+        if ( !isdigit(*arg) )
+            return 0;
+        first = 0;
+    }
+
+    return 1;
+}
+
+void scgi_deal_with_socket_out_of_ram( scgi_desc *d )
+{
+  scgi_kill_socket( d, scgi_memory_refused ? SCGI_CLOSE_MEMORY_BUDGET : SCGI_CLOSE_OUT_OF_RAM );
+}
+
+/*
+ * Ask to be told whenever a connection closes (pass NULL to stop being told).
+ * The hook is called with the connection's request, one of the SCGI_CLOSE_* codes saying
+ * why it closed, and its timings, just before the request is freed.  Don't hang on to
+ * the request pointer after your hook returns.
+ */
+void scgi_set_close_hook( scgi_close_hook *hook )
+{
+  scgi_close_hook_fn = hook;
+}
+
+/*
+ * A human-readable name for one of the SCGI_CLOSE_* codes, e.g. for labelling metrics
+ */
+const char *scgi_close_reason_name( int reason )
+{
+  static const char *names[SCGI_CLOSE_REASONS] =
+  {
+    "completed", "exception", "idle", "bad_netstring", "bad_header", "no_scgi_header",
+    "inbuf_overflow", "outbuf_overflow", "out_of_ram", "eof", "recv_error", "send_error",
+    "shed", "expired", "header_timeout", "body_timeout", "too_slow", "memory_budget"
+  };
+
+  if ( reason < 0 || reason >= SCGI_CLOSE_REASONS )
+    return "unknown";
+
+  return names[reason];
+}
+
+/*
+ * Fill in a configuration structure with the compile-time defaults from scgilib.h
+ */
+void scgi_config_defaults( scgi_config *cfg )
+{
+  cfg->initial_outbuf_size = SCGI_INITIAL_OUTBUF_SIZE;
+  cfg->max_inbuf_size = SCGI_MAX_INBUF_SIZE;
+  cfg->max_outbuf_size = SCGI_MAX_OUTBUF_SIZE;
+  cfg->kick_idle_after_x_secs = SCGI_KICK_IDLE_AFTER_X_SECS;
+  cfg->log_slow_requests_after_x_msecs = SCGI_LOG_SLOW_REQUESTS_AFTER_X_MSECS;
+  cfg->max_connections = SCGI_MAX_CONNECTIONS_PER_PORT;
+  cfg->max_unrecved_requests = SCGI_MAX_UNRECVED_REQUESTS_PER_PORT;
+  cfg->retry_after_secs = SCGI_RETRY_AFTER_SECS;
+  cfg->queue_deadline_msecs = SCGI_QUEUE_DEADLINE_MSECS;
+  cfg->answer_expired_with_504 = SCGI_ANSWER_EXPIRED_WITH_504;
+  cfg->header_timeout_msecs = SCGI_HEADER_TIMEOUT_MSECS;
+  cfg->body_timeout_msecs = SCGI_BODY_TIMEOUT_MSECS;
+  cfg->min_bytes_per_sec = SCGI_MIN_BYTES_PER_SEC;
+}
+
+/*
+ * Sanity-check a configuration before letting a port use it.
+ * (The output buffer starts out at its initial size and doubles from there, so an initial size
+ *  of zero would never grow, and an initial size above the maximum makes no sense)
+ */
+int scgi_config_is_valid( scgi_config *cfg )
+{
+  if ( cfg->initial_outbuf_size < 1 || cfg->max_inbuf_size < 1 )
+    return 0;
+
+  if ( cfg->max_outbuf_size < cfg->initial_outbuf_size )
+    return 0;
+
+  if ( cfg->kick_idle_after_x_secs < 1 )
+    return 0;
+
+  if ( cfg->log_slow_requests_after_x_msecs < 0 )
+    return 0;
+
+  if ( cfg->max_connections < 0 || cfg->max_unrecved_requests < 0
+  ||   cfg->retry_after_secs < 0 || cfg->retry_after_secs > 99999999 )
+    return 0;
+
+  if ( cfg->queue_deadline_msecs < 0 )
+    return 0;
+
+  if ( cfg->header_timeout_msecs < 0 || cfg->body_timeout_msecs < 0 || cfg->min_bytes_per_sec < 0 )
+    return 0;
+
+  return 1;
+}
+
+/*
+ * Find the structure for a port we're listening on, or NULL if we aren't listening on it
+ */
+scgi_port *scgi_find_port( int port )
+{
+  scgi_port *p;
+
+  for ( p = first_scgi_port; p; p = p->next )
+    if ( p->port == port )
+      return p;
+
+  return NULL;
+}
+
+/*
+ * Copy a port's current configuration into cfg.
+ * Returns 0 if we aren't listening on that port.
+ */
+int scgi_get_config( int port, scgi_config *cfg )
+{
+  scgi_port *p = scgi_find_port( port );
+
+  if ( !p )
+    return 0;
+
+  *cfg = p->config;
+  return 1;
+}
+
+/*
+ * Change a port's configuration on the fly.
+ * Connections which are already open are affected too: the new idle timeout applies to them
+ * immediately, and the new buffer sizes apply the next time their buffers need to grow.
+ * Returns 0 (and changes nothing) if we aren't listening on that port or cfg is nonsense.
+ */
+int scgi_set_config( int port, scgi_config *cfg )
+{
+  scgi_port *p = scgi_find_port( port );
+
+  if ( !p || !scgi_config_is_valid( cfg ) )
+    return 0;
+
+  p->config = *cfg;
+  scgi_prepare_canned_responses( p );
+  return 1;
+}
+
+/*
+ * Microseconds according to the monotonic clock (i.e., unaffected by someone changing the
+ * system time).  Only useful for measuring how long things take, not for telling the time.
+ */
+long long scgi_now_usecs( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+
+  return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Add a sample to a histogram.  The bucket is the number of bits needed to write the
+ * sample down, so this is just a few shifts and increments: cheap enough to always leave on.
+ */
+void scgi_histogram_record( scgi_histogram *h, long long usecs )
+{
+  unsigned long long v;
+  int bucket = 0;
+
+  if ( usecs < 0 )
+    usecs = 0;
+
+  for ( v = usecs; v && bucket < SCGI_HISTOGRAM_BUCKETS - 1; v >>= 1 )
+    bucket++;
+
+  h->count++;
+  h->sum_usecs += usecs;
+  h->buckets[bucket]++;
+}
+
+/*
+ * Add the stats s into the running total sum
+ */
+void scgi_stats_add( scgi_stats *sum, scgi_stats *s )
+{
+  int i;
+
+  sum->connections_accepted += s->connections_accepted;
+  sum->connections_closed += s->connections_closed;
+  sum->requests_parsed += s->requests_parsed;
+  sum->requests_recved += s->requests_recved;
+  sum->responses_flushed += s->responses_flushed;
+  sum->bytes_read += s->bytes_read;
+  sum->bytes_written += s->bytes_written;
+  sum->buffer_resizes += s->buffer_resizes;
+  sum->requests_expired += s->requests_expired;
+  sum->cache_hits += s->cache_hits;
+  sum->cache_misses += s->cache_misses;
+  sum->static_hits += s->static_hits;
+  sum->requests_routed += s->requests_routed;
+  sum->requests_not_found += s->requests_not_found;
+  sum->open_connections += s->open_connections;
+  sum->unrecved_requests += s->unrecved_requests;
+
+  sum->parse_time.count += s->parse_time.count;
+  sum->parse_time.sum_usecs += s->parse_time.sum_usecs;
+  sum->total_time.count += s->total_time.count;
+  sum->total_time.sum_usecs += s->total_time.sum_usecs;
+
+  for ( i = 0; i < SCGI_HISTOGRAM_BUCKETS; i++ )
+  {
+    sum->parse_time.buckets[i] += s->parse_time.buckets[i];
+    sum->total_time.buckets[i] += s->total_time.buckets[i];
+  }
+
+  for ( i = 0; i < SCGI_CLOSE_REASONS; i++ )
+    sum->closed_by_reason[i] += s->closed_by_reason[i];
+}
+
+/*
+ * Copy the library's stats, totalled over all ports, into out.
+ * The stats are plain counters updated by the event loop (no locks, no atomics), so call this
+ * from the same thread that calls scgi_recv.  It's cheap enough to call on every scrape.
+ */
+void scgi_stats_snapshot( scgi_stats *out )
+{
+  scgi_port *p;
+
+  memset( out, 0, sizeof(*out) );
+
+  for ( p = first_scgi_port; p; p = p->next )
+    scgi_stats_add( out, &p->stats );
+}
+
+/*
+ * Copy the stats for one port into out.  Returns 0 if we aren't listening on that port.
+ */
+int scgi_port_stats_snapshot( int port, scgi_stats *out )
+{
+  scgi_port *p = scgi_find_port( port );
+
+  if ( !p )
+    return 0;
+
+  *out = p->stats;
+  return 1;
+}
+
+/*
+ * Function to initialize the SCGI C Library (and start it listening on the specified port).
+ * Returns 0 on failure.
+ * May be called multiple times with different port numbers, if you want a single program
+ * listening on different ports.
+ *
+ * This is one of the functions which you (the programmer making use of the SCGI C Library)
+ * are likely to use in practice.
+ */
+int scgi_initialize(int port)
+{
+  return scgi_initialize_with_config( port, NULL );
+}
+
+/*
+ * Same as scgi_initialize, but the port will use the specified configuration rather than
+ * the defaults (a NULL cfg means the defaults).  Returns 0 on failure, including if cfg
+ * is nonsense.
+ */
+int scgi_initialize_with_config( int port, scgi_config *cfg )
+{
+  int status, sock;
+  struct addrinfo hints, *servinfo;
+  char portstr[128];
+
+  if ( cfg && !scgi_config_is_valid( cfg ) )
+    return 0;
+
+  /*
+   * Socket stuff
+   */
+  memset(&hints, 0, sizeof hints);
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  sprintf( portstr, "%d", port );
+
+  if ((status=getaddrinfo(NULL,portstr,&hints,&servinfo)) != 0)
+  {
+    return 0;
+  }
+
+  sock = socket( servinfo->ai_family, servinfo->ai_socktype, servinfo->ai_protocol );
+
+  if ( sock == -1 )
+  {
+    freeaddrinfo( servinfo );
+    return 0;
+  }
+
+  /*
+   * The event loop couldn't select on it (see SCGI_MAX_SOCKET_SLOTS)
+   */
+  if ( sock >= FD_SETSIZE )
+  {
+    freeaddrinfo( servinfo );
+    close( sock );
+    return 0;
+  }
+
+  /*
+   * The listening socket is non-blocking, so that if several processes share it (see scgi_prefork),
+   * the ones that lose the race for a new connection don't get stuck in accept.
+   */
+  if ( bind(sock, servinfo->ai_addr, servinfo->ai_addrlen) == -1
+  ||   listen(sock, SCGI_LISTEN_BACKLOG_PER_PORT) == -1
+  ||   fcntl( sock, F_SETFL, FNDELAY ) == -1 )
+  {
+    freeaddrinfo( servinfo );
+    close(sock);
+    return 0;
+  }
+
+  freeaddrinfo( servinfo );
+
+  /*
+   * At this point, SCGI C Library has successfully opened its ears to listen on the specified port.
+   * Commit the port to memory.
+   */
+  scgi_add_port( port, sock, cfg );
+
+  return 1;
+}
+
+/*
+ * Like scgi_initialize_with_config, but without a socket: the port only takes in-memory
+ * connections (see scgi_pipe_connect and scgi_connect_transport), so nothing about it ever
+ * goes near the kernel.  port is just a number to tell it apart from other ports by.
+ * Returns 0 if cfg is invalid or there's already a port with that number.
+ */
+int scgi_initialize_loopback( int port, scgi_config *cfg )
+{
+  if ( ( cfg && !scgi_config_is_valid( cfg ) ) || scgi_find_port( port ) )
+    return 0;
+
+  scgi_add_port( port, -1, cfg );
+
+  return 1;
+}
+
+/*
+ * Commit a port to memory (sock is -1 for a loopback port)
+ */
+scgi_port *scgi_add_port( int port, int sock, scgi_config *cfg )
+{
+  scgi_port *p;
+
+  SCGI_CREATE( p, scgi_port, 1 );
+  p->next = NULL;
+  p->prev = NULL;
+  p->port = port;
+  p->sock = sock;
+  memset( &p->stats, 0, sizeof(p->stats) );
+
+  if ( cfg )
+    p->config = *cfg;
+  else
+    scgi_config_defaults( &p->config );
+
+  scgi_prepare_canned_responses( p );
+
+  if ( sock >= 0 )
+    SCGI_CREATE( p->lingering, scgi_lingerer, SCGI_MAX_LINGERING );
+
+  SCGI_LINK(p, first_scgi_port, last_scgi_port, next, prev );
+
+  return p;
+}
+
+/*
+ * If any pending requests have successfully been parsed and are waiting to be served by your program,
+ * this function will return a pointer to one of them.  A NULL return value indicates there are no such
+ * requests.
+ *
+ * This is one of the functions which you (the programmer making use of the SCGI C Library)
+ * are likely to use in practice.
+ */
+scgi_request *scgi_recv( void )
+{
+  if ( !first_scgi_unrecved_req )
+  {
+    scgi_update_connections();
+
+    if ( !first_scgi_unrecved_req )
+      return NULL;
+  }
+
+  return scgi_hand_out_request( scgi_now_usecs() );
+}
+
+/*
+ * Get up to max requests at once, storing them in out[], and return how many there were.
+ *
+ * Unlike scgi_recv, which only does I/O when nobody is waiting, this always does exactly one
+ * pass over the sockets first (accepting new connections, reading requests, and flushing
+ * responses), so that a busy server keeps its responses draining, and the cost of polling is
+ * spread over the whole batch.  If nobody is waiting, it first waits up to timeout_ms
+ * milliseconds for something to happen (0 means don't wait), which can stand in for the sleep
+ * in your main loop.  Like scgi_recv, it should be called regularly.
+ */
+int scgi_recv_batch( scgi_request **out, int max, int timeout_ms )
+{
+  scgi_request *req;
+  long long now;
+  int count = 0;
+
+  /*
+   * Requests waiting to be handed out are no reason to hurry if the caller isn't taking any
+   */
+  if ( ( !first_scgi_unrecved_req || max <= 0 ) && timeout_ms > 0 )
+    scgi_wait_for_io( timeout_ms );
+
+  scgi_update_connections();
+
+  now = scgi_now_usecs();
+
+  while ( count < max && ( req = scgi_hand_out_request( now ) ) != NULL )
+    out[count++] = req;
+
+  return count;
+}
+
+/*
+ * Block until any socket on any port is ready for whatever we'd do with it next (or until
+ * timeout_ms milliseconds pass).  Doesn't do the I/O itself; scgi_update_connections does that.
+ */
+void scgi_wait_for_io( int timeout_ms )
+{
+  fd_set inset, outset;
+  struct timeval timeout;
+  scgi_port *p;
+  scgi_desc *d;
+  int top_desc = -1, i;
+
+  /*
+   * If an in-memory connection has something to do already, there's nothing to wait for
+   */
+  if ( scgi_virtual_io_pending() )
+    return;
+
+  FD_ZERO( &inset );
+  FD_ZERO( &outset );
+
+  for ( p = first_scgi_port; p; p = p->next )
+  {
+    if ( p->sock < 0 )
+      continue;
+
+    FD_SET( p->sock, &inset );
+    if ( p->sock > top_desc )
+      top_desc = p->sock;
+
+    for ( i = 0; i < p->lingering_count; i++ )
+    {
+      FD_SET( p->lingering[i].sock, &inset );
+      if ( p->lingering[i].sock > top_desc )
+        top_desc = p->lingering[i].sock;
+    }
+  }
+
+  for ( i = 0; i < scgi_top_slot; i++ )
+  {
+    if ( !scgi_slots[i].in_use || scgi_slots[i].desc.sock < 0 )
+      continue;
+
+    d = &scgi_slots[i].desc;
+
+    if ( d->state == SCGI_SOCKSTATE_READING_REQUEST )
+      FD_SET( d->sock, &inset );
+    else
+    if ( d->state == SCGI_SOCKSTATE_WRITING_RESPONSE && d->outbuflen > 0 && !d->building )
+      FD_SET( d->sock, &outset );
+    else
+    if ( d->discarding )
+      FD_SET( d->sock, &inset );
+    else
+      continue;
+
+    if ( d->sock > top_desc )
+      top_desc = d->sock;
+  }
+
+  if ( top_desc < 0 )
+    return;
+
+  timeout.tv_sec = timeout_ms / 1000;
+  timeout.tv_usec = ( timeout_ms % 1000 ) * 1000;
+
+  /*
+   * If a signal interrupts us, that's fine, we were only waiting
+   */
+  select( top_desc+1, &inset, &outset, NULL, &timeout );
+}
+
+/*
+ * Whether any connection without a socket could get something done right now: it has input
+ * waiting, or a response ready to go (and those are always ready to be written to)
+ */
+int scgi_virtual_io_pending( void )
+{
+  scgi_desc *d;
+  int i;
+
+  for ( i = scgi_socket_slots; i < scgi_top_virtual_slot; i++ )
+  {
+    if ( !scgi_slots[i].in_use || !scgi_slots[i].desc.transport )
+      continue;
+
+    d = &scgi_slots[i].desc;
+
+    if ( d->state == SCGI_SOCKSTATE_READING_REQUEST && (*d->transport->readable)( d ) )
+      return 1;
+
+    if ( d->state == SCGI_SOCKSTATE_WRITING_RESPONSE && d->outbuflen > 0 && !d->building )
+      return 1;
+  }
+
+  return 0;
+}
+
+/*
+ * Take the next request out of line (see scgi_next_in_line) and hand it to the programmer,
+ * or return NULL if nobody's waiting.
+ */
+scgi_request *scgi_hand_out_request( long long now )
+{
+  scgi_request *req;
+
+  /*
+   * Don't waste your time on requests which have waited so long that the webserver has probably
+   * given up on them.  The oldest requests are at the front of the line, so clear those out first
+   * (otherwise, with LIFO, they could sit there forever), then make sure the one we pick is still fresh.
+   */
+  while ( first_scgi_unrecved_req && scgi_request_has_expired( first_scgi_unrecved_req, now ) )
+    scgi_expire_request( first_scgi_unrecved_req );
+
+  for ( ; ; )
+  {
+    if ( !first_scgi_unrecved_req )
+      return NULL;
+
+    req = scgi_next_in_line();
+
+    if ( !scgi_request_has_expired( req, now ) )
+      break;
+
+    scgi_expire_request( req );
+  }
+
+  /*
+   * After scgi_recv returns the pointer to the request, it is up to you (the programmer using SCGI Library)
+   * to do something with it-- in most cases by sending a response.
+   */
+  req->descriptor->state = SCGI_SOCKSTATE_WRITING_RESPONSE;
+
+  SCGI_UNLINK( req, first_scgi_unrecved_req, last_scgi_unrecved_req, next_unrecved, prev_unrecved );
+
+  req->descriptor->port->stats.unrecved_requests--;
+  req->descriptor->port->stats.requests_recved++;
+  req->timings.recved = now;
+
+  return req;
+}
+
+/*
+ * Has a waiting request been waiting longer than its port's queue deadline?
+ */
+int scgi_request_has_expired( scgi_request *req, long long now )
+{
+  int deadline = req->descriptor->port->config.queue_deadline_msecs;
+
+  return deadline > 0 && now - req->timings.queued > deadline * 1000LL;
+}
+
+/*
+ * Take an expired request out of line, and either tell them so (504 Gateway Timeout, sent from
+ * the event loop) or just hang up on them, depending on the port's configuration.
+ */
+void scgi_expire_request( scgi_request *req )
+{
+  scgi_desc *d = req->descriptor;
+
+  SCGI_UNLINK( req, first_scgi_unrecved_req, last_scgi_unrecved_req, next_unrecved, prev_unrecved );
+
+  d->port->stats.unrecved_requests--;
+  d->port->stats.requests_expired++;
+
+  if ( d->port->config.answer_expired_with_504 )
+    scgi_respond_canned( d, SCGI_CANNED_EXPIRED, SCGI_CLOSE_EXPIRED );
+  else
+    scgi_kill_socket( d, SCGI_CLOSE_EXPIRED );
+}
+
+/*
+ * Which waiting request should scgi_recv hand out next?  Normally the oldest, but when the line
+ * gets long, scgi_set_queue_policy can say otherwise.
+ */
+scgi_request *scgi_next_in_line( void )
+{
+  scgi_request *req, *best;
+  scgi_port *p;
+  long waiting = 0;
+
+  if ( scgi_queue_policy == SCGI_QUEUE_FIFO )
+    return first_scgi_unrecved_req;
+
+  for ( p = first_scgi_port; p; p = p->next )
+    waiting += p->stats.unrecved_requests;
+
+  if ( waiting < scgi_queue_pressure )
+    return first_scgi_unrecved_req;
+
+  if ( scgi_queue_policy == SCGI_QUEUE_LIFO )
+    return last_scgi_unrecved_req;
+
+  best = first_scgi_unrecved_req;
+
+  for ( req = best->next_unrecved; req; req = req->next_unrecved )
+  {
+    if ( req->priority > best->priority )
+      best = req;
+  }
+
+  return best;
+}
+
+/*
+ * Choose the order in which scgi_recv hands out waiting requests (one of the SCGI_QUEUE_* policies),
+ * but only while at least "pressure" requests are waiting (over all ports); with fewer, it's
+ * always oldest first.  Serving the newest (LIFO) or most important (PRIORITY) requests first during
+ * a backlog keeps more of them inside the webserver's timeout, at the expense of the oldest ones.
+ *
+ * Returns 0 if the policy is unknown or the pressure is negative.
+ */
+int scgi_set_queue_policy( int policy, int pressure )
+{
+  if ( policy != SCGI_QUEUE_FIFO && policy != SCGI_QUEUE_LIFO && policy != SCGI_QUEUE_PRIORITY )
+    return 0;
+
+  if ( pressure < 0 )
+    return 0;
+
+  scgi_queue_policy = policy;
+  scgi_queue_pressure = pressure;
+
+  return 1;
+}
+
+/*
+ * Rank requests for the SCGI_QUEUE_PRIORITY policy.  The hook is called once for each request,
+ * as it joins the queue, and returns its priority (bigger numbers go first).  Requests queued with
+ * no hook installed have priority 0.
+ */
+void scgi_set_priority_hook( scgi_priority_hook *hook )
+{
+  scgi_priority_hook_fn = hook;
+}
+
+/*
+ * Send a response to a request, without explicitly specifying the response's length.
+ * NOTE: scgi_write should only be called once per request. Once it has been called, every time
+ * the SCGI Library updates it will send as much of the response as it can, until the whole
+ * response has been sent, and at that time, the request will be free'd.
+ *
+ * Returns 0 in case of failure due to inability to allocate RAM; nothing has been sent, and the
+ * request is still yours to answer.  If it's the memory budget (see scgi_set_memory_budget)
+ * which doesn't allow it, 0 is returned too, but they've been answered with a 503 instead, and
+ * the request is finished just as if the response had gone out.
+ *
+ * This is one of the functions which you (the programmer making use of the SCGI C Library)
+ * are likely to use in practice.
+ */
+int scgi_write( scgi_request *req, char *txt )
+{
+  int len = strlen(txt);
 
   return scgi_send( req, txt, len );
 }
 
 /*
- * Send a response to a request, explicitly specifying the response's length.
- * NOTE: scgi_send should only be called once per request. Once it has been called, every time
- * the SCGI Library updates it will send as much of the response as it can, until the whole
- * response has been sent, and at that time, the request will be free'd.
- *
- * Returns 0 in case of failure due to inability to allocate RAM.
- *
- * This is one of the functions which you (the programmer making use of the SCGI C Library)
- * are likely to use in practice.
+ * Send a response to a request, explicitly specifying the response's length.
+ * NOTE: scgi_send should only be called once per request. Once it has been called, every time
+ * the SCGI Library updates it will send as much of the response as it can, until the whole
+ * response has been sent, and at that time, the request will be free'd.
+ *
+ * Returns 0 in case of failure due to inability to allocate RAM; nothing has been sent, and the
+ * request is still yours to answer.  If it's the memory budget (see scgi_set_memory_budget)
+ * which doesn't allow it, 0 is returned too, but they've been answered with a 503 instead, and
+ * the request is finished just as if the response had gone out.
+ *
+ * This is one of the functions which you (the programmer making use of the SCGI C Library)
+ * are likely to use in practice.
+ */
+int scgi_send( scgi_request *req, char *txt, int len )
+{
+  scgi_desc *d = req->descriptor;
+
+  req->timings.sent = scgi_now_usecs();
+  d->building = 0;
+
+  switch ( scgi_fill_outbuf( d, txt, len ) )
+  {
+    case 1:
+      break;
+
+    case -1:
+      scgi_respond_canned( d, SCGI_CANNED_BUSY, SCGI_CLOSE_MEMORY_BUDGET );
+      return 0;
+
+    default:
+      return 0;
+  }
+
+  /*
+   * The actual physical transmission will be handled by the scgi_flush_response function,
+   * once the socket is ready to receive it.
+   */
+
+  return 1;
+}
+
+/*
+ * Copy a response into a connection's output buffer, growing it if more is being sent than
+ * we've allocated space for.  Returns 1 if it's in, or else leaves the connection as it was and
+ * returns 0 if there's no RAM for it, or -1 if the memory budget doesn't allow it.
+ */
+int scgi_fill_outbuf( scgi_desc *d, char *txt, int len )
+{
+  char *newbuf;
+
+  if ( len < d->outbufsize - 5 )
+  {
+    memcpy( d->outbuf, txt, len );
+    d->outbuflen = len;
+    return 1;
+  }
+
+  if ( !scgi_memory_charge( len + 6L - d->outbufsize ) )
+    return -1;
+
+  newbuf = calloc( len + 7, sizeof(char) );
+
+  if ( !newbuf )
+  {
+    scgi_memory_charge( -( len + 6L - d->outbufsize ) );
+    return 0;
+  }
+  memcpy( newbuf, txt, len );
+  free( d->outbuf );
+  d->outbuf = newbuf;
+  d->outbuflen = len;
+  d->outbufsize = len + 6;
+  return 1;
+}
+
+
+/*
+ * Redirect the client elsewhere (302 Found), e.g. scgi_302_redirect( req, "http://www.example.com/" ).
+ * Like scgi_send, this finishes the request.
+ */
+void scgi_302_redirect( scgi_request *req, char *address )
+{
+  scgi_resp_status( req, 302, "Found" );
+  scgi_resp_header( req, "Location", address );
+  scgi_resp_body( req, NULL, 0 );
+}
+
+/*
+ * Building a response piece by piece, straight into the connection's output buffer, rather than
+ * formatting it somewhere else and then copying it in with scgi_send:
+ *
+ *   scgi_resp_status( req, 200, "OK" );
+ *   scgi_resp_header( req, "Content-Type", "text/html" );
+ *   scgi_resp_printf( req, "<p>Hello, %s!</p>", name );
+ *   scgi_resp_body( req, footer, footer_len );
+ *
+ * Status and headers come first, then any amount of body (scgi_resp_printf), and scgi_resp_body
+ * finishes the response, adding the Content-Length header.  Nothing is sent until then.
+ * The output buffer doubles in size as needed, up to the port's max_outbuf_size.
+ * For HEAD requests, the body is measured (for Content-Length) but left out.
+ *
+ * Begin building, if we haven't already.  The response starts SCGI_CONTENT_LENGTH_ROOM bytes
+ * into the output buffer, leaving room to put the Content-Length header in front of it at the end
+ * (CGI doesn't care what order the headers come in).
+ */
+int scgi_resp_start( scgi_desc *d )
+{
+  if ( d->building )
+    return !d->build_failed;
+
+  d->building = 1;
+  d->build_failed = 0;
+  d->body_starts = 0;
+  d->writehead = NULL;
+  d->outbuflen = 0;
+
+  if ( !scgi_resp_reserve( d, SCGI_CONTENT_LENGTH_ROOM ) )
+    return 0;
+
+  d->outbuflen = SCGI_CONTENT_LENGTH_ROOM;
+  return 1;
+}
+
+/*
+ * Make sure the output buffer has room for "extra" more bytes (plus a \0), doubling it as
+ * many times as necessary.  If it would outgrow max_outbuf_size, or we're out of RAM, the
+ * response being built is doomed (see scgi_resp_body); return 0.
+ */
+int scgi_resp_reserve( scgi_desc *d, int extra )
+{
+  int size = d->outbufsize, max = d->port->config.max_outbuf_size;
+  char *tmp;
+
+  if ( d->build_failed )
+    return 0;
+
+  /*
+   * (Written this way round so that a huge extra can't overflow)
+   */
+  if ( extra < 0 || extra >= max - d->outbuflen )
+  {
+    d->build_failed = SCGI_CLOSE_OUTBUF_OVERFLOW;
+    return 0;
+  }
+
+  if ( d->outbuflen + extra < size )
+    return 1;
+
+  /*
+   * Stop doubling before it could overflow: by then, max is big enough
+   */
+  while ( d->outbuflen + extra >= size )
+  {
+    if ( size > max / 2 )
+    {
+      size = max;
+      break;
+    }
+    size *= 2;
+  }
+
+  if ( !scgi_memory_charge( (long) size - d->outbufsize ) )
+  {
+    d->build_failed = SCGI_CLOSE_MEMORY_BUDGET;
+    return 0;
+  }
+
+  tmp = (char *) realloc( d->outbuf, size + 1 );
+
+  if ( !tmp )
+  {
+    scgi_memory_charge( (long) d->outbufsize - size );
+    d->build_failed = SCGI_CLOSE_OUT_OF_RAM;
+    return 0;
+  }
+
+  d->outbuf = tmp;
+  d->outbufsize = size;
+  d->port->stats.buffer_resizes++;
+
+  return 1;
+}
+
+/*
+ * Add some bytes to the response being built
+ */
+int scgi_resp_append( scgi_desc *d, char *txt, int len )
+{
+  if ( !scgi_resp_reserve( d, len ) )
+    return 0;
+
+  memcpy( &d->outbuf[d->outbuflen], txt, len );
+  d->outbuflen += len;
+  d->outbuf[d->outbuflen] = '\0';
+
+  return 1;
+}
+
+/*
+ * Done with the headers: add the blank line which separates them from the body
+ */
+int scgi_resp_start_body( scgi_desc *d )
+{
+  if ( !scgi_resp_start( d ) )
+    return 0;
+
+  if ( !d->body_starts )
+  {
+    if ( !scgi_resp_append( d, "\r\n", 2 ) )
+      return 0;
+    d->body_starts = d->outbuflen;
+  }
+
+  return 1;
+}
+
+/*
+ * Set the response's status, e.g. scgi_resp_status( req, 404, "Not Found" ).
+ * (If you don't, the webserver will assume 200 OK.)  Must come before the body.
+ * Returns 0 if the response has already outgrown the output buffer.
+ */
+int scgi_resp_status( scgi_request *req, int code, char *reason )
+{
+  scgi_desc *d = req->descriptor;
+  char buf[32];
+
+  if ( !scgi_resp_start( d ) || d->body_starts )
+    return 0;
+
+  sprintf( buf, "Status: %d ", code );
+
+  return scgi_resp_append( d, buf, strlen( buf ) )
+  &&     scgi_resp_append( d, reason, strlen( reason ) )
+  &&     scgi_resp_append( d, "\r\n", 2 );
+}
+
+/*
+ * Add a header to the response, e.g. scgi_resp_header( req, "Content-Type", "text/plain" ).
+ * Must come before the body.  Don't add Content-Length yourself, scgi_resp_body takes care of it.
+ * Returns 0 if the name or value contain a line break (which would let whoever controls them
+ * add headers of their own), or the response has already outgrown the output buffer.
+ */
+int scgi_resp_header( scgi_request *req, char *name, char *value )
+{
+  scgi_desc *d = req->descriptor;
+
+  if ( !scgi_resp_start( d ) || d->body_starts )
+    return 0;
+
+  if ( strpbrk( name, "\r\n:" ) || strpbrk( value, "\r\n" ) )
+    return 0;
+
+  return scgi_resp_append( d, name, strlen( name ) )
+  &&     scgi_resp_append( d, ": ", 2 )
+  &&     scgi_resp_append( d, value, strlen( value ) )
+  &&     scgi_resp_append( d, "\r\n", 2 );
+}
+
+/*
+ * Add formatted text (printf-style) to the response's body.
+ * Returns 0 if the response has outgrown the output buffer.
+ */
+int scgi_resp_printf( scgi_request *req, char *fmt, ... )
+{
+  scgi_desc *d = req->descriptor;
+  va_list args;
+  int room, len;
+
+  if ( !scgi_resp_start_body( d ) )
+    return 0;
+
+  /*
+   * Try formatting it into whatever room there is; if it doesn't fit, make room and try again.
+   * Either way, it goes through scgi_resp_reserve, so max_outbuf_size holds even if it fit.
+   */
+  room = d->outbufsize + 1 - d->outbuflen;
+
+  va_start( args, fmt );
+  len = vsnprintf( &d->outbuf[d->outbuflen], room, fmt, args );
+  va_end( args );
+
+  if ( len < 0 || !scgi_resp_reserve( d, len ) )
+    return 0;
+
+  if ( len >= room )
+  {
+    va_start( args, fmt );
+    vsnprintf( &d->outbuf[d->outbuflen], len + 1, fmt, args );
+    va_end( args );
+  }
+
+  d->outbuflen += len;
+
+  return 1;
+}
+
+/*
+ * Add the last of the body to the response (len bytes of body, which may be NULL if len is 0),
+ * then finish it off: add the Content-Length header and send it on its way.  Like scgi_send,
+ * this finishes the request, and it belongs to the library from then on.
+ *
+ * Returns 0 if the response outgrew max_outbuf_size or we ran out of RAM.  In that case,
+ * the connection is closed (with nothing sent), since the webserver can't be given half a response.
+ */
+int scgi_resp_body( scgi_request *req, char *body, int len )
+{
+  scgi_desc *d = req->descriptor;
+  char buf[SCGI_CONTENT_LENGTH_ROOM + 1];
+  int body_len, n;
+
+  if ( !scgi_resp_start_body( d ) || ( len > 0 && !scgi_resp_append( d, body, len ) ) )
+  {
+    scgi_kill_socket( d, d->build_failed ? d->build_failed : SCGI_CLOSE_OUTBUF_OVERFLOW );
+    return 0;
+  }
+
+  body_len = d->outbuflen - d->body_starts;
+
+  /*
+   * HEAD requests get the Content-Length the body would have had, but not the body
+   */
+  if ( req->request_method == SCGI_METHOD_HEAD )
+    d->outbuflen = d->body_starts;
+
+  n = sprintf( buf, "Content-Length: %d\r\n", body_len );
+  memcpy( &d->outbuf[SCGI_CONTENT_LENGTH_ROOM - n], buf, n );
+
+  d->writehead = &d->outbuf[SCGI_CONTENT_LENGTH_ROOM - n];
+  d->outbuflen -= SCGI_CONTENT_LENGTH_ROOM - n;
+  d->building = 0;
+
+  req->timings.sent = scgi_now_usecs();
+
+  return 1;
+}
+
+/*
+ * Hash a response cache key (the same as scgi_hash would give for the key as it's stored,
+ * with the three parts separated by \0's).  NULL means "".
+ */
+unsigned int scgi_cache_hash( char *host, char *uri, char *query )
+{
+  char *parts[3];
+  unsigned int h = 2166136261u;
+  int i;
+
+  parts[0] = host;
+  parts[1] = uri;
+  parts[2] = query;
+
+  for ( i = 0; i < 3; i++ )
+  {
+    char *str;
+
+    for ( str = parts[i]; str && *str; str++ )
+      h = ( h ^ (unsigned char) *str ) * 16777619u;
+
+    h = h * 16777619u;
+  }
+
+  return h;
+}
+
+/*
+ * Does a response cache entry's key match?  NULL means "".
+ */
+int scgi_cache_key_matches( scgi_cache_entry *e, char *host, char *uri, char *query )
+{
+  char *k = e->key;
+
+  if ( strcmp( k, host ? host : "" ) )
+    return 0;
+  k += strlen( k ) + 1;
+
+  if ( strcmp( k, uri ? uri : "" ) )
+    return 0;
+  k += strlen( k ) + 1;
+
+  return !strcmp( k, query ? query : "" );
+}
+
+/*
+ * Find a response in the response cache, or NULL if it isn't there.  Stale entries are thrown out
+ * as we come across them.
+ */
+scgi_cache_entry *scgi_cache_lookup( char *host, char *uri, char *query )
+{
+  scgi_cache_entry *e;
+  unsigned int h = scgi_cache_hash( host, uri, query );
+
+  for ( e = scgi_cache_table[h % SCGI_CACHE_BUCKETS]; e; e = e->next_in_bucket )
+  {
+    if ( e->hash == h && scgi_cache_key_matches( e, host, uri, query ) )
+    {
+      if ( e->expires <= scgi_now_usecs() )
+      {
+        scgi_cache_remove( e );
+        return NULL;
+      }
+      return e;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Take an entry out of the response cache and free it
+ */
+void scgi_cache_remove( scgi_cache_entry *e )
+{
+  scgi_cache_entry **ptr;
+
+  for ( ptr = &scgi_cache_table[e->hash % SCGI_CACHE_BUCKETS]; *ptr; ptr = &(*ptr)->next_in_bucket )
+  {
+    if ( *ptr == e )
+    {
+      *ptr = e->next_in_bucket;
+      break;
+    }
+  }
+
+  SCGI_UNLINK( e, first_scgi_cache_entry, last_scgi_cache_entry, next_lru, prev_lru );
+
+  scgi_cache_used -= e->cost;
+
+  free( e );
+}
+
+/*
+ * Throw out the least recently used responses until there's room for "cost" more bytes
+ */
+void scgi_cache_make_room( long cost )
+{
+  while ( first_scgi_cache_entry && scgi_cache_used + cost > scgi_cache_budget )
+    scgi_cache_remove( first_scgi_cache_entry );
+}
+
+/*
+ * Answer a request from the response cache, if possible (returns 0 if not).  The response is copied
+ * into the connection's output buffer, so it doesn't matter if the entry is thrown out meanwhile.
+ * HEAD requests get only the headers.
+ */
+int scgi_answer_from_cache( scgi_desc *d )
+{
+  scgi_request *req = d->req;
+  scgi_cache_entry *e = scgi_cache_lookup( req->http_host, req->request_uri, req->query_string );
+
+  if ( !e )
+    return 0;
+
+  /*
+   * Not scgi_send: if the memory budget won't have it, that would answer them with a 503, when
+   * they can just as well be treated as a miss and given to you (the programmer)
+   */
+  if ( scgi_fill_outbuf( d, e->response, req->request_method == SCGI_METHOD_HEAD ? e->headers_len : e->len ) != 1 )
+    return 0;
+
+  /*
+   * Move it to the back of the line for eviction purposes
+   */
+  if ( e != last_scgi_cache_entry )
+  {
+    SCGI_UNLINK( e, first_scgi_cache_entry, last_scgi_cache_entry, next_lru, prev_lru );
+    SCGI_LINK( e, first_scgi_cache_entry, last_scgi_cache_entry, next_lru, prev_lru );
+  }
+
+  scgi_respond_from_loop( d, d->outbuf, d->outbuflen, SCGI_CLOSE_COMPLETED );
+  return 1;
+}
+
+/*
+ * Put a response in the response cache.  For the next ttl_msecs milliseconds, GET and HEAD requests
+ * with the same host, URI and query string as req will be answered with it straight from the event loop,
+ * without going through scgi_recv.  The response should be the whole thing, headers and body, just as
+ * you'd pass it to scgi_send (in fact, you'll usually do both); it is copied, so you can do what you like
+ * with it afterwards.
+ *
+ * If the cache is over budget, the least recently used responses are thrown out to make room.
+ * Returns 0 if the response doesn't fit in the budget at all, or there isn't enough RAM.
+ */
+int scgi_cache_insert( scgi_request *req, char *response, int len, int ttl_msecs )
+{
+  scgi_cache_entry *e;
+  char *host = req->http_host ? req->http_host : "";
+  char *uri = req->request_uri ? req->request_uri : "";
+  char *query = req->query_string ? req->query_string : "";
+  int hostlen = strlen( host ), urilen = strlen( uri ), querylen = strlen( query );
+  int keylen = hostlen + urilen + querylen + 3;
+  long cost = sizeof(scgi_cache_entry) + keylen + len;
+  char *end;
+
+  if ( len < 0 || ttl_msecs <= 0 || cost > scgi_cache_budget )
+    return 0;
+
+  if ( ( e = scgi_cache_lookup( host, uri, query ) ) != NULL )
+    scgi_cache_remove( e );
+
+  scgi_cache_make_room( cost );
+
+  /*
+   * The entry, its key and its response all go in one allocation
+   */
+  e = (scgi_cache_entry *) malloc( cost );
+
+  if ( !e )
+    return 0;
+
+  e->key = (char *) &e[1];
+  memcpy( e->key, host, hostlen + 1 );
+  memcpy( &e->key[hostlen + 1], uri, urilen + 1 );
+  memcpy( &e->key[hostlen + urilen + 2], query, querylen + 1 );
+  e->keylen = keylen;
+
+  e->response = &e->key[keylen];
+  memcpy( e->response, response, len );
+  e->len = len;
+
+  /*
+   * The headers end at the first blank line (or if there isn't one, it's all headers)
+   */
+  e->headers_len = len;
+
+  for ( end = e->response; ( end = memchr( end, '\n', &e->response[len] - end ) ) != NULL; end++ )
+  {
+    if ( &end[1] < &e->response[len] && end[1] == '\n' )
+    {
+      e->headers_len = &end[2] - e->response;
+      break;
+    }
+    if ( &end[2] < &e->response[len] && end[1] == '\r' && end[2] == '\n' )
+    {
+      e->headers_len = &end[3] - e->response;
+      break;
+    }
+  }
+
+  e->hash = scgi_cache_hash( host, uri, query );
+  e->expires = scgi_now_usecs() + ttl_msecs * 1000LL;
+  e->cost = cost;
+
+  e->next_in_bucket = scgi_cache_table[e->hash % SCGI_CACHE_BUCKETS];
+  scgi_cache_table[e->hash % SCGI_CACHE_BUCKETS] = e;
+
+  SCGI_LINK( e, first_scgi_cache_entry, last_scgi_cache_entry, next_lru, prev_lru );
+
+  scgi_cache_used += cost;
+
+  return 1;
+}
+
+/*
+ * Throw responses out of the response cache.  NULL for the host, URI or query string means any,
+ * so e.g. scgi_cache_invalidate( NULL, "/news", NULL ) throws out /news for every host and query
+ * string, and scgi_cache_invalidate( NULL, NULL, NULL ) empties the cache.
+ * Returns how many responses were thrown out.
+ */
+int scgi_cache_invalidate( char *host, char *uri, char *query )
+{
+  scgi_cache_entry *e, *e_next;
+  int count = 0;
+
+  if ( host && uri && query )
+  {
+    if ( ( e = scgi_cache_lookup( host, uri, query ) ) == NULL )
+      return 0;
+    scgi_cache_remove( e );
+    return 1;
+  }
+
+  for ( e = first_scgi_cache_entry; e; e = e_next )
+  {
+    char *k = e->key;
+
+    e_next = e->next_lru;
+
+    if ( host && strcmp( k, host ) )
+      continue;
+    k += strlen( k ) + 1;
+
+    if ( uri && strcmp( k, uri ) )
+      continue;
+    k += strlen( k ) + 1;
+
+    if ( query && strcmp( k, query ) )
+      continue;
+
+    scgi_cache_remove( e );
+    count++;
+  }
+
+  return count;
+}
+
+/*
+ * Set how many bytes (of responses, keys and bookkeeping) the response cache may hold.
+ * 0 turns the cache off.  If the cache is already bigger, the least recently used responses
+ * are thrown out right away.
+ */
+void scgi_cache_set_budget( long budget )
+{
+  scgi_cache_budget = budget > 0 ? budget : 0;
+  scgi_cache_make_room( 0 );
+}
+
+/*
+ * Limit how much memory connections' input and output buffers and requests' arenas (their
+ * headers and bodies) may use, over all ports: past soft_limit bytes, requests which say they're
+ * bigger than SCGI_MEMORY_LARGE_REQUEST are turned away (503) as soon as they say so, and nothing
+ * may take us past hard_limit: new connections are turned away (503), responses which would need
+ * a bigger output buffer get a 503 instead, and connections whose input buffer or arena would
+ * need to grow are dropped.
+ * Either limit can be 0 for no limit.  Within each process, that is: with scgi_prefork,
+ * every worker gets the whole budget.
+ *
+ * Returns 0 if a limit is negative, or the soft limit is above the hard one.
+ */
+int scgi_set_memory_budget( long soft_limit, long hard_limit )
+{
+  if ( soft_limit < 0 || hard_limit < 0 || ( hard_limit > 0 && soft_limit > hard_limit ) )
+    return 0;
+
+  scgi_memory_soft_limit = soft_limit;
+  scgi_memory_hard_limit = hard_limit;
+
+  return 1;
+}
+
+/*
+ * How many bytes connections' input and output buffers and requests' arenas are using right now
+ */
+long scgi_memory_in_use( void )
+{
+  return scgi_memory_used;
+}
+
+/*
+ * Count "bytes" more bytes of connections' buffers or requests' arenas (or fewer, if it's negative),
+ * unless that would take us past the hard limit (see scgi_set_memory_budget), in which case return 0.
+ */
+int scgi_memory_charge( long bytes )
+{
+  scgi_memory_refused = bytes > 0 && scgi_memory_hard_limit > 0 && scgi_memory_used + bytes > scgi_memory_hard_limit;
+
+  if ( scgi_memory_refused )
+    return 0;
+
+  scgi_memory_used += bytes;
+
+  return 1;
+}
+
+/*
+ * How much does an Accept-Encoding header (e.g. "gzip, deflate;q=0.5, *;q=0") like a given content coding?
+ * Returns its q-value, from 0 (not acceptable) to 1.  Identity is acceptable unless ruled out, but
+ * if it isn't mentioned, it gets a token q-value so that anything they actually asked for wins.
+ * If there's no Accept-Encoding header at all, identity is the only safe choice.
+ */
+double scgi_accept_q( char *accept, char *coding )
+{
+  int codinglen = strlen( coding ), is_identity = !strcasecmp( coding, "identity" );
+  double star = -1;
+
+  if ( !accept )
+    return is_identity ? 1 : 0;
+
+  while ( *accept )
+  {
+    char *name, *end;
+    int namelen;
+    double q = 1;
+
+    while ( *accept == ' ' || *accept == '\t' || *accept == ',' )
+      accept++;
+
+    if ( !*accept )
+      break;
+
+    name = accept;
+
+    while ( *accept && *accept != ',' && *accept != ';' && *accept != ' ' && *accept != '\t' )
+      accept++;
+
+    namelen = accept - name;
+
+    /*
+     * Parameters: the only one we care about is q
+     */
+    end = accept;
+    while ( *end && *end != ',' )
+      end++;
+
+    for ( ; accept < end; accept++ )
+    {
+      if ( ( *accept == 'q' || *accept == 'Q' ) && accept[1] == '=' && ( accept[-1] == ';' || accept[-1] == ' ' ) )
+        q = strtod( &accept[2], NULL );
+    }
+
+    if ( namelen == codinglen && !strncasecmp( name, coding, codinglen ) )
+      return q;
+
+    if ( namelen == 1 && *name == '*' )
+      star = q;
+  }
+
+  if ( star >= 0 )
+    return star;
+
+  return is_identity ? 0.001 : 0;
+}
+
+/*
+ * Answer a request with a static response, if there is one for its URI (returns 0 if not).
+ * Of the variants the client accepts, the one they like best wins, and among those, the smallest.
+ * The response is sent by reference, since static responses never go away.
+ */
+int scgi_answer_with_static_response( scgi_desc *d )
+{
+  scgi_request *req = d->req;
+  scgi_static_response *v, *best = NULL;
+  double best_q = 0;
+  char *uri = req->request_uri, *query;
+  unsigned int h;
+
+  if ( !uri )
+    return 0;
+
+  /*
+   * Static responses don't care about the query string
+   */
+  if ( ( query = strchr( uri, '?' ) ) != NULL )
+  {
+    char *path = scgi_req_alloc( req, query - uri + 1 );
+
+    if ( !path )
+      return 0;
+    memcpy( path, uri, query - uri );
+    path[query - uri] = '\0';
+    uri = path;
+  }
+
+  h = scgi_hash( uri );
+
+  for ( v = first_scgi_static_response; v; v = v->next )
+  {
+    double q;
+
+    if ( v->hash != h || strcmp( v->uri, uri ) )
+      continue;
+
+    q = scgi_accept_q( req->http_accept_encoding, v->encoding );
+
+    if ( q <= 0 )
+      continue;
+
+    if ( !best || q > best_q || ( q == best_q && v->len - v->headers_len < best->len - best->headers_len ) )
+    {
+      best = v;
+      best_q = q;
+    }
+  }
+
+  if ( !best )
+    return 0;
+
+  scgi_respond_from_loop( d, best->response, req->request_method == SCGI_METHOD_HEAD ? best->headers_len : best->len, SCGI_CLOSE_COMPLETED );
+  return 1;
+}
+
+/*
+ * Register a static response: from now on, GET and HEAD requests for the uri (regardless of
+ * query string) are answered with body straight from the event loop, and scgi_recv never sees them.
+ * Good for health checks, robots.txt, favicons and the like.
+ *
+ * Call it once for each content encoding you have the body in: encoding is "identity" (or NULL)
+ * for the plain body, or e.g. "gzip", "br" or "zstd" for a precompressed one.  Each request gets
+ * the variant its Accept-Encoding header likes best (and the smallest, among equals).  If it accepts
+ * none of them, it goes to scgi_recv as usual.  Registering the same uri and encoding again replaces
+ * the old variant.
+ *
+ * Everything is copied, and the full responses (with Content-Length, Content-Encoding and Vary
+ * headers) are formatted once and for all, right here.
+ * Returns 0 if there isn't enough RAM.
+ */
+int scgi_add_static_response( char *uri, char *content_type, char *encoding, char *body, int len )
+{
+  scgi_static_response *v, **ptr;
+  char headers[768];
+  int headers_len, urilen, enclen;
+
+  if ( !encoding )
+    encoding = "identity";
+
+  if ( !content_type )
+    content_type = "application/octet-stream";
+
+  if ( len < 0 || strlen( content_type ) + strlen( encoding ) > 256 )
+    return 0;
+
+  if ( !strcasecmp( encoding, "identity" ) )
+    headers_len = sprintf( headers, "Status: 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\nVary: Accept-Encoding\r\n\r\n",
+      content_type, len );
+  else
+    headers_len = sprintf( headers, "Status: 200 OK\r\nContent-Type: %s\r\nContent-Length: %d\r\nContent-Encoding: %s\r\nVary: Accept-Encoding\r\n\r\n",
+      content_type, len, encoding );
+
+  urilen = strlen( uri );
+  enclen = strlen( encoding );
+
+  /*
+   * The variant, its uri and encoding, and its response all go in one allocation
+   */
+  v = (scgi_static_response *) malloc( sizeof(scgi_static_response) + urilen + 1 + enclen + 1 + headers_len + len );
+
+  if ( !v )
+    return 0;
+
+  v->uri = (char *) &v[1];
+  memcpy( v->uri, uri, urilen + 1 );
+  v->encoding = &v->uri[urilen + 1];
+  memcpy( v->encoding, encoding, enclen + 1 );
+  v->response = &v->encoding[enclen + 1];
+  memcpy( v->response, headers, headers_len );
+  memcpy( &v->response[headers_len], body, len );
+  v->headers_len = headers_len;
+  v->len = headers_len + len;
+  v->hash = scgi_hash( v->uri );
+
+  /*
+   * Replace the old variant, if any.  (Connections might still be sending the old one, which
+   * is why it isn't freed; replacing static responses is meant to be rare.)
+   */
+  for ( ptr = &first_scgi_static_response; *ptr; ptr = &(*ptr)->next )
+  {
+    if ( (*ptr)->hash == v->hash && !strcmp( (*ptr)->uri, uri ) && !strcasecmp( (*ptr)->encoding, encoding ) )
+    {
+      v->next = (*ptr)->next;
+      *ptr = v;
+      return 1;
+    }
+  }
+
+  v->next = first_scgi_static_response;
+  first_scgi_static_response = v;
+
+  return 1;
+}
+
+/*
+ * Set by the signal handler when the master process of scgi_prefork is told to shut down
+ */
+volatile sig_atomic_t scgi_prefork_shutdown;
+
+void scgi_prefork_signal( int sig )
+{
+  (void) sig;
+  scgi_prefork_shutdown = 1;
+}
+
+/*
+ * Use every core, without threads: call this after scgi_initialize (for every port you want),
+ * and it forks the specified number of worker processes, which all share the listening sockets.
+ * In each worker, it returns that worker's number (0 to workers-1), and from there on, the worker
+ * is just like a single-process server: call scgi_recv in a loop, etc.  Since each worker is its
+ * own process, your handlers don't need to be thread-safe.
+ *
+ * The original process becomes the master.  It doesn't serve any requests itself; it waits,
+ * and if a worker dies, it starts a new one in its place (with the same number).  When the master
+ * gets SIGTERM or SIGINT, it passes SIGTERM on to the workers, waits for them to exit, and then
+ * returns -1, at which point it should clean up and exit.  It also returns -1 if it can't fork
+ * the workers to begin with (workers which were already started are stopped).
+ *
+ * Stats, caches, hooks etc. are per process; set them up before calling scgi_prefork to have
+ * every worker start out with them.  Capturing traffic (see scgi_capture_start) is the exception:
+ * workers can't share one capture file (they'd share its offset too, and scribble over each
+ * other's records), so any capture that's running is stopped here, and each worker should start
+ * its own, with a file of its own (e.g. one named after its worker number or pid).
+ */
+int scgi_prefork( int workers )
+{
+  struct sigaction sa, old_term, old_int;
+  pid_t *pids, pid;
+  long long *started;
+  int i, status, alive = 0;
+
+  if ( workers < 1 )
+    return -1;
+
+  scgi_capture_stop();
+
+  SCGI_CREATE( pids, pid_t, workers );
+  SCGI_CREATE( started, long long, workers );
+
+  memset( &sa, 0, sizeof(sa) );
+  sa.sa_handler = scgi_prefork_signal;
+  sigemptyset( &sa.sa_mask );
+  sigaction( SIGTERM, &sa, &old_term );
+  sigaction( SIGINT, &sa, &old_int );
+  scgi_prefork_shutdown = 0;
+
+  for ( ; ; )
+  {
+    /*
+     * (Re)start any workers that aren't running.  If a worker died young, it's probably going to
+     * keep dying, so don't restart it over and over as fast as we can.
+     */
+    for ( i = 0; i < workers && !scgi_prefork_shutdown; i++ )
+    {
+      if ( pids[i] )
+        continue;
+
+      if ( started[i] && scgi_now_usecs() - started[i] < 1000000 )
+        sleep( 1 );
+
+      if ( scgi_prefork_shutdown )
+        break;
+
+      /*
+       * Anything still sitting in a stdio buffer would be copied into the worker, and then
+       * written out twice
+       */
+      fflush( NULL );
+
+      pid = fork();
+
+      if ( pid == 0 )
+      {
+        /*
+         * We're the worker
+         */
+        sigaction( SIGTERM, &old_term, NULL );
+        sigaction( SIGINT, &old_int, NULL );
+        free( pids );
+        free( started );
+        return i;
+      }
+
+      if ( pid < 0 )
+      {
+        scgi_perror( "Warning: scgilib was unable to fork a worker process." );
+
+        if ( !alive )
+        {
+          scgi_prefork_shutdown = 1;
+          break;
+        }
+        continue;
+      }
+
+      pids[i] = pid;
+      started[i] = scgi_now_usecs();
+      alive++;
+    }
+
+    if ( scgi_prefork_shutdown )
+      break;
+
+    /*
+     * Wait for a worker to die (or for a signal)
+     */
+    pid = waitpid( -1, &status, 0 );
+
+    if ( pid <= 0 )
+    {
+      if ( errno == ECHILD )
+        alive = 0;
+      else if ( !alive )
+        sleep( 1 );
+      continue;
+    }
+
+    for ( i = 0; i < workers; i++ )
+    {
+      if ( pids[i] == pid )
+      {
+        fprintf( stderr, "scgilib: worker %d (pid %d) %s %d, restarting it.\n", i, (int) pid,
+                 WIFSIGNALED( status ) ? "was killed by signal" : "exited with status",
+                 WIFSIGNALED( status ) ? WTERMSIG( status ) : WEXITSTATUS( status ) );
+        pids[i] = 0;
+        alive--;
+        break;
+      }
+    }
+  }
+
+  /*
+   * Shutting down: pass it on, and wait for the workers to finish
+   */
+  for ( i = 0; i < workers; i++ )
+  {
+    if ( pids[i] )
+      kill( pids[i], SIGTERM );
+  }
+
+  while ( alive > 0 )
+  {
+    pid = waitpid( -1, &status, 0 );
+
+    if ( pid < 0 && errno != EINTR )
+      break;
+
+    if ( pid > 0 )
+      alive--;
+  }
+
+  sigaction( SIGTERM, &old_term, NULL );
+  sigaction( SIGINT, &old_int, NULL );
+  free( pids );
+  free( started );
+
+  return -1;
+}
+
+/*
+ * Get a handle for a request: a number which identifies it, and which (unlike the pointer)
+ * stays safe to use after the request is freed, since it then simply stops matching.
+ * Check it with scgi_handle_alive (from any thread) or turn it back into the request with
+ * scgi_handle_lookup.  Handles are never 0.
+ */
+scgi_handle scgi_request_handle( scgi_request *req )
+{
+  scgi_slot *slot = (scgi_slot *) req->descriptor;
+  unsigned int generation = atomic_load_explicit( &slot->generation, memory_order_relaxed );
+
+  return ( (scgi_handle) ( slot - scgi_slots ) << 32 ) | ( (scgi_handle) ( generation & 0x7fffffffU ) << 1 ) | 1;
+}
+
+/*
+ * Is the request a handle refers to still around?  Only looks at the slot's generation, without
+ * touching the request, so it's safe from any thread (though of course, the answer can change
+ * a moment later, when the thread running the library frees the request).  The slot's in_use
+ * doesn't need checking: handles are only made for connections in the slot, and the generation
+ * goes up as soon as the connection leaves it.
+ */
+int scgi_handle_alive( scgi_handle h )
+{
+  unsigned long long i = h >> 32;
+  unsigned int generation;
+
+  if ( !scgi_slots || i >= (unsigned long long) scgi_total_slots )
+    return 0;
+
+  generation = atomic_load_explicit( &scgi_slots[i].generation, memory_order_acquire );
+
+  return ( ( h & 0xffffffffULL ) >> 1 ) == ( generation & 0x7fffffffU );
+}
+
+/*
+ * Turn a handle back into its request, or NULL if the request has been freed since.
+ * Like the request itself, only use this from the thread running the library.
+ */
+scgi_request *scgi_handle_lookup( scgi_handle h )
+{
+  if ( !scgi_handle_alive( h ) )
+    return NULL;
+
+  return scgi_slots[h >> 32].desc.req;
+}
+
+/*
+ * Start recording all incoming traffic (on every port) to a file, in the format described
+ * at SCGI_CAPTURE_MAGIC, so it can be played back later with bench/scgireplay to see how a new
+ * version of your server copes with your real traffic.  If we were already recording to
+ * another file, that one is closed first.
+ *
+ * Mind that the file gets everything the webserver sends, cookies and all, so treat it
+ * as carefully as you would your webserver's logs.
+ *
+ * With scgi_prefork, call this in each worker (after scgi_prefork returns), each with its own
+ * filename, e.g. one with getpid() in it.  scgi_prefork stops any capture started before it.
+ *
+ * Returns 0 if the file couldn't be created.
+ */
+int scgi_capture_start( char *filename )
+{
+  FILE *fp;
+
+  scgi_capture_stop();
+
+  if ( !( fp = fopen( filename, "wb" ) ) )
+    return 0;
+
+  if ( fwrite( SCGI_CAPTURE_MAGIC, 1, SCGI_CAPTURE_MAGIC_LEN, fp ) != SCGI_CAPTURE_MAGIC_LEN )
+  {
+    fclose( fp );
+    return 0;
+  }
+
+  scgi_capture_file = fp;
+  scgi_capture_last_record = scgi_now_usecs();
+
+  return 1;
+}
+
+/*
+ * Stop recording (see scgi_capture_start), and close the file
  */
-int scgi_send( scgi_request *req, char *txt, int len )
+void scgi_capture_stop( void )
 {
-  scgi_desc *d = req->descriptor;
+  if ( !scgi_capture_file )
+    return;
+
+  if ( fclose( scgi_capture_file ) != 0 )
+    scgi_perror( "scgilib: Couldn't finish writing the capture file" );
+
+  scgi_capture_file = NULL;
+}
+
+/*
+ * Record a chunk of input which recv just handed us from a connection
+ */
+void scgi_capture( scgi_desc *d, char *data, int len )
+{
+  long long now = scgi_now_usecs();
 
   /*
-   * If more is being sent than we've allocated space for, then allocate more space
+   * Numbers only need to be unique within a file, so connections which were already open when
+   * the capture started simply get the next one when they first show up in it
    */
-  if ( len >= d->outbufsize - 5 )
+  if ( !d->capture_id )
+    d->capture_id = ++scgi_capture_next_id;
+
+  if ( !scgi_capture_varint( d->capture_id )
+  ||   !scgi_capture_varint( now > scgi_capture_last_record ? now - scgi_capture_last_record : 0 )
+  ||   !scgi_capture_varint( len )
+  ||   fwrite( data, 1, len, scgi_capture_file ) != (size_t) len )
+  {
+    scgi_perror( "scgilib: Couldn't write to the capture file, so we've stopped capturing" );
+    scgi_capture_stop();
+    return;
+  }
+
+  scgi_capture_last_record = now;
+}
+
+/*
+ * Write a number to the capture file as a varint (see SCGI_CAPTURE_MAGIC).
+ * Returns 0 if the write failed.
+ */
+int scgi_capture_varint( unsigned long long x )
+{
+  do
   {
-    char *newbuf = calloc( len + 6, sizeof(char) );
+    if ( putc( ( x & 0x7f ) | ( x > 0x7f ? 0x80 : 0 ), scgi_capture_file ) == EOF )
+      return 0;
+    x >>= 7;
+  }
+  while ( x );
+
+  return 1;
+}
+
+/*
+ * Send requests for a host and path to a handler, which is called (from the event loop) with the
+ * request and arg as soon as the request has arrived.  It's then your request, just as if you'd
+ * got it from scgi_recv: answer it right away, or hang on to it (a handle, see scgi_request_handle,
+ * is the safe way) and answer it later.  With a NULL handler, matching requests are queued for
+ * scgi_recv as usual.  Once there are any routes, requests which match none get a 404 straight
+ * from the event loop, without bothering you.
+ *
+ * path must begin with '/'.  With match = SCGI_ROUTE_EXACT, the route matches URIs which are exactly
+ * path (not counting any query string); with SCGI_ROUTE_PREFIX, URIs which begin with path, so end
+ * it with '/' to match whole path segments.  The longest matching prefix wins, and an exact match
+ * beats any prefix.  host (e.g. "www.example.com", not case sensitive, without a port number) can be
+ * NULL for any host; routes for the request's own host are tried first, and only if none of them
+ * match, routes for any host.
+ *
+ * Routes are compiled into a trie, so a request is routed in a single pass over its host and URI,
+ * however many routes there are.  Add them at startup: every addition recompiles the lot.
+ *
+ * Returns 0 if the path or host isn't valid, the route already exists, or we're out of RAM.
+ */
+int scgi_add_route( char *host, char *path, int match, scgi_route_handler *handler, void *arg )
+{
+  scgi_route *tmp;
+  char *key;
+  int hostlen = host ? strlen( host ) : 0, i;
+
+  if ( !path || *path != '/' || ( match != SCGI_ROUTE_EXACT && match != SCGI_ROUTE_PREFIX )
+  ||   strchr( path, '?' ) || ( host && strpbrk( host, "/:" ) ) )
+    return 0;
 
-    if ( !newbuf )
+  if ( !( key = (char *) malloc( hostlen + strlen( path ) + 1 ) ) )
+    return 0;
+
+  for ( i = 0; i < hostlen; i++ )
+    key[i] = tolower( (unsigned char) host[i] );
+  strcpy( &key[hostlen], path );
+
+  for ( i = 0; i < scgi_route_count; i++ )
+  {
+    if ( scgi_routes[i].match == match && !strcmp( scgi_routes[i].key, key ) )
+    {
+      free( key );
       return 0;
-    memcpy( newbuf, txt, len );
-    free( d->outbuf );
-    d->outbuf = newbuf;
-    d->outbuflen = len;
-    d->outbufsize = len + 6;
-    return 1;
+    }
   }
 
-  memcpy( d->outbuf, txt, len );
-  d->outbuflen = len;
+  if ( !( tmp = (scgi_route *) realloc( scgi_routes, ( scgi_route_count + 1 ) * sizeof(scgi_route) ) ) )
+  {
+    free( key );
+    return 0;
+  }
+
+  scgi_routes = tmp;
+  scgi_routes[scgi_route_count].key = key;
+  scgi_routes[scgi_route_count].match = match;
+  scgi_routes[scgi_route_count].handler = handler;
+  scgi_routes[scgi_route_count].arg = arg;
+  scgi_route_count++;
+
+  if ( !scgi_compile_routes() )
+  {
+    free( scgi_routes[--scgi_route_count].key );
+    return 0;
+  }
+
+  return 1;
+}
+
+/*
+ * Forget all the routes, so that requests go to scgi_recv as usual again
+ */
+void scgi_clear_routes( void )
+{
+  int i;
+
+  for ( i = 0; i < scgi_route_count; i++ )
+    free( scgi_routes[i].key );
+
+  free( scgi_routes );
+  free( scgi_route_nodes );
+  free( scgi_route_edge_bytes );
+  free( scgi_route_edge_nodes );
+
+  scgi_routes = NULL;
+  scgi_route_nodes = NULL;
+  scgi_route_edge_bytes = NULL;
+  scgi_route_edge_nodes = NULL;
+  scgi_route_count = 0;
+  scgi_route_node_count = 0;
+  scgi_route_edge_count = 0;
+}
+
+/*
+ * Build the trie of the routes' keys from scratch: sort them, and then each node's children are
+ * simply the distinct next bytes of a run of consecutive keys, so they can be laid out side by side.
+ * Returns 0 if we're out of RAM (leaving the previous trie in place).
+ */
+int scgi_compile_routes( void )
+{
+  scgi_route_node *nodes;
+  unsigned char *edge_bytes;
+  int *edge_nodes, *order, total = 1, i;
+
+  for ( i = 0; i < scgi_route_count; i++ )
+    total += strlen( scgi_routes[i].key );
+
+  nodes = (scgi_route_node *) malloc( total * sizeof(scgi_route_node) );
+  edge_bytes = (unsigned char *) malloc( total );
+  edge_nodes = (int *) malloc( total * sizeof(int) );
+  order = (int *) malloc( ( scgi_route_count + 1 ) * sizeof(int) );
+
+  if ( !nodes || !edge_bytes || !edge_nodes || !order )
+  {
+    free( nodes );
+    free( edge_bytes );
+    free( edge_nodes );
+    free( order );
+    return 0;
+  }
+
+  for ( i = 0; i < scgi_route_count; i++ )
+    order[i] = i;
+
+  qsort( order, scgi_route_count, sizeof(int), scgi_compare_routes );
+
+  free( scgi_route_nodes );
+  free( scgi_route_edge_bytes );
+  free( scgi_route_edge_nodes );
+
+  scgi_route_nodes = nodes;
+  scgi_route_edge_bytes = edge_bytes;
+  scgi_route_edge_nodes = edge_nodes;
+  scgi_route_node_count = 0;
+  scgi_route_edge_count = 0;
+
+  scgi_compile_route_node( order, 0, scgi_route_count, 0 );
+
+  free( order );
+  return 1;
+}
+
+/*
+ * Sort routes by key (byte by byte, unsigned, which is how the trie is searched)
+ */
+int scgi_compare_routes( const void *a, const void *b )
+{
+  return strcmp( scgi_routes[*(const int *) a].key, scgi_routes[*(const int *) b].key );
+}
+
+/*
+ * Make the trie node for the (sorted) routes order[lo] to order[hi-1], whose keys all share their
+ * first "depth" bytes, and return its index
+ */
+int scgi_compile_route_node( int *order, int lo, int hi, int depth )
+{
+  int node = scgi_route_node_count++, edge, i, j;
+  scgi_route_node *n = &scgi_route_nodes[node];
+
+  n->exact = -1;
+  n->prefix = -1;
 
   /*
-   * The actual physical transmission will be handled by the scgi_flush_response function,
-   * once the socket is ready to receive it.
+   * Keys which end here sort before the ones which go on
    */
+  for ( ; lo < hi && !scgi_routes[order[lo]].key[depth]; lo++ )
+  {
+    if ( scgi_routes[order[lo]].match == SCGI_ROUTE_EXACT )
+      n->exact = order[lo];
+    else
+      n->prefix = order[lo];
+  }
+
+  n->first_edge = scgi_route_edge_count;
+  n->edge_count = 0;
+
+  for ( i = lo; i < hi; i = j )
+  {
+    for ( j = i + 1; j < hi && scgi_routes[order[j]].key[depth] == scgi_routes[order[i]].key[depth]; j++ )
+      ;
+    n->edge_count++;
+  }
+
+  scgi_route_edge_count += n->edge_count;
+
+  for ( i = lo, edge = n->first_edge; i < hi; i = j, edge++ )
+  {
+    for ( j = i + 1; j < hi && scgi_routes[order[j]].key[depth] == scgi_routes[order[i]].key[depth]; j++ )
+      ;
+    scgi_route_edge_bytes[edge] = scgi_routes[order[i]].key[depth];
+    scgi_route_edge_nodes[edge] = scgi_compile_route_node( order, i, j, depth + 1 );
+  }
+
+  return node;
+}
+
+/*
+ * Follow a node's edge for a byte, returning the node it leads to, or -1 if there isn't one
+ */
+int scgi_route_child( int node, unsigned char byte )
+{
+  int lo = scgi_route_nodes[node].first_edge, hi = lo + scgi_route_nodes[node].edge_count, mid;
+
+  while ( lo < hi )
+  {
+    mid = ( lo + hi ) / 2;
+
+    if ( scgi_route_edge_bytes[mid] == byte )
+      return scgi_route_edge_nodes[mid];
+
+    if ( scgi_route_edge_bytes[mid] < byte )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return -1;
+}
+
+/*
+ * Follow a URI's path (up to any query string) down the trie from a node, and return the route
+ * it matches: exactly, if there is one, or else the longest prefix.  -1 if none match.
+ */
+int scgi_route_path( int node, char *uri )
+{
+  int best = -1;
+
+  for ( ; *uri && *uri != '?' && *uri != '#'; uri++ )
+  {
+    if ( ( node = scgi_route_child( node, (unsigned char) *uri ) ) < 0 )
+      return best;
+
+    if ( scgi_route_nodes[node].prefix >= 0 )
+      best = scgi_route_nodes[node].prefix;
+  }
+
+  return scgi_route_nodes[node].exact >= 0 ? scgi_route_nodes[node].exact : best;
+}
+
+/*
+ * Which route does a request match?  Returns its index, or -1 if none.
+ */
+int scgi_find_route( scgi_request *req )
+{
+  char *uri = req->request_uri ? req->request_uri : "", *c;
+  int node = 0, route;
+
+  if ( req->http_host && *req->http_host )
+  {
+    for ( c = req->http_host; *c && *c != ':' && node >= 0; c++ )
+      node = scgi_route_child( node, tolower( (unsigned char) *c ) );
+
+    if ( node >= 0 && ( route = scgi_route_path( node, uri ) ) >= 0 )
+      return route;
+  }
+
+  return scgi_route_path( 0, uri );
+}
+
+/*
+ * A request is ready, and there are routes: send it wherever they say.
+ * Returns 1 if it's to be queued for scgi_recv after all, or 0 if it's been dealt with.
+ *
+ * This is called from inside the parser, so the route's handler isn't called from here: it
+ * might well kill the connection (e.g. if its response is too big), and then the parser would
+ * be left holding a connection whose buffers have been freed.  Instead the route is noted, and
+ * scgi_listen_to_request calls the handler (see scgi_run_route_handler) once the parser is done.
+ */
+int scgi_dispatch_route( scgi_desc *d )
+{
+  scgi_route *r;
+  int route = scgi_find_route( d->req );
+
+  if ( route < 0 )
+  {
+    d->port->stats.requests_not_found++;
+    scgi_respond_canned( d, SCGI_CANNED_NOT_FOUND, SCGI_CLOSE_COMPLETED );
+    return 0;
+  }
+
+  r = &scgi_routes[route];
+
+  if ( !r->handler )
+    return 1;
+
+  d->route = r;
+
+  return 0;
+}
+
+/*
+ * Give a request to the handler of the route scgi_dispatch_route picked for it:
+ * over to you, just as if scgi_recv had handed it to you
+ */
+void scgi_run_route_handler( scgi_desc *d )
+{
+  scgi_route *r = d->route;
+
+  d->route = NULL;
+  d->state = SCGI_SOCKSTATE_WRITING_RESPONSE;
+  d->port->stats.requests_routed++;
+  d->req->timings.recved = scgi_now_usecs();
+
+  (*r->handler)( d->req, r->arg );
+}
+
+/*
+ * Plug in a connection which doesn't come in through a socket, on the specified port: the event
+ * loop reads its request and sends its response through transport's functions, with data as the
+ * connection's transport_data, and otherwise treats it like any other connection.  (Those
+ * functions are expected not to block.)  It's a way to feed the library from something that isn't
+ * a socket, and it's what scgi_pipe_connect does.
+ * Returns NULL if there's no such port, the port already has max_connections, or there's no room
+ * in the connection table (see SCGI_VIRTUAL_SLOTS) or no RAM.
+ */
+scgi_desc *scgi_connect_transport( int port, scgi_transport *transport, void *data )
+{
+  scgi_port *p = scgi_find_port( port );
+  scgi_desc *d;
+
+  if ( !p || !transport )
+    return NULL;
+
+  if ( p->config.max_connections > 0 && p->stats.open_connections >= p->config.max_connections )
+  {
+    p->stats.connections_accepted++;
+    p->stats.connections_closed++;
+    p->stats.closed_by_reason[SCGI_CLOSE_SHED]++;
+    return NULL;
+  }
+
+  if ( !( d = scgi_new_connection( p, -1 ) ) )
+    return NULL;
+
+  d->transport = transport;
+  d->transport_data = data;
+
+  return d;
+}
+
+/*
+ * Open an in-memory connection to the specified port (a loopback one from scgi_initialize_loopback,
+ * or a real one: the library doesn't mind).  Write a request into it with scgi_pipe_write, let the
+ * event loop run (scgi_recv etc.), and read the response back out with scgi_pipe_read.  No sockets
+ * or system calls are involved, so what's left to measure is the library itself, and the same
+ * input always gets the same output.
+ * Returns NULL if scgi_connect_transport would.
+ */
+scgi_pipe *scgi_pipe_connect( int port )
+{
+  scgi_pipe *pp = (scgi_pipe *) calloc( 1, sizeof(scgi_pipe) );
+
+  if ( !pp )
+    return NULL;
+
+  pp->close_reason = -1;
+
+  if ( !( pp->desc = scgi_connect_transport( port, &scgi_pipe_transport, pp ) ) )
+  {
+    free( pp );
+    return NULL;
+  }
+
+  return pp;
+}
+
+/*
+ * Send len bytes of request down the pipe.  The library reads them next time the event loop
+ * runs, in chunks of up to SCGI_SCRATCH_SIZE, just as if they'd arrived on a socket.
+ * Returns 0 if there's no RAM, or the pipe has been shut down or closed by the library.
+ */
+int scgi_pipe_write( scgi_pipe *pp, char *data, int len )
+{
+  if ( pp->shut || !pp->desc )
+    return 0;
+
+  return scgi_pipe_append( &pp->in, &pp->in_len, &pp->in_read, &pp->in_size, data, len );
+}
+
+/*
+ * Say we're done writing: once the library has read what's already been written, it reads EOF
+ */
+void scgi_pipe_shutdown( scgi_pipe *pp )
+{
+  pp->shut = 1;
+}
+
+/*
+ * Read up to len bytes of what the library has sent down the pipe.
+ * Returns how many were read, 0 if there's nothing left and the library has closed the pipe (and
+ * pp->close_reason says why), or -1 if there's nothing yet.
+ */
+int scgi_pipe_read( scgi_pipe *pp, char *buf, int len )
+{
+  int n = pp->out_len - pp->out_read;
+
+  if ( n <= 0 )
+    return pp->desc ? -1 : 0;
+
+  if ( n > len )
+    n = len;
+
+  memcpy( buf, &pp->out[pp->out_read], n );
+  pp->out_read += n;
+
+  if ( pp->out_read == pp->out_len )
+    pp->out_read = pp->out_len = 0;
+
+  return n;
+}
+
+/*
+ * Done with a pipe.  If the library hasn't closed its end yet, it's as if we hung up on it (SCGI_CLOSE_EOF).
+ */
+void scgi_pipe_close( scgi_pipe *pp )
+{
+  if ( pp->desc )
+    scgi_kill_socket( pp->desc, SCGI_CLOSE_EOF );
+
+  free( pp->in );
+  free( pp->out );
+  free( pp );
+}
+
+/*
+ * Add n bytes to one direction of a pipe, making room if need be.  The first done bytes have
+ * already been read, so they're discarded first.  Returns 0 if there's no RAM.
+ */
+int scgi_pipe_append( char **buf, int *len, int *done, int *size, char *data, int n )
+{
+  char *bigger;
+  int newsize;
+
+  if ( *done > 0 )
+  {
+    memmove( *buf, *buf + *done, *len - *done );
+    *len -= *done;
+    *done = 0;
+  }
+
+  if ( *len + n > *size )
+  {
+    newsize = *size ? *size * 2 : 1024;
+    while ( newsize < *len + n )
+      newsize *= 2;
+
+    if ( !( bigger = (char *) realloc( *buf, newsize ) ) )
+      return 0;
+
+    *buf = bigger;
+    *size = newsize;
+  }
+
+  memcpy( *buf + *len, data, n );
+  *len += n;
 
   return 1;
 }
 
+/*
+ * The library's end of a pipe (see scgi_pipe_transport)
+ */
+int scgi_pipe_readable( scgi_desc *d )
+{
+  scgi_pipe *pp = (scgi_pipe *) d->transport_data;
 
-void scgi_302_redirect( scgi_request *req, char *address )
+  return pp->in_read < pp->in_len || pp->shut;
+}
+
+int scgi_pipe_recv( scgi_desc *d, char *buf, int len )
 {
-  char buf[256], *b = buf;
-  int len;
+  scgi_pipe *pp = (scgi_pipe *) d->transport_data;
+  int n = pp->in_len - pp->in_read;
+
+  if ( n <= 0 )
+  {
+    if ( pp->shut )
+      return 0;
+
+    errno = EAGAIN;
+    return -1;
+  }
+
+  if ( n > len )
+    n = len;
 
-  len = 100 + strlen(address);
+  memcpy( buf, &pp->in[pp->in_read], n );
+  pp->in_read += n;
 
-  if ( len >= 250 )
+  if ( pp->in_read == pp->in_len )
+    pp->in_read = pp->in_len = 0;
+
+  return n;
+}
+
+int scgi_pipe_send( scgi_desc *d, char *buf, int len )
+{
+  scgi_pipe *pp = (scgi_pipe *) d->transport_data;
+
+  if ( !scgi_pipe_append( &pp->out, &pp->out_len, &pp->out_read, &pp->out_size, buf, len ) )
   {
-    SCGI_CREATE( b, char, len + 1 );
+    errno = ENOMEM;
+    return -1;
   }
 
-  sprintf( b, "Status: 302 Found\n\rLocation: %s\n\rContent-Length: 0\n\r\n\r", address );
-  scgi_send( req, b, len );
+  return len;
+}
+
+void scgi_pipe_hang_up( scgi_desc *d, int reason )
+{
+  scgi_pipe *pp = (scgi_pipe *) d->transport_data;
 
-  if ( b != buf )
-    free( b );
+  pp->desc = NULL;
+  pp->close_reason = reason;
 }
@@ -18,32 +18,154 @@
 
 #include <unistd.h>
 #include <fcntl.h>
+#include <sys/select.h>
+#include <limits.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 typedef struct SCGI_PORT scgi_port;
 typedef struct SCGI_HEADER scgi_header;
 typedef struct SCGI_REQUEST scgi_request;
 typedef struct SCGI_DESC scgi_desc;
+typedef struct SCGI_CONFIG scgi_config;
+typedef struct SCGI_HISTOGRAM scgi_histogram;
+typedef struct SCGI_STATS scgi_stats;
+typedef struct SCGI_TIMINGS scgi_timings;
+typedef struct SCGI_PARAM scgi_param;
+typedef struct SCGI_ARENA_CHUNK scgi_arena_chunk;
+typedef struct SCGI_CACHE_ENTRY scgi_cache_entry;
+typedef struct SCGI_STATIC_RESPONSE scgi_static_response;
+typedef struct SCGI_SLOT scgi_slot;
+typedef struct SCGI_ROUTE scgi_route;
+typedef struct SCGI_ROUTE_NODE scgi_route_node;
+typedef struct SCGI_TRANSPORT scgi_transport;
+typedef struct SCGI_PIPE scgi_pipe;
+typedef struct SCGI_LINGERER scgi_lingerer;
+typedef struct SCGI_CANNED scgi_canned;
+
+/*
+ * A reference to a request which can safely outlive it (see scgi_request_handle)
+ */
+typedef unsigned long long scgi_handle;
 
 #if !defined(FNDELAY)
 #define FNDELAY O_NDELAY
 #endif
 
 /*
- * If a browser connects, but doesn't do anything, how long until kicking them off
- * (See also the next comment below)
+ * The following limits are only defaults.  Each port carries its own scgi_config
+ * (see below) which starts out with these values and can be changed per port,
+ * either when the port is opened or at any time afterwards.
+ */
+
+/*
+ * If a browser connects, but doesn't do anything, how long until kicking them off.
+ * (Only time spent waiting on them counts: not while their request waits in the queue,
+ *  or for your program to answer it.)
  */
 #define SCGI_KICK_IDLE_AFTER_X_SECS 60
 
 /*
- * How many times, per second, will your main project be checking for new connections?
- * (Rather than keep track of the exact time a client is idle, rather we keep track of
- *  the number of times we've checked for updates and found none.  When the client has
- *  been idle for SCGI_KICK_IDLE_AFTER_X_SECS * SCGI_PULSE_PER_SEC consecutive checks,
- *  they will be booted.  SCGI_PULSES_PER_SEC is not used anywhere else.  Thus, it is
- *  not terribly important that it be completely precise, a ballpark estimate is good
- *  enough.
+ * If a request takes longer than this (from accepting the connection until closing it),
+ * write a line to stderr saying where the time went.  0 means don't bother.
+ */
+#define SCGI_LOG_SLOW_REQUESTS_AFTER_X_MSECS 0
+
+/*
+ * Admission control.  Once a port has SCGI_MAX_CONNECTIONS_PER_PORT connections open, or
+ * SCGI_MAX_UNRECVED_REQUESTS_PER_PORT parsed requests waiting for scgi_recv, further requests
+ * are answered straight away with "503 Service Unavailable" (telling them to retry after
+ * SCGI_RETRY_AFTER_SECS seconds) instead of piling up.  0 means no limit.
+ * See also scgi_set_shed_hook.
+ */
+#define SCGI_MAX_CONNECTIONS_PER_PORT 0
+#define SCGI_MAX_UNRECVED_REQUESTS_PER_PORT 0
+#define SCGI_RETRY_AFTER_SECS 1
+
+/*
+ * Protection against clients which take their sweet time sending a request (on purpose, like
+ * "slowloris" attacks, or not), tying up connections.  They get kicked off if:
+ * - their headers haven't all arrived SCGI_HEADER_TIMEOUT_MSECS after they connected,
+ * - their body hasn't all arrived SCGI_BODY_TIMEOUT_MSECS after their headers did, or
+ * - they've sent less than SCGI_MIN_BYTES_PER_SEC bytes per second since they connected
+ *   (not counting the first SCGI_RATE_GRACE_MSECS).
+ * 0 means no limit.  (See also SCGI_KICK_IDLE_AFTER_X_SECS, which only catches clients which
+ * send nothing at all for a while.)
+ */
+#define SCGI_HEADER_TIMEOUT_MSECS 30000
+#define SCGI_BODY_TIMEOUT_MSECS 0
+#define SCGI_MIN_BYTES_PER_SEC 0
+#define SCGI_RATE_GRACE_MSECS 1000
+
+/*
+ * Requests which have waited longer than SCGI_QUEUE_DEADLINE_MSECS for scgi_recv are thrown away
+ * instead of being handed to you: by then, the webserver has probably given up on them anyway.
+ * If SCGI_ANSWER_EXPIRED_WITH_504 is nonzero, they get a "504 Gateway Timeout", otherwise the
+ * connection is simply closed.  A deadline of 0 means requests wait as long as it takes.
+ */
+#define SCGI_QUEUE_DEADLINE_MSECS 0
+#define SCGI_ANSWER_EXPIRED_WITH_504 1
+
+/*
+ * The response cache (see scgi_cache_insert) holds at most SCGI_CACHE_BUDGET bytes of responses
+ * (0 = no cache), in a hash table with SCGI_CACHE_BUCKETS buckets.
+ */
+#define SCGI_CACHE_BUDGET 0
+#define SCGI_CACHE_BUCKETS 1024
+
+/*
+ * Connections' input and output buffers and requests' arenas, over all ports, may use at most
+ * SCGI_MEMORY_HARD_LIMIT bytes (0 = no limit): past that, new connections are turned away (503)
+ * and connections whose buffers or arenas need to grow are dropped.  Past SCGI_MEMORY_SOFT_LIMIT
+ * bytes (0 = no limit), requests which say they're bigger than SCGI_MEMORY_LARGE_REQUEST get a 503 instead.
+ * See scgi_set_memory_budget.
+ */
+#define SCGI_MEMORY_SOFT_LIMIT 0
+#define SCGI_MEMORY_HARD_LIMIT 0
+#define SCGI_MEMORY_LARGE_REQUEST 16384
+
+/*
+ * When building a response (see scgi_resp_status etc.), this much room is left at the start of the
+ * output buffer for the Content-Length header, which isn't known until the end:
+ * "Content-Length: " plus up to 10 digits plus "\r\n".
+ */
+#define SCGI_CONTENT_LENGTH_ROOM 28
+
+/*
+ * Room for a canned response which a port sends straight from the event loop (e.g. the 503)
+ */
+#define SCGI_CANNED_RESPONSE_SIZE 256
+
+/*
+ * Connections live in a table indexed by socket, which is allocated once (when the first port is
+ * opened) with room for every socket the process may open (RLIMIT_NOFILE), but no more than
+ * SCGI_MAX_SOCKET_SLOTS, plus SCGI_VIRTUAL_SLOTS for connections which don't have a socket of their
+ * own (e.g. bench/parsebench's, or in-memory pipes: see scgi_pipe_connect).  The table is never
+ * reallocated.  The event loop watches sockets with select, which can't handle a socket numbered
+ * FD_SETSIZE or higher, so that's as far as the table goes: callers on sockets beyond it get a 503.
+ */
+#define SCGI_MAX_SOCKET_SLOTS FD_SETSIZE
+#define SCGI_VIRTUAL_SLOTS 4096
+
+/*
+ * Callers a port turns away without taking them on (see scgi_turn_away_caller) get the 503 and a
+ * half-close, and then up to SCGI_MAX_LINGERING of them per port are kept until they hang up (but
+ * for no more than SCGI_LINGER_SECS), while whatever they send is read and thrown away.
+ */
+#define SCGI_MAX_LINGERING 64
+#define SCGI_LINGER_SECS 5
+
+/*
+ * Capture files (see scgi_capture_start) begin with SCGI_CAPTURE_MAGIC, followed by one record per
+ * chunk of input as recv handed it to us: connection number, microseconds since the previous record,
+ * and length, each as a varint (7 bits per byte, low bits first, high bit set on all but the last
+ * byte), then the bytes themselves.  Connections are numbered in the order they first send
+ * something.  bench/scgireplay plays them back.
  */
-#define SCGI_PULSES_PER_SEC 10
+#define SCGI_CAPTURE_MAGIC "SCGICAP1"
+#define SCGI_CAPTURE_MAGIC_LEN 8
 
 /*
  * Different states of a client.
@@ -52,12 +174,11 @@ typedef struct SCGI_DESC scgi_desc;
 #define SCGI_SOCKSTATE_WRITING_RESPONSE 1
 
 /*
- * How many bytes of memory to initially allocate for I/O buffers when a client connects.
- * (These will automatically grow when/if the client sends a bigger amount of input or
- * SCGI C Library responds with a bigger amount of output)
+ * How many bytes of memory to initially allocate for the output buffer when a client connects.
+ * (This will automatically grow when/if SCGI C Library responds with a bigger amount of output.
+ * Input buffers are sized to fit, see SCGI_SCRATCH_SIZE.)
  */
 #define SCGI_INITIAL_OUTBUF_SIZE 16384
-#define SCGI_INITIAL_INBUF_SIZE 16384
 
 /*
  * Upper limits on the size of I/O buffers.  If they send more data than this,
@@ -66,6 +187,19 @@ typedef struct SCGI_DESC scgi_desc;
 #define SCGI_MAX_INBUF_SIZE 131072
 #define SCGI_MAX_OUTBUF_SIZE 524288
 
+/*
+ * Input is read into one scratch buffer, shared by all connections, this big.  A connection only
+ * gets an input buffer of its own when its request arrives in more than one piece (and then it's
+ * sized to fit the request).
+ */
+#define SCGI_SCRATCH_SIZE 65536
+
+/*
+ * The most digits we'll read of the length at the start of a request.  max_inbuf_size is an int,
+ * so anything longer is too big for us anyway.
+ */
+#define SCGI_MAX_LENGTH_DIGITS 10
+
 /*
  * If multiple clients simultaneously attempt to connect, how many connections should SCGI C Library
  * accept at once?  Additional simultaneous connections beyond this limit will have to wait
@@ -73,13 +207,26 @@ typedef struct SCGI_DESC scgi_desc;
  */
 #define SCGI_LISTEN_BACKLOG_PER_PORT 32
 
+/*
+ * Each request's memory comes out of an arena (see scgi_arena_add_chunk in scgilib.c).
+ * SCGI_ARENA_SPARE is how much room to leave in it beyond what the headers need,
+ * and SCGI_ARENA_ALIGN is the alignment of scgi_req_alloc'd memory.
+ */
+#define SCGI_ARENA_SPARE 1024
+#define SCGI_ARENA_ALIGN 16
+
+/*
+ * How many buckets in each latency histogram (see struct SCGI_HISTOGRAM)
+ */
+#define SCGI_HISTOGRAM_BUCKETS 32
+
 /*
  * Different parts of the SCGI protocol
  */
 typedef enum
 {
   SCGI_PARSE_HEADLENGTH, SCGI_PARSE_HEADNAME, SCGI_PARSE_HEADVAL,
-  SCGI_PARSE_BODY
+  SCGI_PARSE_BODY, SCGI_PARSE_DONE
 } types_of_states_for_the_request_parser;
 
 /*
@@ -92,6 +239,62 @@ typedef enum
   SCGI_METHOD_GET, SCGI_METHOD_POST, SCGI_METHOD_HEAD
 } types_of_methods_for_http_protocol;
 
+/*
+ * Reasons why a connection was closed (see scgi_kill_socket and scgi_set_close_hook)
+ */
+typedef enum
+{
+  SCGI_CLOSE_COMPLETED,		// we sent the whole response, everything went fine
+  SCGI_CLOSE_EXCEPTION,		// the socket raised an exception
+  SCGI_CLOSE_IDLE,		// they sat there doing nothing for too long
+  SCGI_CLOSE_BAD_NETSTRING,	// what they sent wasn't a valid SCGI netstring
+  SCGI_CLOSE_BAD_HEADER,	// malformed headers (empty header name, bad CONTENT_LENGTH, etc.)
+  SCGI_CLOSE_NO_SCGI_HEADER,	// they didn't send the mandatory "SCGI" header with value 1
+  SCGI_CLOSE_INBUF_OVERFLOW,	// their request was too big for the input buffer limit
+  SCGI_CLOSE_OUTBUF_OVERFLOW,	// our response was too big for the output buffer limit
+  SCGI_CLOSE_OUT_OF_RAM,	// we couldn't allocate memory for them
+  SCGI_CLOSE_EOF,		// they hung up on us
+  SCGI_CLOSE_RECV_ERROR,	// recv failed
+  SCGI_CLOSE_SEND_ERROR,	// send failed
+  SCGI_CLOSE_SHED,		// we were too busy, so we sent them a 503
+  SCGI_CLOSE_EXPIRED,		// their request waited past the port's queue deadline
+  SCGI_CLOSE_HEADER_TIMEOUT,	// their headers took too long to arrive
+  SCGI_CLOSE_BODY_TIMEOUT,	// their body took too long to arrive
+  SCGI_CLOSE_TOO_SLOW,		// they sent their request slower than the minimum data rate
+  SCGI_CLOSE_MEMORY_BUDGET,	// connection buffers were using too much memory (see scgi_set_memory_budget)
+  SCGI_CLOSE_REASONS		// (not a reason, just the number of reasons)
+} types_of_reasons_for_closing_a_connection;
+
+/*
+ * Different orders in which scgi_recv can hand out waiting requests (see scgi_set_queue_policy)
+ */
+typedef enum
+{
+  SCGI_QUEUE_FIFO,		// oldest first (the default)
+  SCGI_QUEUE_LIFO,		// newest first
+  SCGI_QUEUE_PRIORITY		// highest priority first (see scgi_set_priority_hook), oldest first among equals
+} types_of_policies_for_the_request_queue;
+
+/*
+ * How a route's path has to match a request's URI (see scgi_add_route)
+ */
+typedef enum
+{
+  SCGI_ROUTE_EXACT,		// the URI (up to any '?') is exactly the path
+  SCGI_ROUTE_PREFIX		// the URI starts with the path
+} types_of_route_matches;
+
+/*
+ * The responses a port sends straight from the event loop (see scgi_prepare_canned_responses)
+ */
+typedef enum
+{
+  SCGI_CANNED_BUSY,		// 503 Service Unavailable
+  SCGI_CANNED_EXPIRED,		// 504 Gateway Timeout
+  SCGI_CANNED_NOT_FOUND,	// 404 Not Found
+  SCGI_CANNED_RESPONSES		// (not a response, just the number of them)
+} types_of_canned_responses;
+
 /*
  * Macros for handling generic doubly-linked lists
  */
@@ -138,6 +341,201 @@ do                                              \
    }                                            \
 } while (0)
 
+/*
+ * Runtime configuration for a port.  Fill one in with scgi_config_defaults, change whatever
+ * you like, then pass it to scgi_initialize_with_config (or to scgi_set_config for a port which
+ * is already open).  Each port keeps its own copy, so e.g. an upload port can have big buffers
+ * and patient timeouts while an API port on the same server has small buffers and short ones.
+ */
+struct SCGI_CONFIG
+{
+  int initial_outbuf_size;	// how many bytes to initially allocate for a connection's output buffer
+  int max_inbuf_size;		// if they send more than this, kill the connection
+  int max_outbuf_size;		// if we'd need more than this to store our output, kill the connection
+  int kick_idle_after_x_secs;	// how long a connection may sit idle before being kicked off
+  int log_slow_requests_after_x_msecs;	// log requests which take longer than this (0 = never)
+  int max_connections;		// turn away new connections (with a 503) beyond this many (0 = no limit)
+  int max_unrecved_requests;	// turn away new requests (with a 503) while this many are waiting for scgi_recv (0 = no limit)
+  int retry_after_secs;		// how long the 503 tells them to wait before trying again
+  int queue_deadline_msecs;	// throw away requests which have waited longer than this for scgi_recv (0 = never)
+  int answer_expired_with_504;	// whether thrown-away requests get a 504 (otherwise they're just closed)
+  int header_timeout_msecs;	// kick them off if their headers take longer than this to arrive (0 = no limit)
+  int body_timeout_msecs;	// kick them off if their body takes longer than this to arrive (0 = no limit)
+  int min_bytes_per_sec;	// kick them off if they send their request slower than this (0 = no limit)
+};
+
+/*
+ * Latency histogram with logarithmic buckets.
+ * buckets[0] counts samples under 1 microsecond, and buckets[i] counts samples of at least
+ * 2^(i-1) but less than 2^i microseconds.  The last bucket also catches anything bigger.
+ */
+struct SCGI_HISTOGRAM
+{
+  unsigned long long count;	// how many samples
+  unsigned long long sum_usecs;	// sum of all samples, in microseconds
+  unsigned long long buckets[SCGI_HISTOGRAM_BUCKETS];
+};
+
+/*
+ * Counters, gauges and histograms describing what the library has been up to.
+ * Each port keeps its own; see scgi_stats_snapshot and scgi_port_stats_snapshot.
+ */
+struct SCGI_STATS
+{
+  /*
+   * Counters (only ever go up)
+   */
+  unsigned long long connections_accepted;
+  unsigned long long connections_closed;
+  unsigned long long requests_parsed;	// requests which were successfully parsed
+  unsigned long long requests_recved;	// requests handed to you by scgi_recv
+  unsigned long long responses_flushed;	// responses which were transmitted in full
+  unsigned long long bytes_read;
+  unsigned long long bytes_written;
+  unsigned long long buffer_resizes;	// how many times resize_buffer had to grow a buffer
+  unsigned long long requests_expired;	// requests thrown away for waiting past the queue deadline
+  unsigned long long cache_hits;	// GET/HEAD requests answered from the response cache
+  unsigned long long cache_misses;	// GET/HEAD requests the response cache couldn't answer
+  unsigned long long static_hits;	// GET/HEAD requests answered with a static response
+  unsigned long long requests_routed;	// requests passed to a route's handler (see scgi_add_route)
+  unsigned long long requests_not_found;	// requests which matched no route, and got a 404
+  unsigned long long closed_by_reason[SCGI_CLOSE_REASONS];	// connections closed, by SCGI_CLOSE_* reason
+  /*
+   * Gauges (current values)
+   */
+  long open_connections;
+  long unrecved_requests;		// parsed requests waiting for scgi_recv
+  /*
+   * Histograms
+   */
+  scgi_histogram parse_time;		// from a connection's first byte until its request is parsed
+  scgi_histogram total_time;		// from accepting a connection until its response is flushed
+};
+
+/*
+ * A name=value pair from the query string or the cookies (see scgi_query_param and scgi_cookie).
+ * These point straight into the original string, so they are NOT \0-terminated.
+ */
+struct SCGI_PARAM
+{
+  char *name;
+  char *value;
+  int namelen;
+  int valuelen;
+  char name_escaped;		// whether the name contains anything to decode ('%', or '+' in a query string), so it's compared as decoded
+  char escaped;			// whether the value contains anything to decode, and hasn't been decoded yet
+};
+
+/*
+ * A chunk of a request's arena.  The memory handed out follows right after this structure
+ * (at offset SCGI_ARENA_HEADER_SIZE, to keep it aligned).
+ */
+struct SCGI_ARENA_CHUNK
+{
+  scgi_arena_chunk *next;
+  int size;			// how many bytes of memory follow
+  int used;			// how many of them have been handed out
+};
+
+#define SCGI_ARENA_HEADER_SIZE ( ( sizeof(scgi_arena_chunk) + SCGI_ARENA_ALIGN - 1 ) & ~( SCGI_ARENA_ALIGN - 1 ) )
+
+/*
+ * The most a chunk can hold (so that its size, plus its header, still fits in an int)
+ */
+#define SCGI_ARENA_MAX_CHUNK ( INT_MAX - (int) SCGI_ARENA_HEADER_SIZE )
+
+/*
+ * When things happened to a connection, in microseconds according to scgi_now_usecs.
+ * A field is 0 if the thing hasn't happened (yet).
+ */
+struct SCGI_TIMINGS
+{
+  long long accepted;		// we accepted the connection
+  long long first_byte;		// their first byte arrived
+  long long headers_done;	// we finished parsing their headers
+  long long body_done;		// we finished reading their body
+  long long queued;		// the request joined the queue for scgi_recv
+  long long recved;		// scgi_recv handed the request to you
+  long long sent;		// you called scgi_send (or scgi_write)
+  long long flushed;		// the last byte of the response was sent
+  long long closed;		// the connection was closed
+};
+
+/*
+ * A response in the response cache (see scgi_cache_insert)
+ */
+struct SCGI_CACHE_ENTRY
+{
+  scgi_cache_entry *next_in_bucket;	// other entries whose keys hash to the same bucket
+  scgi_cache_entry *next_lru;	// doubly-linked list, least recently used first
+  scgi_cache_entry *prev_lru;
+  unsigned int hash;
+  char *key;			// host, uri and query string, separated by \0's
+  int keylen;
+  char *response;		// the whole response, headers and body, exactly as it was sent
+  int len;
+  int headers_len;		// how much of the response is headers (which is all a HEAD request gets)
+  long long expires;		// when (scgi_now_usecs) the entry goes stale
+  int cost;			// how much of the cache budget the entry uses
+};
+
+/*
+ * One variant (one content encoding) of a static response (see scgi_add_static_response)
+ */
+struct SCGI_STATIC_RESPONSE
+{
+  scgi_static_response *next;
+  unsigned int hash;		// scgi_hash of the uri
+  char *uri;
+  char *encoding;		// "identity", "gzip", "br", etc.
+  char *response;		// the whole response, headers and body, ready to go
+  int len;
+  int headers_len;		// how much of the response is headers (which is all a HEAD request gets)
+};
+
+/*
+ * Function type for a route's handler (see scgi_add_route)
+ */
+typedef void scgi_route_handler( scgi_request *req, void *arg );
+
+/*
+ * A route (see scgi_add_route)
+ */
+struct SCGI_ROUTE
+{
+  char *key;			// the host (lowercased, if the route has one) followed by the path, e.g. "example.com/api/"
+  int match;			// SCGI_ROUTE_EXACT or SCGI_ROUTE_PREFIX
+  scgi_route_handler *handler;	// NULL to queue matching requests for scgi_recv as usual
+  void *arg;			// passed along to the handler
+};
+
+/*
+ * A state of the compiled routes (a trie of their keys).  Its children are the edge_count entries
+ * of scgi_route_edge_bytes (and scgi_route_edge_nodes) starting at first_edge, sorted by byte.
+ */
+struct SCGI_ROUTE_NODE
+{
+  int first_edge;
+  int edge_count;
+  int exact;			// the route whose key ends here, exactly, or -1
+  int prefix;			// the route whose key ends here, as a prefix, or -1
+};
+
+/*
+ * Function type for the hook which scgi_set_close_hook installs
+ */
+typedef void scgi_close_hook( scgi_request *req, int reason, scgi_timings *timings );
+
+/*
+ * Function type for the hook which scgi_set_shed_hook installs
+ */
+typedef int scgi_shed_hook( scgi_request *req );
+
+/*
+ * Function type for the hook which scgi_set_priority_hook installs
+ */
+typedef int scgi_priority_hook( scgi_request *req );
+
 /*
  * Data structure for a port -- SCGI C Library can listen on multiple ports simultaneously
  */
@@ -145,10 +543,33 @@ struct SCGI_PORT
 {
   scgi_port *next;
   scgi_port *prev;
-  scgi_desc *first_scgi_desc;	// first descriptor, i.e. connection (in a doubly-linked list)
-  scgi_desc *last_scgi_desc;	// last descriptor, i.e. connection (in a doubly-linked list)
   int port;			// port number
   int sock;			// socket number for listening on this port
+  scgi_config config;		// this port's limits and timeouts
+  scgi_stats stats;		// what's been happening on this port
+  scgi_canned *canned;		// the responses it sends straight from the event loop, ready to go
+  scgi_lingerer *lingering;	// callers it's turned away, which haven't hung up yet (see scgi_turn_away_caller)
+  int lingering_count;
+};
+
+/*
+ * A caller who's been turned away, but whose socket we're keeping until they hang up
+ */
+struct SCGI_LINGERER
+{
+  int sock;
+  long long since;		// when they were turned away (see scgi_now_usecs)
+};
+
+/*
+ * A port's canned responses.  Connections send these by reference, so when the port's config
+ * changes, it gets a new set, and the old one stays put until the last connection using it is done.
+ */
+struct SCGI_CANNED
+{
+  int users;			// how many connections are sending one of these right now
+  char response[SCGI_CANNED_RESPONSES][SCGI_CANNED_RESPONSE_SIZE];	// indexed by SCGI_CANNED_*
+  int len[SCGI_CANNED_RESPONSES];
 };
 
 /*
@@ -160,6 +581,7 @@ struct SCGI_HEADER
   scgi_header *prev;
   char *name;			// name of the header
   char *value;			// value of the header
+  unsigned int hash;		// hash of the name (filled in when the request's header index is built)
 };
 
 /*
@@ -168,19 +590,29 @@ struct SCGI_HEADER
  */
 struct SCGI_REQUEST
 {
-  scgi_request *next;
-  scgi_request *prev;
   scgi_request *next_unrecved;
   scgi_request *prev_unrecved;
   scgi_desc *descriptor;	// info about the connection
   scgi_header *first_header;	// doubly-linked list of request headers
   scgi_header *last_header;
+  scgi_header **header_index;	// hash table of the headers, built by the first scgi_get_header
+  int header_index_size;
   char *body;			// request body
   int scgi_content_length;	// length of the request body
   char scgi_scgiheader;		// whether or not the request included the "SCGI" header
-  int *dead;			// pointer to an int which SCGI C Library can use to specify whether a connection is dead (see documentation for details)
+  int *dead;			// (deprecated, use scgi_request_handle) pointer to an int which SCGI C Library sets to 1 when the request is freed
   int request_method;		// type of request (SCGI_METHOD_GET, SCGI_METHOD_POST, SCGI_METHOD_HEAD, or SCGI_METHOD_UNKNOWN)
   char *http_host;		// which host name are they connecting to (in principle, with this, you can have one program serve multiple domain names)
+  scgi_timings timings;		// when things happened to this request's connection
+  scgi_param *query_params;	// query string split into name/value pairs, by the first scgi_query_param
+  int query_param_count;	// (-1 until then)
+  scgi_param *cookies;		// cookies split into name/value pairs, by the first scgi_cookie
+  int cookie_count;		// (-1 until then)
+  char *decoded;		// storage for query parameters and cookies which had to be %-decoded
+  int decoded_len;
+  scgi_arena_chunk *arena;	// memory for everything about this request (see scgi_req_alloc)
+  int priority;			// what the priority hook said about this request when it was queued (see scgi_set_priority_hook)
+  void *userdata;		// yours to use, NULL to begin with (but if you use scgilib.hpp, it's using it)
   /*
    * The remaining fields are some individual headers that might be sent
    */
@@ -205,20 +637,30 @@ struct SCGI_REQUEST
  */
 struct SCGI_DESC
 {
-  scgi_desc *next;
-  scgi_desc *prev;
   scgi_port *port;		//which port are they connected to
   scgi_request *req;		//info about the request they are sending
   int sock;			//which socket they're bound to
-  char *buf;			//input buffer for the data they're sending us
+  char *buf;			//input buffer for the data they're sending us (NULL unless their request arrived in pieces)
   int bufsize;			//how much space we've allocated so far for the data they're sending us
   int buflen;			//how much data they've sent us so far
+  int buf_borrowed;		//whether buf is really someone else's (the scratch buffer), just while it's being parsed
   char *outbuf;			//output buffer for data we're going to send them
   int outbufsize;		//how much space we've allocated for outbuf so far
   int outbuflen;		//how long outbuf has become so far
-  int idle;			//how many times we checked the connection for new data and found it idle
+  long long last_active;		//when they last sent us something or took some of our response (see scgi_now_usecs)
+  long bytes_received;		//how many bytes they've sent us
+  unsigned long capture_id;	//which connection this is in the capture file (0 if it isn't in it yet)
+  scgi_transport *transport;	//how to reach them if they aren't on a socket (NULL if they are; see scgi_connect_transport)
+  void *transport_data;		//the transport's own info about the connection
+  scgi_canned *canned;		//if we're sending one of the port's canned responses, the set it's from
+  int discarding;		//whether we've turned them away mid-request (see scgi_keep_input), so the rest of it just gets read and thrown away
+  scgi_route *route;		//the route whose handler their request is to be given, once the parser is done with the connection (see scgi_dispatch_route)
   int state;			//which state is this connection in
+  int close_reason;		//why we'll say the connection closed once the response is sent (normally SCGI_CLOSE_COMPLETED)
   char *writehead;		//pointer to the end of the data currently stored in outbuf
+  int building;			//whether a response is being built in outbuf (see scgi_resp_status etc.); if so, don't send it yet
+  int build_failed;		//if the response being built outgrew max_outbuf_size (or RAM), the SCGI_CLOSE_* reason why
+  int body_starts;		//where the body of the response being built starts in outbuf (0 = still doing headers)
   /*
    * The remaining fields are technical fields used by the parser
    */
@@ -229,14 +671,67 @@ struct SCGI_DESC
   int parser_state;
 };
 
+/*
+ * A way for connections to reach us other than a socket (see scgi_connect_transport).
+ * Each function is handed the connection, and works like the system call it's named after.
+ */
+struct SCGI_TRANSPORT
+{
+  int (*readable)( scgi_desc *d );			// whether recv would return something (bytes, or 0 at the end) right now
+  int (*recv)( scgi_desc *d, char *buf, int len );	// bytes read, 0 if they're done sending, -1 with errno set (EAGAIN: nothing yet)
+  int (*send)( scgi_desc *d, char *buf, int len );	// bytes sent, -1 with errno set (EAGAIN: no room yet)
+  void (*close)( scgi_desc *d, int reason );		// the connection is being closed, for the SCGI_CLOSE_* reason
+};
+
+/*
+ * An in-memory connection (see scgi_pipe_connect): what the client writes into one end, the library
+ * reads from the other, and the other way around
+ */
+struct SCGI_PIPE
+{
+  scgi_desc *desc;		// the library's end (NULL once the library has closed it)
+  int close_reason;		// why the library closed it (SCGI_CLOSE_*), or -1 if it hasn't
+  int shut;			// whether the client is done writing (see scgi_pipe_shutdown)
+  char *in;			// what the client has written and the library hasn't read yet
+  int in_len;
+  int in_read;
+  int in_size;
+  char *out;			// what the library has sent and the client hasn't read yet
+  int out_len;
+  int out_read;
+  int out_size;
+};
+
+/*
+ * A slot's generation is read by scgi_handle_alive, which may be called from other threads, so it's
+ * atomic.  (C++ code never touches the connection table directly, only through those functions,
+ * and _Atomic isn't C++, so there it's declared plain: the two have the same size and alignment.)
+ */
+#ifdef __cplusplus
+#define SCGI_ATOMIC
+#else
+#define SCGI_ATOMIC _Atomic
+#endif
+
+/*
+ * A slot in the connection table
+ */
+struct SCGI_SLOT
+{
+  scgi_desc desc;		// the connection in this slot (if in_use)
+  SCGI_ATOMIC unsigned int generation;	// goes up every time a connection leaves the slot, so old handles stop matching
+  int in_use;
+};
+
 /*
  * Global variables from scgilib.c
  */
 extern scgi_port *first_scgi_port;	// doubly-linked list of ports for SCGI C Library to listen on
 extern scgi_port *last_scgi_port;
 
-extern scgi_request *first_scgi_req;	// doubly-linked list of SCGI requests awaiting response
-extern scgi_request *last_scgi_req;
+extern scgi_slot *scgi_slots;		// the connection table (see SCGI_MAX_SOCKET_SLOTS)
+extern int scgi_top_slot;		// one past the highest socket's slot in use
+extern int scgi_top_virtual_slot;	// one past the highest slot in use by a connection without a socket
 
 extern fd_set scgi_inset;		// socket programming stuff
 extern fd_set scgi_outset;
@@ -247,16 +742,69 @@ extern fd_set scgi_excset;
  */
 void scgi_update_connections_port( scgi_port *p );
 void scgi_update_connections( void );
-void scgi_kill_socket( scgi_desc *d );
+void scgi_kill_socket( scgi_desc *d, int reason );
 void free_scgi_request( scgi_request *r );
 void scgi_flush_response( scgi_desc *d );
 void scgi_listen_to_request( scgi_desc *d );
 void scgi_answer_the_phone( scgi_port *p );
+scgi_desc *scgi_new_connection( scgi_port *p, int sock );
 void scgi_perror( char *txt );
 int scgi_initialize(int port);
+int scgi_initialize_with_config( int port, scgi_config *cfg );
+int scgi_initialize_loopback( int port, scgi_config *cfg );
+scgi_desc *scgi_connect_transport( int port, scgi_transport *transport, void *data );
+scgi_pipe *scgi_pipe_connect( int port );
+int scgi_pipe_write( scgi_pipe *pp, char *data, int len );
+void scgi_pipe_shutdown( scgi_pipe *pp );
+int scgi_pipe_read( scgi_pipe *pp, char *buf, int len );
+void scgi_pipe_close( scgi_pipe *pp );
+void scgi_config_defaults( scgi_config *cfg );
+int scgi_get_config( int port, scgi_config *cfg );
+int scgi_set_config( int port, scgi_config *cfg );
+scgi_port *scgi_find_port( int port );
+long long scgi_now_usecs( void );
+void scgi_histogram_record( scgi_histogram *h, long long usecs );
+void scgi_stats_snapshot( scgi_stats *out );
+int scgi_port_stats_snapshot( int port, scgi_stats *out );
+void scgi_set_close_hook( scgi_close_hook *hook );
+const char *scgi_close_reason_name( int reason );
+void scgi_set_shed_hook( scgi_shed_hook *hook );
+void scgi_respond_from_loop( scgi_desc *d, char *txt, int len, int reason );
+int scgi_set_queue_policy( int policy, int pressure );
+int scgi_cache_insert( scgi_request *req, char *response, int len, int ttl_msecs );
+int scgi_cache_invalidate( char *host, char *uri, char *query );
+void scgi_cache_set_budget( long budget );
+int scgi_set_memory_budget( long soft_limit, long hard_limit );
+long scgi_memory_in_use( void );
+int scgi_add_static_response( char *uri, char *content_type, char *encoding, char *body, int len );
+int scgi_add_route( char *host, char *path, int match, scgi_route_handler *handler, void *arg );
+void scgi_clear_routes( void );
+int scgi_prefork( int workers );
+int scgi_capture_start( char *filename );
+void scgi_capture_stop( void );
+scgi_handle scgi_request_handle( scgi_request *req );
+scgi_request *scgi_handle_lookup( scgi_handle h );
+int scgi_handle_alive( scgi_handle h );
+void scgi_set_priority_hook( scgi_priority_hook *hook );
+
+/*
+ * scgi_send and scgi_write return 0 if the response couldn't be taken on.  If that's for want of
+ * RAM, nothing has been sent and the request is still yours; but if it's the memory budget (see
+ * scgi_set_memory_budget), the library has answered with a 503 instead and the request is finished.
+ */
 int scgi_send( scgi_request *req, char *txt, int len );
 int scgi_write( scgi_request *req, char *txt );
+void scgi_302_redirect( scgi_request *req, char *address );
+int scgi_resp_status( scgi_request *req, int code, char *reason );
+int scgi_resp_header( scgi_request *req, char *name, char *value );
+int scgi_resp_printf( scgi_request *req, char *fmt, ... );
+int scgi_resp_body( scgi_request *req, char *body, int len );
+char *scgi_get_header( scgi_request *req, char *name );
+char *scgi_query_param( scgi_request *req, char *name, int *len );
+char *scgi_cookie( scgi_request *req, char *name, int *len );
+void *scgi_req_alloc( scgi_request *req, int size );
 scgi_request *scgi_recv( void );
+int scgi_recv_batch( scgi_request **out, int max, int timeout_ms );
 
 /*
  * Memory allocation macro
@@ -271,4 +819,8 @@ do									\
    }									\
 } while(0)
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif //ends the "#ifdef SCGILIB_H" from the beginning of the file
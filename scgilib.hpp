@@ -0,0 +1,492 @@
+/*
+ *  SCGI C Library
+ *
+ *  scgilib.hpp - C++20 coroutine front-end for the SCGI C Library
+ *
+ *  Instructions:  #include this file (C++20 or later) instead of scgilib.h, and compile scgilib.c
+ *                 as C alongside your project, as usual.  Then write each request's handling as a
+ *                 coroutine:
+ *
+ *                   scgi::task serve( scgi::server &server )
+ *                   {
+ *                     for ( ; ; )
+ *                     {
+ *                       scgi::request req = co_await server.accept();
+ *                       co_await req.send( "Status: 200 OK\r\n\r\nHello World!" );
+ *                     }
+ *                   }
+ *
+ *                 start as many of those as you like, and call server.run().  See helloworld.cpp.
+ *
+ *  Everything runs on the thread which calls server.run(), driven by the library's event loop:
+ *  server.accept() takes a request from scgi_recv_batch, but only as many as there are coroutines
+ *  waiting for one, and req.send() hands the response to scgi_send and resumes the coroutine
+ *  once the connection is closed (it's told by the close hook).  Coroutine frames come from a
+ *  pool which is reused from one request to the next, so once things warm up, nothing is
+ *  allocated per request beyond what the C library itself allocates.
+ *
+ *  This layer installs its own close hook (see scgi::server::set_close_hook to chain yours) and
+ *  uses each request's userdata.
+ *
+ *  Copyright/license:  MIT
+ */
+
+#ifndef SCGILIB_HPP
+#define SCGILIB_HPP
+
+#include "scgilib.h"
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <string_view>
+
+namespace scgi
+{
+  /*
+   * Coroutine frames are recycled through free lists, one per size class (multiples of
+   * frame_pool::granularity bytes, up to frame_pool::largest; anything bigger goes straight to
+   * operator new).  Freed frames are kept for the next coroutine rather than given back.
+   */
+  class frame_pool
+  {
+  public:
+    static constexpr std::size_t granularity = 64;
+    static constexpr std::size_t largest = 4096;
+
+    static void *allocate( std::size_t size )
+    {
+      std::size_t c = size_class( size );
+
+      if ( c >= classes )
+        return ::operator new( size );
+
+      if ( free_frames[c] )
+      {
+        free_frame *f = free_frames[c];
+
+        free_frames[c] = f->next;
+        return f;
+      }
+
+      return ::operator new( ( c + 1 ) * granularity );
+    }
+
+    static void deallocate( void *p, std::size_t size ) noexcept
+    {
+      std::size_t c = size_class( size );
+
+      if ( c >= classes )
+      {
+        ::operator delete( p );
+        return;
+      }
+
+      free_frame *f = static_cast<free_frame *>( p );
+
+      f->next = free_frames[c];
+      free_frames[c] = f;
+    }
+
+  private:
+    struct free_frame
+    {
+      free_frame *next;
+    };
+
+    static constexpr std::size_t classes = largest / granularity;
+
+    static std::size_t size_class( std::size_t size )
+    {
+      return size ? ( size - 1 ) / granularity : 0;
+    }
+
+    static inline free_frame *free_frames[classes];
+  };
+
+  /*
+   * The return type for request-handling coroutines.  They start running as soon as they're
+   * called, and clean up after themselves when they finish; nobody waits for them.
+   */
+  struct task
+  {
+    struct promise_type
+    {
+      task get_return_object() noexcept { return {}; }
+      std::suspend_never initial_suspend() noexcept { return {}; }
+      std::suspend_never final_suspend() noexcept { return {}; }
+      void return_void() noexcept {}
+      void unhandled_exception() noexcept { std::terminate(); }
+
+      static void *operator new( std::size_t size ) { return frame_pool::allocate( size ); }
+      static void operator delete( void *p, std::size_t size ) noexcept { frame_pool::deallocate( p, size ); }
+    };
+  };
+
+  class server;
+  class request;
+
+  namespace detail
+  {
+    /*
+     * Turn one of the library's char * fields into a string_view (empty if it's NULL)
+     */
+    inline std::string_view view( const char *s )
+    {
+      return s ? std::string_view( s ) : std::string_view();
+    }
+
+    /*
+     * Something waiting to be resumed by the event loop, linked into one of the server's lists
+     */
+    struct waiter
+    {
+      std::coroutine_handle<> coroutine;
+      waiter *next = nullptr;
+    };
+
+    struct waiter_list
+    {
+      waiter *first = nullptr;
+      waiter *last = nullptr;
+      int count = 0;
+
+      void push( waiter *w )
+      {
+        w->next = nullptr;
+        if ( last )
+          last->next = w;
+        else
+          first = w;
+        last = w;
+        count++;
+      }
+
+      waiter *pop()
+      {
+        waiter *w = first;
+
+        if ( w )
+        {
+          first = w->next;
+          if ( !first )
+            last = nullptr;
+          count--;
+        }
+
+        return w;
+      }
+    };
+  }
+
+  /*
+   * What co_await req.send( ... ) waits on: the connection closing.  The result says whether
+   * the whole response went out (true), or something went wrong first (false, and
+   * close_reason() says what, or -1 if scgi_send wouldn't take the response; then, if it was
+   * the memory budget that didn't allow it, the library has answered with a 503 instead).
+   */
+  class send_awaiter : public detail::waiter
+  {
+  public:
+    send_awaiter( scgi_request *req, std::string_view response ) : req( req ), response( response ) {}
+
+    bool await_ready() noexcept
+    {
+      if ( !req || !scgi_send( req, const_cast<char *>( response.data() ), static_cast<int>( response.size() ) ) )
+        return true;
+
+      req->userdata = static_cast<detail::waiter *>( this );
+      return false;
+    }
+
+    void await_suspend( std::coroutine_handle<> h ) noexcept
+    {
+      coroutine = h;
+    }
+
+    bool await_resume() const noexcept
+    {
+      return reason == SCGI_CLOSE_COMPLETED;
+    }
+
+    int close_reason() const noexcept
+    {
+      return reason;
+    }
+
+  private:
+    friend class server;
+
+    scgi_request *req;
+    std::string_view response;
+    int reason = -1;
+  };
+
+  /*
+   * Reads a request's body a piece at a time.  This is not streaming: the library only hands out
+   * requests once the whole body has arrived and been buffered (up to max_inbuf_size), so there's
+   * never anything to wait for, and read() is an ordinary call, not something to co_await.  The
+   * pieces are views into the request's own memory, not copies.
+   */
+  class body_reader
+  {
+  public:
+    explicit body_reader( std::string_view body ) : rest( body ) {}
+
+    /*
+     * The next (up to) max bytes of the body; an empty view once it's all been read
+     */
+    std::string_view read( std::size_t max )
+    {
+      std::string_view piece = rest.substr( 0, max );
+
+      rest.remove_prefix( piece.size() );
+      return piece;
+    }
+
+    bool done() const noexcept
+    {
+      return rest.empty();
+    }
+
+  private:
+    std::string_view rest;
+  };
+
+  /*
+   * A request, as handed out by co_await server.accept().  It's only a reference to the library's
+   * scgi_request, which goes away when its connection closes; the string_views it hands out are
+   * good until then.  alive() says whether it's still there; once it isn't, the accessors return
+   * empty views (and method() returns SCGI_METHOD_UNSPECIFIED).
+   */
+  class request
+  {
+  public:
+    request() = default;
+    explicit request( scgi_request *req ) : req( req ), handle( req ? scgi_request_handle( req ) : 0 ) {}
+
+    bool alive() const { return req && scgi_handle_alive( handle ); }
+    scgi_request *c_request() const { return alive() ? req : nullptr; }
+
+    int method() const { return alive() ? req->request_method : SCGI_METHOD_UNSPECIFIED; }
+    std::string_view uri() const { return alive() ? detail::view( req->request_uri ) : std::string_view(); }
+    std::string_view query_string() const { return alive() ? detail::view( req->query_string ) : std::string_view(); }
+    std::string_view host() const { return alive() ? detail::view( req->http_host ) : std::string_view(); }
+    std::string_view user_agent() const { return alive() ? detail::view( req->user_agent ) : std::string_view(); }
+    std::string_view remote_addr() const { return alive() ? detail::view( req->remote_addr ) : std::string_view(); }
+
+    std::string_view header( const char *name ) const
+    {
+      if ( !alive() )
+        return std::string_view();
+
+      return detail::view( scgi_get_header( req, const_cast<char *>( name ) ) );
+    }
+
+    std::string_view query_param( const char *name ) const
+    {
+      int len;
+      char *val;
+
+      if ( !alive() )
+        return std::string_view();
+
+      val = scgi_query_param( req, const_cast<char *>( name ), &len );
+
+      return val ? std::string_view( val, len ) : std::string_view();
+    }
+
+    std::string_view cookie( const char *name ) const
+    {
+      int len;
+      char *val;
+
+      if ( !alive() )
+        return std::string_view();
+
+      val = scgi_cookie( req, const_cast<char *>( name ), &len );
+
+      return val ? std::string_view( val, len ) : std::string_view();
+    }
+
+    std::string_view body() const
+    {
+      if ( !alive() )
+        return std::string_view();
+
+      return req->body && req->scgi_content_length > 0 ? std::string_view( req->body, req->scgi_content_length ) : std::string_view();
+    }
+
+    body_reader body_stream() const
+    {
+      return body_reader( body() );
+    }
+
+    /*
+     * Send the response (the whole thing: status line, headers and body) and wait until the
+     * connection is closed.  Like scgi_send, once per request, and afterwards the request is gone.
+     */
+    send_awaiter send( std::string_view response )
+    {
+      return send_awaiter( c_request(), response );
+    }
+
+  private:
+    scgi_request *req = nullptr;
+    scgi_handle handle = 0;
+  };
+
+  /*
+   * The event loop.  There's only one library, so there should only be one of these, listening
+   * on as many ports as you like.
+   */
+  class server
+  {
+  public:
+    static constexpr int batch_size = 64;
+
+    /*
+     * Listen on a port (more with listen()); check ok() to see whether it worked
+     */
+    explicit server( int port )
+    {
+      current = this;
+      scgi_set_close_hook( &server::closed );
+      listening = scgi_initialize( port ) != 0;
+    }
+
+    ~server()
+    {
+      if ( current == this )
+        current = nullptr;
+    }
+
+    server( const server & ) = delete;
+    server &operator=( const server & ) = delete;
+
+    bool ok() const { return listening; }
+
+    bool listen( int port )
+    {
+      return scgi_initialize( port ) != 0;
+    }
+
+    /*
+     * Your own close hook, called after this layer's
+     */
+    static void set_close_hook( scgi_close_hook *hook )
+    {
+      chained_hook = hook;
+    }
+
+    /*
+     * co_await server.accept() waits for the next request
+     */
+    class accept_awaiter : public detail::waiter
+    {
+    public:
+      explicit accept_awaiter( server &s ) : s( s ) {}
+
+      bool await_ready() const noexcept { return false; }
+
+      void await_suspend( std::coroutine_handle<> h ) noexcept
+      {
+        coroutine = h;
+        s.accepting.push( this );
+      }
+
+      request await_resume() const noexcept
+      {
+        return request( req );
+      }
+
+    private:
+      friend class server;
+
+      server &s;
+      scgi_request *req = nullptr;
+    };
+
+    accept_awaiter accept()
+    {
+      return accept_awaiter( *this );
+    }
+
+    /*
+     * One pass of the event loop: do the library's I/O (waiting up to timeout_ms for something
+     * to happen, unless there are requests ready for coroutines waiting in accept()), then hand
+     * out requests to those coroutines, and resume the ones whose responses are done.
+     */
+    void run_once( int timeout_ms )
+    {
+      scgi_request *batch[batch_size];
+      int count, i;
+
+      count = scgi_recv_batch( batch, accepting.count < batch_size ? accepting.count : batch_size, timeout_ms );
+
+      for ( i = 0; i < count; i++ )
+      {
+        accept_awaiter *a = static_cast<accept_awaiter *>( accepting.pop() );
+
+        a->req = batch[i];
+        a->coroutine.resume();
+      }
+
+      resume_closed();
+    }
+
+    /*
+     * Run the event loop until stop() is called
+     */
+    void run( int timeout_ms = 100 )
+    {
+      stopping = false;
+      while ( !stopping )
+        run_once( timeout_ms );
+    }
+
+    void stop()
+    {
+      stopping = true;
+    }
+
+  private:
+    /*
+     * Our close hook: if a coroutine was waiting for this connection to close, it can go on, but
+     * not until we're out of the library (see resume_closed)
+     */
+    static void closed( scgi_request *req, int reason, scgi_timings *timings )
+    {
+      if ( req->userdata && current )
+      {
+        send_awaiter *s = static_cast<send_awaiter *>( static_cast<detail::waiter *>( req->userdata ) );
+
+        s->reason = reason;
+        s->req = nullptr;
+        req->userdata = nullptr;
+        current->closing.push( s );
+      }
+
+      if ( chained_hook )
+        (*chained_hook)( req, reason, timings );
+    }
+
+    void resume_closed()
+    {
+      detail::waiter *w;
+
+      while ( ( w = closing.pop() ) != nullptr )
+        w->coroutine.resume();
+    }
+
+    detail::waiter_list accepting;
+    detail::waiter_list closing;
+    bool listening = false;
+    bool stopping = false;
+
+    static inline server *current;
+    static inline scgi_close_hook *chained_hook;
+  };
+}
+
+#endif //ends the "#ifdef SCGILIB_HPP" from the beginning of the file